@@ -40,6 +40,13 @@
  * by #asset_fopen will assert on seek, even if the file is not compressed
  * (so that the user code will be ready for adding compression at any time).
  * 
+ * The only exception are files compressed in chunked mode (mkasset --chunk):
+ * they are split into independently compressed blocks, so that the FILE*
+ * returned by #asset_fopen can be freely seeked, at the cost of decompressing
+ * at most one block to reach the requested position. This is useful for
+ * large files accessed randomly (eg: level data or audio banks), at the
+ * expense of a slightly worse compression ratio.
+ * 
  * If you know that the file will never be compressed and you absolutely need
  * to freely seek, simply use the standard fopen() function.
  * 
@@ -66,6 +73,8 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #ifdef N64
 #include "debug.h"
@@ -124,6 +133,78 @@ extern void __asset_init_compression_lvl3(void);
  */
 void *asset_load(const char *fn, int *sz);
 
+/** @brief Handle of an asynchronous asset load (see #asset_load_async) */
+typedef struct asset_loader_s asset_loader_t;
+
+/**
+ * @brief Timing statistics of an asynchronous asset load
+ * 
+ * All values are in CPU ticks (see #TICKS_TO_US to convert them).
+ */
+typedef struct {
+    uint32_t total_ticks;           ///< Time elapsed from #asset_load_async to the end of the load
+    uint32_t cpu_ticks;             ///< Time spent by the CPU within #asset_load_poll
+    uint32_t decompress_ticks;      ///< Time spent decompressing (part of cpu_ticks)
+    int num_polls;                  ///< Number of calls to #asset_load_poll that did some work
+} asset_load_stats_t;
+
+/**
+ * @brief Start loading an asset file asynchronously
+ * 
+ * This is an asynchronous version of #asset_load: the file is loaded
+ * and decompressed in small steps, each one performed by a call to
+ * #asset_load_poll, so that the loading can be spread across multiple
+ * frames without causing hitches.
+ * 
+ * Files in ROM are transferred via PI DMA in background. Files compressed
+ * in chunked mode (mkasset --chunk) benefit the most: each poll decompresses
+ * one block, while the next one is being transferred (double buffering).
+ * Other compressed files are transferred in pieces and then decompressed
+ * in a single step (the last poll), racing with the final DMA transfer.
+ * 
+ * @code{.c}
+ *      asset_loader_t *ld = asset_load_async("rom:/level2.dat");
+ *      while (!asset_load_poll(ld, NULL)) {
+ *          // Keep the game running while the level is being loaded
+ *          render_frame();
+ *      }
+ *      int size;
+ *      void *level = asset_load_wait(ld, &size, NULL);
+ * @endcode
+ * 
+ * @param fn        Filename to load (including filesystem prefix, eg: "rom:/foo.dat")
+ * @return asset_loader_t*  Handle of the load. It must be passed to #asset_load_wait
+ *                          to get the loaded data and release it.
+ */
+asset_loader_t* asset_load_async(const char *fn);
+
+/**
+ * @brief Advance an asynchronous load, without blocking
+ * 
+ * Each call performs a bounded amount of work (a DMA transfer request or the
+ * decompression of one block). If a DMA transfer is still in progress, the
+ * function returns immediately.
+ * 
+ * @param ld        Handle of the load
+ * @param progress  If not NULL, will be filled with the number of bytes of
+ *                  the (uncompressed) file that are available so far
+ * @return true     The load is complete: call #asset_load_wait to get the data
+ * @return false    The load is still in progress
+ */
+bool asset_load_poll(asset_loader_t *ld, int *progress);
+
+/**
+ * @brief Complete an asynchronous load and return the loaded data
+ * 
+ * This function blocks until the load is complete, then releases the handle.
+ * 
+ * @param ld        Handle of the load (invalid after this call)
+ * @param sz        If not NULL, this will be filed with the uncompressed size of the loaded file
+ * @param stats     If not NULL, this will be filled with timing statistics of the load
+ * @return void*    Pointer to the loaded file (must be freed with free() when done)
+ */
+void* asset_load_wait(asset_loader_t *ld, int *sz, asset_load_stats_t *stats);
+
 /**
  * @brief Open an asset file for reading (with transparent decompression)
  * 
@@ -136,6 +217,8 @@ void *asset_load(const char *fn, int *sz);
  * to do efficiently on a compressed file. Seeking forward is supported and is
  * simulated by reading (decompressing) and discarding data. You can rewind
  * the file to the start though, (by using either fseek or rewind).
+ * Files compressed in chunked mode (mkasset --chunk) instead support
+ * arbitrary seeking.
  * 
  * This behavior of the returned file is enforced also for non compressed
  * assets, so that the code is ready to switch to compressed assets if
@@ -18,6 +18,20 @@
 /** @brief Special path value in #directory_entry::path defining the root sector */
 #define ROOT_PATH       "DragonFS 2.0"
 
+/**
+ * @brief File flag (in the same nibble as the file type) marking a file
+ *        compressed by mkdfs in the asset format
+ *
+ * The payload and the size in the directory entry are those of the compressed
+ * data. Files opened via stdio are transparently decompressed, while the
+ * DragonFS API (#dfs_open, #dfs_read, #dfs_rom_addr) accesses the compressed
+ * data as-is.
+ */
+#define FLAGS_COMPRESSED    0x4
+
+/** @brief open() flag to access a compressed file without transparent decompression */
+#define DFS_O_RAW           0x40000000
+
 /** @brief The size of a sector */
 #define SECTOR_SIZE     256
 /** @brief The size of a sector payload */
@@ -41,6 +55,97 @@ _Static_assert(sizeof(struct directory_entry) == SECTOR_SIZE, "invalid directory
 /** @brief Type definition */
 typedef struct directory_entry directory_entry_t;
 
+/** @brief Magic value identifying the path index ("DFSI") */
+#define DFS_INDEX_MAGIC     0x44465349
+/** @brief Current version of the path index */
+#define DFS_INDEX_VERSION   2
+
+/**
+ * @brief Header of the hashed path index
+ *
+ * The path index is an optional structure that allows to resolve a full
+ * path into a file with a single small DMA, instead of walking the directory
+ * lists one sector at a time. When present, the #directory_entry::file_pointer
+ * field of the root sector (which is otherwise unused) points to it. Older
+ * versions of the library simply ignore it, so images containing an index
+ * are still compatible with them.
+ *
+ * The header is followed by a table of `num_buckets+1` 32-bit integers, where
+ * the i-th value is the index of the first entry of bucket i (and the last
+ * value is the total number of entries). After the table, there is the array
+ * of #dfs_index_entry, grouped by bucket. The bucket of a path is the lower
+ * bits of its hash (see #dfs_hash_update).
+ *
+ * Since version 2, the entries are followed by the file table: an array of
+ * `num_entries` #dfs_file_entry, one per file, in file ID order. File IDs are
+ * assigned by mkdfs (which can export them as a C header), and allow to
+ * access files without any path lookup (see #dfs_open_by_index).
+ *
+ * Only files are indexed. Directories are still reachable through the normal
+ * directory walk.
+ */
+struct dfs_index_header
+{
+    /** @brief Magic value (#DFS_INDEX_MAGIC) */
+    uint32_t magic;
+    /** @brief Version of the index (#DFS_INDEX_VERSION) */
+    uint32_t version;
+    /** @brief Number of entries in the index */
+    uint32_t num_entries;
+    /** @brief Number of hash buckets (always a power of two) */
+    uint32_t num_buckets;
+} __attribute__((__packed__));
+
+/** @brief An entry of the hashed path index */
+struct dfs_index_entry
+{
+    /** @brief Higher 32 bits of the hash of the full path */
+    uint32_t hash_hi;
+    /** @brief Lower 32 bits of the hash of the full path */
+    uint32_t hash_lo;
+    /** @brief File size and flags (same as #directory_entry::flags) */
+    uint32_t flags;
+    /** @brief Offset to start sector of the file (same as #directory_entry::file_pointer) */
+    uint32_t file_pointer;
+} __attribute__((__packed__));
+
+_Static_assert(sizeof(struct dfs_index_entry) == 16, "invalid dfs_index_entry size");
+
+/** @brief An entry of the file table (see #dfs_index_header) */
+struct dfs_file_entry
+{
+    /** @brief File size and flags (same as #directory_entry::flags) */
+    uint32_t flags;
+    /** @brief Offset to start sector of the file (same as #directory_entry::file_pointer) */
+    uint32_t file_pointer;
+} __attribute__((__packed__));
+
+/** @brief Initial value for #dfs_hash_update (FNV-1a 64-bit offset basis) */
+#define DFS_HASH_INIT       0xcbf29ce484222325ull
+
+/**
+ * @brief Update the hash of a path used by the path index
+ *
+ * The hash is a 64-bit FNV-1a over the full path of a file, without leading
+ * slash, with components separated by a single slash, and each component
+ * truncated to #MAX_FILENAME_LEN (eg: "sprites/hero.sprite").
+ *
+ * @param[in] hash      Current hash value (#DFS_HASH_INIT at start)
+ * @param[in] data      Data to hash
+ * @param[in] len       Length of the data in bytes
+ *
+ * @return The updated hash value
+ */
+static inline uint64_t dfs_hash_update(uint64_t hash, const char *data, int len)
+{
+    for (int i=0; i<len; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
 /** @brief Open file handle structure */
 typedef struct dfs_open_file_s
 {
@@ -50,8 +155,36 @@ typedef struct dfs_open_file_s
     uint32_t loc;
     /** @brief The offset within the filesystem where the file is stored */
     uint32_t cart_start_loc;
+    /** @brief Read-ahead buffer (NULL if disabled, see #dfs_set_readahead) */
+    uint8_t *ra_buf;
+    /** @brief Size of the read-ahead buffer in bytes */
+    uint32_t ra_size;
+    /** @brief ROM address of the data contained in the read-ahead buffer */
+    uint32_t ra_rom;
+    /** @brief Number of valid bytes in the read-ahead buffer */
+    uint32_t ra_len;
+    /** @brief True if an asynchronous DMA into the read-ahead buffer is in progress */
+    bool ra_pending;
+    /** @brief True if the file is compressed (see #FLAGS_COMPRESSED) */
+    bool compressed;
+    /** @brief Decompression stream for files opened via stdio (NULL if none) */
+    void *stream;
 } dfs_open_file_t;
 
+/**
+ * @brief Return the physical address of the raw contents of a file (in ROM space)
+ *
+ * This is like #dfs_rom_addr, but it also accepts files compressed by mkdfs,
+ * returning the address of their compressed payload. It is used by the asset
+ * library, which reads the compressed data directly from ROM.
+ *
+ * @param[in] path
+ *            Name of the file
+ *
+ * @return The physical address of the file body, or 0 if the file was not found
+ */
+uint32_t __dfs_rom_addr_raw(const char *path);
+
 /** @} */ /* dfs */
 
 #endif
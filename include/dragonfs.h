@@ -6,6 +6,9 @@
 #ifndef __LIBDRAGON_DRAGONFS_H
 #define __LIBDRAGON_DRAGONFS_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 /**
  * @defgroup dfs DragonFS
  * @ingroup asset
@@ -39,8 +42,11 @@
  * Files can be opened using both sets of API calls simultaneously as long as no more than
  * four files are open at any one time.
  * 
- * DragonFS does not support file compression; if you want to compress your assets,
- * use the asset API (#asset_load / #asset_fopen).
+ * Files can be stored compressed in the filesystem by mkdfs (see its `--compress`
+ * option). Compressed files are transparently decompressed when opened via
+ * the standard C functions (seeking backward is supported but slow, as it restarts
+ * decompression), and also by the asset API (#asset_load / #asset_fopen), while
+ * the lower-level DFS API calls access the compressed data as-is.
  * 
  * @{
  */
@@ -197,6 +203,35 @@ int dfs_dir_findnext(char *buf);
  */
 int dfs_open(const char * const path);
 
+/**
+ * @brief Open a file given its ID
+ *
+ * File IDs are assigned by mkdfs while building the filesystem image, and
+ * can be exported as a C header with the `--header` option, which contains
+ * a macro for each file (eg: DFSID_SPRITES_HERO_SPRITE for the file
+ * "sprites/hero.sprite"). This allows to open files without any path
+ * lookup at runtime:
+ *
+ * @code{.c}
+ *      #include "filesystem_ids.h"    // Generated by mkdfs --header
+ *
+ *      int fh = dfs_open_by_index(DFSID_MUSIC_LEVEL1_WAV64);
+ * @endcode
+ *
+ * The table of all files is loaded in RAM on the first call (8 bytes per
+ * file), so that all subsequent calls do not access the ROM at all.
+ *
+ * @note The header is only valid for the filesystem image generated
+ *       together with it: make sure to rebuild your code when the
+ *       filesystem changes.
+ *
+ * @param[in] id
+ *            ID of the file to open
+ *
+ * @return A valid file handle to reference the file by or a negative error on failure.
+ */
+int dfs_open_by_index(int id);
+
 /**
  * @brief Read data from a file
  * 
@@ -291,6 +326,88 @@ int dfs_size(uint32_t handle);
  */
 uint32_t dfs_rom_addr(const char *path);
 
+/**
+ * @brief Return the physical address and size of a file given its ID
+ *
+ * This is the equivalent of #dfs_rom_addr for a file ID (see
+ * #dfs_open_by_index). It is the fastest way to access a file, as it
+ * requires no path lookup nor memory allocation.
+ *
+ * @param[in]  id
+ *             ID of the file
+ * @param[out] size
+ *             If not NULL, will contain the size of the file in bytes
+ *
+ * @return A pointer to the physical address of the file body, or 0
+ *         if the ID is invalid.
+ */
+uint32_t dfs_rom_addr_by_index(int id, int *size);
+
+/** @brief Statistics of the read-ahead buffers (see #dfs_set_readahead) */
+typedef struct {
+    /** @brief Number of reads served entirely from the read-ahead buffers */
+    uint32_t hits;
+    /** @brief Number of reads that required waiting for a new DMA transfer */
+    uint32_t misses;
+    /** @brief Number of asynchronous prefetches started */
+    uint32_t prefetches;
+} dfs_readahead_stats_t;
+
+/**
+ * @brief Configure the read-ahead buffer for files opened via stdio
+ *
+ * Files opened with the standard C API (eg: `fopen("rom:/...")`) are often
+ * read with many small reads, each of which would be a separate PI DMA
+ * transfer. When the read-ahead is enabled, each file opened via stdio
+ * gets its own buffer of the specified size: small reads are served from
+ * RAM, and the buffer is refilled with a single large DMA. When a buffer is
+ * fully consumed, the next chunk of the file is prefetched asynchronously,
+ * so that sequential reads rarely need to wait for the PI.
+ *
+ * Reads larger than the buffer bypass it, and go straight into the
+ * destination buffer. The setting only affects files opened after the call,
+ * and does not affect the DragonFS API (#dfs_read).
+ *
+ * Use #dfs_get_readahead_stats to tune the buffer size.
+ *
+ * @param[in] size
+ *            Size of the read-ahead buffer in bytes (0 to disable, which is
+ *            the default)
+ */
+void dfs_set_readahead(int size);
+
+/**
+ * @brief Get the statistics of the read-ahead buffers
+ *
+ * @param[out] stats
+ *             Structure to fill with the statistics
+ */
+void dfs_get_readahead_stats(dfs_readahead_stats_t *stats);
+
+/**
+ * @brief Reset the statistics of the read-ahead buffers
+ */
+void dfs_reset_readahead_stats(void);
+
+/**
+ * @brief Enable or disable the access trace
+ *
+ * When enabled, every file access (open, read, ROM address lookup) and
+ * directory change is logged on the debug channel (see #debugf) with a timestamp, as lines beginning
+ * with "dfs: trace". Save the debug log while running through a typical
+ * session (eg: loading a level), and pass it to mkdfs with the
+ * `--order-from-trace` option: mkdfs will lay out the files in the order
+ * in which they were first accessed, so that loads become mostly sequential
+ * reads from ROM.
+ *
+ * The trace is logged via #debugf, so it is not available when building
+ * with NDEBUG.
+ *
+ * @param[in] enable
+ *            True to enable the trace, false to disable it
+ */
+void dfs_trace_enable(bool enable);
+
 /**
  * @brief Convert DFS error code into an error string
  */
@@ -94,6 +94,18 @@
  * Blocks must always be created at runtime once (eg: at init time) before
  * being used.
  * 
+ * ## Recordings
+ * 
+ * A recording (#rspq_rec_t) is a private command stream that a producer
+ * (eg: an audio, UI or 3D module) can fill independently of the main queue
+ * and of other producers, and then submit to the queue as a whole via
+ * #rspq_rec_submit. Between #rspq_rec_begin and #rspq_rec_end, all commands
+ * (including those of higher-level libraries like rdpq) go into the recording.
+ * Recordings can be interleaved freely: a cooperative task can fill one
+ * recording in several steps, and an interrupt handler can record into
+ * another while the main code is writing into the queue or into a third
+ * recording. Submitted recordings are run in submission order.
+ * 
  * ## Syncpoints
  * 
  * The RSP command queue is designed to be fully lockless, but sometimes it is
@@ -231,6 +243,40 @@ typedef int rspq_syncpoint_t;
  */
 void rspq_init(void);
 
+/**
+ * @brief Configuration of the RDRAM command buffers of the RSP queue
+ * 
+ * The CPU writes the commands into a ring of RDRAM buffers, which are
+ * consumed by the RSP. When the CPU fills a buffer, it moves to the next one
+ * in the ring, and must wait if the RSP is still running it. Larger or more
+ * numerous buffers let the CPU run further ahead of the RSP (fewer stalls,
+ * see #rspq_get_buffer_stats), at the cost of RDRAM and of a longer latency
+ * for #rspq_wait.
+ * 
+ * Each field can be left to 0 to use the default value.
+ * 
+ * @see #rspq_init_config
+ */
+typedef struct rspq_config_s {
+    /** @brief Size of each lowpri buffer in 32-bit words (default: RSPQ_DRAM_LOWPRI_BUFFER_SIZE) */
+    int lowpri_buffer_size;
+    /** @brief Number of lowpri buffers, 2 to RSPQ_DRAM_MAX_BUFFER_COUNT (default: RSPQ_DRAM_LOWPRI_BUFFER_COUNT) */
+    int lowpri_buffer_count;
+    /** @brief Size of each of the two highpri buffers in 32-bit words (default: RSPQ_DRAM_HIGHPRI_BUFFER_SIZE) */
+    int highpri_buffer_size;
+} rspq_config_t;
+
+/**
+ * @brief Initialize the RSPQ library with a custom buffer configuration.
+ * 
+ * This is like #rspq_init, but allows to configure the RDRAM buffers used
+ * by the queue. Since the first call to #rspq_init wins, this must be called
+ * before initializing any library that uses the RSP queue (eg: #rdpq_init).
+ * 
+ * @param[in] config    Buffer configuration (NULL to use the defaults)
+ */
+void rspq_init_config(const rspq_config_t *config);
+
 /**
  * @brief Shut down the RSPQ library.
  * 
@@ -734,6 +780,101 @@ void rspq_block_run(rspq_block_t *block);
  */
 void rspq_block_free(rspq_block_t *block);
 
+/** @brief A recording: a command stream built independently of the main queue */
+typedef struct rspq_rec_s rspq_rec_t;
+
+/**
+ * @brief Allocate a new recording.
+ * 
+ * A recording is a reusable object: after each #rspq_rec_submit, it is
+ * empty and can be used to record new commands.
+ * 
+ * @return The new (empty) recording
+ */
+rspq_rec_t* rspq_rec_new(void);
+
+/**
+ * @brief Free a recording.
+ * 
+ * Commands recorded but not yet submitted are discarded. Commands already
+ * submitted are not affected.
+ * 
+ * @param rec   The recording to free
+ */
+void rspq_rec_free(rspq_rec_t *rec);
+
+/**
+ * @brief Start (or continue) recording commands into a recording.
+ * 
+ * After this call, all commands are appended to the recording instead
+ * of the queue (or of the block / recording that was being written before).
+ * The previous writer is transparently resumed by #rspq_rec_end. This
+ * means that begin/end pairs can be nested, for instance in an interrupt
+ * handler that preempts code that is writing commands, without the need
+ * of disabling interrupts.
+ * 
+ * Like for blocks, syncpoints and highpri mode cannot be used while
+ * recording, and blocks cannot be created (but they can be run).
+ * 
+ * @note Recording allocates memory as the recording grows (as done by
+ *       #rspq_block_begin). When recording within an interrupt handler, make
+ *       sure the main code does not allocate memory with interrupts enabled.
+ * 
+ * @param rec   The recording
+ * 
+ * @see #rspq_rec_end
+ */
+void rspq_rec_begin(rspq_rec_t *rec);
+
+/**
+ * @brief Stop recording commands into a recording.
+ * 
+ * The recording keeps the commands recorded so far; it is possible to
+ * call #rspq_rec_begin again later to append more commands.
+ * 
+ * @param rec   The recording (must be the last one passed to #rspq_rec_begin)
+ */
+void rspq_rec_end(rspq_rec_t *rec);
+
+/**
+ * @brief Submit a recording to the RSP queue.
+ * 
+ * All commands recorded so far are enqueued as a single unit, after the
+ * recordings submitted before it. The recording is then empty and can be
+ * reused immediately; its memory is freed automatically once the RSP has
+ * run it. If the recording contains RDP commands (eg: from rdpq), a
+ * SYNC_FULL is also enqueued after it (see #rdpq_sync_full), and the memory
+ * is freed once the RDP has completed it.
+ * 
+ * This function can be called from an interrupt handler, and also while
+ * another recording or a block is being written. In these cases, the
+ * recording is only queued, and is added to the RSP queue at the next
+ * #rspq_flush, #rspq_wait or #rspq_rec_submit called from the main code.
+ * 
+ * @param rec   The recording to submit (must not be currently recording)
+ */
+void rspq_rec_submit(rspq_rec_t *rec);
+
+/**
+ * @brief Submit a recording that can be reordered to reduce overlay switches.
+ * 
+ * This is like #rspq_rec_submit, but declares that the recording does not
+ * depend on the order of execution relative to other unordered recordings.
+ * Unordered recordings are not enqueued immediately, but are kept pending
+ * until the next #rspq_flush, #rspq_wait or #rspq_rec_submit. At that point,
+ * each sequence of consecutive unordered recordings is grouped by the first
+ * overlay used in each recording, so that the RSP switches overlay (reloading
+ * its code and data) less often.
+ * 
+ * Notice that commands written directly to the queue after this call might
+ * run before the recording.
+ * 
+ * @param rec   The recording to submit (must not be currently recording)
+ * 
+ * @see #rspq_get_overlay_stats
+ */
+void rspq_rec_submit_unordered(rspq_rec_t *rec);
+
 /**
  * @brief Start building a high-priority queue.
  * 
@@ -836,6 +977,116 @@ void rspq_dma_to_rdram(void *rdram_addr, uint32_t dmem_addr, uint32_t len, bool
  */
 void rspq_dma_to_dmem(uint32_t dmem_addr, void *rdram_addr, uint32_t len, bool is_async);
 
+/** @brief Number of command IDs tracked by the profiler (see #rspq_profile_data_t) */
+#define RSPQ_PROFILE_CMD_COUNT   256
+
+/** @brief Profiling statistics of a RSP command (see #rspq_profile_get_data) */
+typedef struct {
+    uint64_t calls;                 ///< Number of times the command was run
+    uint64_t total_cycles;          ///< Total RCP cycles spent running the command
+    uint64_t rdp_stall_cycles;      ///< RCP cycles spent waiting for the RDP (included in total_cycles)
+    uint32_t max_cycles;            ///< Maximum RCP cycles of a single run of the command
+} rspq_profile_cmd_t;
+
+/** @brief Profiling statistics of the RSP queue (see #rspq_profile_get_data) */
+typedef struct {
+    /** @brief Statistics per command ID (overlay ID in the top 4 bits, as in #rspq_write) */
+    rspq_profile_cmd_t commands[RSPQ_PROFILE_CMD_COUNT];
+    uint64_t frame_count;           ///< Number of frames profiled (calls to #rspq_profile_next_frame)
+    uint64_t dropped_samples;       ///< Number of commands not profiled because the sample buffer was full
+} rspq_profile_data_t;
+
+/**
+ * @brief Collect the profiling data of the commands run in the current frame
+ * 
+ * The RSP queue profiler is an opt-in feature, enabled by setting RSPQ_PROFILE
+ * to 1 in rspq_constants.h and rebuilding libdragon and all the overlays. When
+ * enabled, the RSP measures the duration of each command using the RCP clock
+ * counter (DP_CLOCK), including the time spent waiting for the RDP to accept
+ * more commands, and stores the samples in a RDRAM buffer.
+ * 
+ * This function must be called once per frame: it accumulates the samples of the
+ * frame into the statistics returned by #rspq_profile_get_data, and makes room
+ * for the next frame. It forces a full sync (see #rspq_wait), so it distorts
+ * the timing of the frame a bit; call it at the end of the frame.
+ * 
+ * If the profiler is disabled, this function does nothing.
+ */
+void rspq_profile_next_frame(void);
+
+/**
+ * @brief Get the profiling statistics accumulated so far
+ * 
+ * @param[out] data     Statistics accumulated since the last #rspq_profile_reset
+ *                      (all zeros if the profiler is disabled)
+ */
+void rspq_profile_get_data(rspq_profile_data_t *data);
+
+/**
+ * @brief Reset the profiling statistics
+ */
+void rspq_profile_reset(void);
+
+/**
+ * @brief Dump the profiling statistics to the debug log
+ * 
+ * The dump shows, for each command that was run, the name of its overlay,
+ * the index of the command within the overlay, and the per-frame averages of
+ * calls, execution time and RDP stall time, plus the maximum execution time.
+ */
+void rspq_profile_dump(void);
+
+/** @brief Statistics on the RDRAM command buffers (see #rspq_get_buffer_stats) */
+typedef struct {
+    uint32_t buffer_switches;       ///< Number of times the CPU moved to the next buffer of a queue
+    uint32_t stalls;                ///< Number of switches that had to wait for the RSP to free the buffer
+    uint64_t stall_ticks;           ///< Total CPU time spent waiting for a free buffer (in ticks, see #TICKS_READ)
+} rspq_buffer_stats_t;
+
+/**
+ * @brief Get the statistics on the RDRAM command buffers
+ * 
+ * These statistics can be used to tune the buffer configuration (see
+ * #rspq_config_t): a high number of stalls means that the CPU is often
+ * waiting for the RSP to consume the commands, so that larger or more
+ * buffers might help, if the CPU has other work to do in the meantime.
+ * 
+ * @param[out] stats    Statistics accumulated since the last #rspq_reset_buffer_stats
+ */
+void rspq_get_buffer_stats(rspq_buffer_stats_t *stats);
+
+/**
+ * @brief Reset the statistics on the RDRAM command buffers
+ */
+void rspq_reset_buffer_stats(void);
+
+/** @brief Statistics on overlay switches (see #rspq_get_overlay_stats) */
+typedef struct {
+    uint32_t overlay_loads;         ///< Number of times the RSP switched overlay (saving the previous state, loading code and data)
+    uint32_t scheduled_recordings;  ///< Number of unordered recordings moved earlier to batch them by overlay
+} rspq_overlay_stats_t;
+
+/**
+ * @brief Get the statistics on overlay switches
+ * 
+ * Each overlay switch requires the RSP to write back the state of the current
+ * overlay and load code and data of the new one via DMA, so it is quite
+ * expensive. A high number of loads per frame is a sign that commands of
+ * different overlays are interleaved too finely; see #rspq_rec_submit_unordered
+ * for a way to batch them.
+ * 
+ * The overlay load counter is updated by the RSP, so it is accurate only
+ * for the commands that the RSP has already executed.
+ * 
+ * @param[out] stats    Statistics accumulated since the last #rspq_reset_overlay_stats
+ */
+void rspq_get_overlay_stats(rspq_overlay_stats_t *stats);
+
+/**
+ * @brief Reset the statistics on overlay switches
+ */
+void rspq_reset_overlay_stats(void);
+
 /** @cond */
 __attribute__((deprecated("may not work anymore. use rspq_syncpoint_new/rspq_syncpoint_check instead")))
 void rspq_signal(uint32_t signal);
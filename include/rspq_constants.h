@@ -1,22 +1,60 @@
 #ifndef __RSPQ_INTERNAL
 #define __RSPQ_INTERNAL
 
+/**
+ * Enable the rspq debugging checks in the ucode (invalid overlay / command
+ * asserts, DMEM layout markers). By default, they follow NDEBUG, so that
+ * release builds (see N64_RELEASE in n64.mk) do not pay for them in the
+ * command dispatch loop. Notice that libdragon and all the overlays must be
+ * built with the same setting, as they share the queue engine code.
+ */
+#ifndef RSPQ_DEBUG
+#ifdef NDEBUG
+#define RSPQ_DEBUG                     0
+#else
 #define RSPQ_DEBUG                     1
+#endif
+#endif
+
+/** 
+ * Enable the RSP queue profiler (see #rspq_profile_next_frame). It adds some
+ * overhead to the dispatch of each command, so it is off by default. To
+ * enable it, set it to 1 here, then rebuild libdragon and all the overlays
+ * (which share the queue engine code).
+ */
+#ifndef RSPQ_PROFILE
+#define RSPQ_PROFILE                   0
+#endif
 
-#define RSPQ_DRAM_LOWPRI_BUFFER_SIZE   0x200   ///< Size of each RSPQ RDRAM buffer for lowpri queue (in 32-bit words)
-#define RSPQ_DRAM_HIGHPRI_BUFFER_SIZE  0x80    ///< Size of each RSPQ RDRAM buffer for highpri queue (in 32-bit words)
+#define RSPQ_DRAM_LOWPRI_BUFFER_SIZE   0x200   ///< Default size of each RSPQ RDRAM buffer for lowpri queue (in 32-bit words)
+#define RSPQ_DRAM_LOWPRI_BUFFER_COUNT  2       ///< Default number of RSPQ RDRAM buffers for lowpri queue
+#define RSPQ_DRAM_HIGHPRI_BUFFER_SIZE  0x80    ///< Default size of each RSPQ RDRAM buffer for highpri queue (in 32-bit words)
+#define RSPQ_DRAM_MAX_BUFFER_COUNT     8       ///< Maximum number of RSPQ RDRAM buffers in a queue (see #rspq_config_t)
 
 #define RSPQ_DMEM_BUFFER_SIZE          0x100   ///< Size of the RSPQ DMEM buffer (in bytes)
 #define RSPQ_OVERLAY_TABLE_SIZE        0x10    ///< Number of overlay IDs (0-F)
 #define RSPQ_OVERLAY_DESC_SIZE         0x10    ///< Size of a single overlay descriptor
 
-/** Maximum number of overlays that can be registered (affects DMEM table size) */
-#define RSPQ_MAX_OVERLAY_COUNT         8
+/**
+ * Maximum number of overlays that can be registered, including the builtin one
+ * (affects DMEM table size: 16 bytes per overlay). Since commands address
+ * overlays with a 4-bit ID, 16 is also the maximum possible value. To save
+ * some DMEM, it can be lowered here, rebuilding libdragon and all the
+ * overlays (which share the queue engine data).
+ */
+#ifndef RSPQ_MAX_OVERLAY_COUNT
+#define RSPQ_MAX_OVERLAY_COUNT         16
+#endif
 #define RSPQ_OVERLAY_ID_COUNT          16
 #define RSPQ_MAX_OVERLAY_COMMAND_COUNT ((RSPQ_MAX_OVERLAY_COUNT - 1) * 16)
 #define RSPQ_DESCRIPTOR_SIZE_MASK      0xFC
 #define RSPQ_DESCRIPTOR_MAX_SIZE       RSPQ_DESCRIPTOR_SIZE_MASK
 
+/** Size of the DMEM ring of profiling samples (8 bytes each), flushed to RDRAM when full */
+#define RSPQ_PROFILE_SAMPLES_SIZE      0x80
+/** Size of the RDRAM buffer of profiling samples (in bytes), enough for a frame */
+#define RSPQ_PROFILE_BUFFER_SIZE       0x10000
+
 /** Minimum / maximum size of a block's chunk (contiguous memory buffer) */
 #define RSPQ_BLOCK_MIN_SIZE            64
 #define RSPQ_BLOCK_MAX_SIZE            4192
@@ -222,6 +222,21 @@ surface_t sprite_get_tile(sprite_t *sprite, int h, int v);
  */
 uint16_t* sprite_get_palette(sprite_t *sprite);
 
+/**
+ * @brief Return the ID of the palette shared by the sprite (if any)
+ * 
+ * Sprites converted by mksprite with `--palette-group` are all quantized
+ * to the same palette, and carry an ID computed by hashing the palette. Sprites
+ * with the same palette ID contain the same palette (barring 16-bit hash
+ * collisions), so there is no need to upload it again to TMEM when drawing
+ * them one after the other. rdpq does this automatically in
+ * #rdpq_sprite_upload and #rdpq_sprite_blit.
+ * 
+ * @param   sprite      The sprite to access
+ * @return              The ID of the shared palette, or 0 if the palette is not shared
+ */
+uint16_t sprite_get_palette_id(sprite_t *sprite);
+
 /**
  * @brief Get a copy of the RDP texparms, optionally stored within the sprite.
  * 
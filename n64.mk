@@ -36,6 +36,7 @@ N64_SYM = $(N64_BINDIR)/n64sym
 N64_ELFCOMPRESS = $(N64_BINDIR)/n64elfcompress
 N64_AUDIOCONV = $(N64_BINDIR)/audioconv64
 N64_MKSPRITE = $(N64_BINDIR)/mksprite
+N64_MKASSET = $(N64_BINDIR)/mkasset
 
 N64_C_AND_CXX_FLAGS =  -march=vr4300 -mtune=vr4300 -I$(N64_INCLUDEDIR)
 N64_C_AND_CXX_FLAGS += -falign-functions=32   # NOTE: if you change this, also change backtrace() in backtrace.c
@@ -54,6 +55,16 @@ N64_ED64ROMCONFIGFLAGS =  $(if $(N64_ROM_SAVETYPE),--savetype $(N64_ROM_SAVETYPE
 N64_ED64ROMCONFIGFLAGS += $(if $(N64_ROM_RTC),--rtc) 
 N64_ED64ROMCONFIGFLAGS += $(if $(N64_ROM_REGIONFREE),--regionfree)
 
+# Release build: disable asserts and debugging checks, both on the CPU and
+# in the RSP ucodes (including the rspq/rdpq engine). libdragon and the ROM
+# (with its overlays) must be built with the same setting.
+ifeq ($(N64_RELEASE),1)
+CFLAGS+=-DNDEBUG
+CXXFLAGS+=-DNDEBUG
+ASFLAGS+=-DNDEBUG
+RSPASFLAGS+=-DNDEBUG
+endif
+
 ifeq ($(D),1)
 CFLAGS+=-g3
 CXXFLAGS+=-g3
@@ -99,10 +110,12 @@ RSPASFLAGS+=-MMD
 	@echo "    [V64] $@"
 	$(N64_OBJCOPY) -I binary -O binary --reverse-bytes=2 $< $@
 
+# Use MKDFS_FLAGS to pass extra options to mkdfs, eg: "--header filesystem_ids.h"
+# to generate the file IDs for dfs_open_by_index().
 %.dfs:
 	@mkdir -p $(dir $@)
 	@echo "    [DFS] $@"
-	$(N64_MKDFS) $@ $(<D) >/dev/null
+	$(N64_MKDFS) $(MKDFS_FLAGS) $@ $(<D) >/dev/null
 
 # Assembly rule. We use .S for both RSP and MIPS assembly code, and we differentiate
 # using the prefix of the filename: if it starts with "rsp", it is RSP ucode, otherwise
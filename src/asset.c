@@ -16,11 +16,15 @@
 #include "n64sys.h"
 #include "dma.h"
 #include "dragonfs.h"
+#include "dfsinternal.h"
+/** @brief Flag to open files bypassing the DFS transparent decompression */
+#define ASSET_O_RAW     DFS_O_RAW
 #else
 #include <stdlib.h>
 #include <assert.h>
 #define memalign(a, b) malloc(b)
 #define assertf(x, ...) assert(x)
+#define ASSET_O_RAW     0
 #endif
 
 /** 
@@ -65,9 +69,16 @@ void __asset_init_compression_lvl3(void)
     };
 }
 
-int must_open(const char *fn)
+/**
+ * @brief Open a file, asserting on failure
+ *
+ * @param fn        Filename
+ * @param flags     Flags for open()
+ * @return int      File descriptor
+ */
+static int must_open_flags(const char *fn, int flags)
 {
-    int fd = open(fn, O_RDONLY);
+    int fd = open(fn, flags);
     if (fd < 0) {
         // File not found.
         int errnum = errno;
@@ -91,6 +102,22 @@ int must_open(const char *fn)
     return fd;
 }
 
+int must_open(const char *fn)
+{
+    return must_open_flags(fn, O_RDONLY);
+}
+
+/**
+ * @brief Open a file for the asset library, asserting on failure
+ *
+ * DFS files compressed by mkdfs are opened raw, as the asset library
+ * handles compressed files by itself (and more efficiently).
+ */
+static int asset_must_open(const char *fn)
+{
+    return must_open_flags(fn, O_RDONLY | ASSET_O_RAW);
+}
+
 FILE *must_fopen(const char *fn)
 {
     return fdopen(must_open(fn), "rb");
@@ -133,7 +160,7 @@ static void* decompress_inplace(asset_compression_t *algo, const char *fn, int f
         // Loading from ROM. This is a common enough situation that we want to optimize it.
         // Start an asynchronous DMA transfer, so that we can start decompressing as the
         // data flows in.
-        uint32_t addr = dfs_rom_addr(fn+5) & 0x1FFFFFFF;
+        uint32_t addr = __dfs_rom_addr_raw(fn+5) & 0x1FFFFFFF;
         dma_read_async(s+cmp_offset, addr+sizeof(asset_header_t), cmp_size);
 
         // Run the decompression racing with the DMA.
@@ -154,16 +181,70 @@ static void* decompress_inplace(asset_compression_t *algo, const char *fn, int f
     return ptr;
 }
 
+/**
+ * @brief Read the block index of a chunked asset
+ * 
+ * The file must be positioned right after the asset header. The returned
+ * index is allocated with malloc and contains num_blocks+1 offsets.
+ */
+static asset_chunk_index_t* chunk_index_read(int fd)
+{
+    uint32_t hdr[2];
+    read(fd, hdr, sizeof(hdr));
+    if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {  // for mkasset running on PC
+        hdr[0] = __builtin_bswap32(hdr[0]);
+        hdr[1] = __builtin_bswap32(hdr[1]);
+    }
+
+    asset_chunk_index_t *index = malloc(sizeof(asset_chunk_index_t) + (hdr[1]+1) * sizeof(uint32_t));
+    assertf(index, "asset: out of memory");
+    index->block_size = hdr[0];
+    index->num_blocks = hdr[1];
+    read(fd, index->offsets, (index->num_blocks+1) * sizeof(uint32_t));
+    if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+        for (int i=0; i<=index->num_blocks; i++)
+            index->offsets[i] = __builtin_bswap32(index->offsets[i]);
+    }
+    return index;
+}
+
+static void* decompress_chunked(asset_compression_t *algo, const char *fn, int fd, int winsize, size_t size)
+{
+    asset_chunk_index_t *index = chunk_index_read(fd);
+    void *state = malloc(algo->state_size + winsize);
+    uint8_t *s = memalign(ASSET_ALIGNMENT, size);
+    assertf(state && s, "asset_load: out of memory");
+
+    // Blocks are independent, so just decompress them one after the other,
+    // resetting the decompressor at the start of each of them.
+    algo->decompress_init(state, fd, winsize);
+    for (int i=0; i<index->num_blocks; i++) {
+        int pos = i * index->block_size;
+        int len = size - pos < index->block_size ? size - pos : index->block_size;
+        lseek(fd, index->offsets[i], SEEK_SET);
+        algo->decompress_reset(state);
+        while (len > 0) {
+            int n = algo->decompress_read(state, s + pos, len);
+            assertf(n > 0, "asset: decompression error on file %s: corrupted? (block %d)", fn, i);
+            pos += n; len -= n;
+        }
+    }
+
+    free(state);
+    free(index);
+    return s;
+}
+
 void *asset_load(const char *fn, int *sz)
 {
     uint8_t *s; int size;
-    int fd = must_open(fn);
+    int fd = asset_must_open(fn);
    
     // Check if file is compressed
     asset_header_t header;
     read(fd, &header, sizeof(asset_header_t));
     if (!memcmp(header.magic, ASSET_MAGIC, 3)) {
-        if (header.version != '3') {
+        if (header.version != '3' && header.version != '4') {
             assertf(0, "unsupported asset version: %c\nMake sure to rebuild libdragon tools and your assets", header.version);
             return NULL;
         }
@@ -182,7 +263,11 @@ void *asset_load(const char *fn, int *sz)
             "asset: compression level %d not initialized. Call asset_init_compression(%d) at initialization time", header.algo, header.algo);
 
         size = header.orig_size;
-        if ((header.flags & ASSET_FLAG_INPLACE) && algos[header.algo-1].decompress_full_inplace)
+        if (header.flags & ASSET_FLAG_CHUNKED) {
+            assertf(algos[header.algo-1].decompress_init, 
+                "asset: compression level %d does not support chunked files", header.algo);
+            s = decompress_chunked(&algos[header.algo-1], fn, fd, asset_winsize_from_flags(header.flags), size);
+        } else if ((header.flags & ASSET_FLAG_INPLACE) && algos[header.algo-1].decompress_full_inplace)
             s = decompress_inplace(&algos[header.algo-1], fn, fd, header.cmp_size, size, header.inplace_margin);
         else
             s = algos[header.algo-1].decompress_full(fn, fd, header.cmp_size, size);
@@ -246,11 +331,34 @@ typedef struct  {
     int fd;
     int pos;
     bool seeked;
+    int size;
+    int cur_block;
+    asset_chunk_index_t *index;
     void (*reset)(void *state);
     ssize_t (*read)(void *state, void *buf, size_t len);
     uint8_t alignas(8) state[];
 } cookie_cmp_t;
 
+/**
+ * @brief Skip forward in the decompressed stream, by decompressing and discarding data
+ *
+ * The target position must be within the current block (for chunked files).
+ *
+ * @return The new position, or -1 on error
+ */
+static int cookie_skip(cookie_cmp_t *cookie, int pos)
+{
+    uint8_t tmp[128];
+    while (cookie->pos < pos) {
+        int n = pos - cookie->pos;
+        if (n > sizeof(tmp)) n = sizeof(tmp);
+        n = cookie->read(cookie->state, tmp, n);
+        if (n <= 0) return -1;
+        cookie->pos += n;
+    }
+    return pos;
+}
+
 static int readfn_cmp(void *c, char *buf, int sz)
 {
     cookie_cmp_t *cookie = (cookie_cmp_t*)c;
@@ -260,6 +368,66 @@ static int readfn_cmp(void *c, char *buf, int sz)
     return n;
 }
 
+static int readfn_chunked(void *c, char *buf, int sz)
+{
+    cookie_cmp_t *cookie = (cookie_cmp_t*)c;
+    int block_size = cookie->index->block_size;
+    int total = 0;
+
+    while (sz > 0 && cookie->pos < cookie->size) {
+        int block_end = (cookie->cur_block + 1) * block_size;
+        if (block_end > cookie->size) block_end = cookie->size;
+        if (cookie->pos == block_end) {
+            // Move to the next block. Each block is compressed independently,
+            // so we just need to restart the decompressor at its offset.
+            cookie->cur_block++;
+            lseek(cookie->fd, cookie->index->offsets[cookie->cur_block], SEEK_SET);
+            cookie->reset(cookie->state);
+            continue;
+        }
+
+        int len = block_end - cookie->pos;
+        if (len > sz) len = sz;
+        int n = cookie->read(cookie->state, (uint8_t*)buf, len);
+        if (n <= 0) break;
+        buf += n; sz -= n; total += n;
+        cookie->pos += n;
+    }
+    return total;
+}
+
+static fpos_t seekfn_chunked(void *c, fpos_t pos, int whence)
+{
+    cookie_cmp_t *cookie = (cookie_cmp_t*)c;
+
+    switch (whence) {
+    case SEEK_SET: break;
+    case SEEK_CUR: pos += cookie->pos; break;
+    case SEEK_END: pos += cookie->size; break;
+    default: return -1;
+    }
+    if (pos < 0 || pos > cookie->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pos == cookie->pos)
+        return pos;
+
+    // Jump to the start of the block containing the requested position,
+    // unless we are already in it and the seek is forward.
+    int block = pos / cookie->index->block_size;
+    if (block >= cookie->index->num_blocks) block = cookie->index->num_blocks-1;
+    if (block != cookie->cur_block || pos < cookie->pos) {
+        cookie->cur_block = block;
+        cookie->pos = block * cookie->index->block_size;
+        lseek(cookie->fd, cookie->index->offsets[block], SEEK_SET);
+        cookie->reset(cookie->state);
+    }
+
+    // Skip forward within the block by decompressing and discarding data.
+    return cookie_skip(cookie, pos);
+}
+
 static fpos_t seekfn_cmp(void *c, fpos_t pos, int whence)
 {
     cookie_cmp_t *cookie = (cookie_cmp_t*)c;
@@ -282,10 +450,75 @@ static fpos_t seekfn_cmp(void *c, fpos_t pos, int whence)
     return -1;
 }
 
+/**
+ * @brief Read the asset header of a file, if present
+ *
+ * @param fd        File descriptor, positioned at the start of the file
+ * @param header    Header to fill (in native endianness)
+ * @return true     If the file is compressed
+ */
+static bool read_header(int fd, asset_header_t *header)
+{
+    if (read(fd, header, sizeof(asset_header_t)) != sizeof(asset_header_t) ||
+        memcmp(header->magic, ASSET_MAGIC, 3))
+        return false;
+
+    if (header->version != '3' && header->version != '4') {
+        assertf(0, "unsupported asset version: %c\nMake sure to rebuild libdragon tools and your assets", header->version);
+        return false;
+    }
+
+    if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {  // for mkasset running on PC
+        header->algo = __builtin_bswap16(header->algo);
+        header->flags = __builtin_bswap16(header->flags);
+        header->cmp_size = __builtin_bswap32(header->cmp_size);
+        header->orig_size = __builtin_bswap32(header->orig_size);
+        header->inplace_margin = __builtin_bswap32(header->inplace_margin);
+    }
+    return true;
+}
+
+/**
+ * @brief Create the streaming decompression state of a compressed file
+ *
+ * @param fd        File descriptor, positioned right after the header
+ * @param header    Asset header
+ * @return          Decompression state, ready to read from the start of the data
+ */
+static cookie_cmp_t *cookie_cmp_open(int fd, asset_header_t *header)
+{
+    assertf(header->algo >= 1 && header->algo <= 2,
+        "unsupported compression algorithm: %d", header->algo);
+    assertf(algos[header->algo-1].decompress_full || algos[header->algo-1].decompress_full_inplace, 
+        "asset: compression level %d not initialized. Call asset_init_compression(%d) at initialization time", header->algo, header->algo);
+    assertf(algos[header->algo-1].decompress_init, 
+        "asset: compression level %d does not currently support asset_fopen()", header->algo);
+
+    int winsize = asset_winsize_from_flags(header->flags);
+    cookie_cmp_t *cookie = malloc(sizeof(cookie_cmp_t) + algos[header->algo-1].state_size + winsize);
+    cookie->read = algos[header->algo-1].decompress_read;
+    cookie->reset = algos[header->algo-1].decompress_reset;
+    algos[header->algo-1].decompress_init(cookie->state, fd, winsize);
+
+    cookie->fd = fd;
+    cookie->pos = 0;
+    cookie->seeked = false;
+    cookie->size = header->orig_size;
+    cookie->cur_block = 0;
+    cookie->index = NULL;
+
+    if (header->flags & ASSET_FLAG_CHUNKED) {
+        cookie->index = chunk_index_read(fd);
+        lseek(fd, cookie->index->offsets[0], SEEK_SET);
+    }
+    return cookie;
+}
+
 static int closefn_cmp(void *c)
 {
     cookie_cmp_t *cookie = (cookie_cmp_t*)c;
     close(cookie->fd); cookie->fd = -1;
+    free(cookie->index);
     free(cookie);
     return 0;
 }
@@ -294,44 +527,18 @@ FILE *asset_fopen(const char *fn, int *sz)
 {
     // Open the file. We use buffering on the outer file created by funopen,
     // so we don't actually need buffering on the underlying one.
-    int fd = must_open(fn);
+    int fd = asset_must_open(fn);
 
     // Check if file is compressed
     asset_header_t header;
-    read(fd, &header, sizeof(asset_header_t));
-    if (!memcmp(header.magic, ASSET_MAGIC, 3)) {
-        if (header.version != '3') {
-            assertf(0, "unsupported asset version: %c\nMake sure to rebuild libdragon tools and your assets", header.version);
-            return NULL;
-        }
-
-        if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {  // for mkasset running on PC
-            header.algo = __builtin_bswap16(header.algo);
-            header.flags = __builtin_bswap16(header.flags);
-            header.cmp_size = __builtin_bswap32(header.cmp_size);
-            header.orig_size = __builtin_bswap32(header.orig_size);
-            header.inplace_margin = __builtin_bswap32(header.inplace_margin);
-        }
-
-        cookie_cmp_t *cookie;
-
-        assertf(header.algo >= 1 || header.algo <= 2,
-            "unsupported compression algorithm: %d", header.algo);
-        assertf(algos[header.algo-1].decompress_full || algos[header.algo-1].decompress_full_inplace, 
-            "asset: compression level %d not initialized. Call asset_init_compression(%d) at initialization time", header.algo, header.algo);
-        assertf(algos[header.algo-1].decompress_init, 
-            "asset: compression level %d does not currently support asset_fopen()", header.algo);
-
-        int winsize = asset_winsize_from_flags(header.flags);
-        cookie = malloc(sizeof(cookie_cmp_t) + algos[header.algo-1].state_size + winsize);
-        cookie->read = algos[header.algo-1].decompress_read;
-        cookie->reset = algos[header.algo-1].decompress_reset;
-        algos[header.algo-1].decompress_init(cookie->state, fd, winsize);
-
-        cookie->fd = fd;
-        cookie->pos = 0;
-        cookie->seeked = false;
+    if (read_header(fd, &header)) {
+        cookie_cmp_t *cookie = cookie_cmp_open(fd, &header);
         if (sz) *sz = header.orig_size;
+
+        // Chunked files can be freely seeked, as each block can be
+        // decompressed independently.
+        if (cookie->index)
+            return funopen(cookie, readfn_chunked, NULL, seekfn_chunked, closefn_cmp);
         return funopen(cookie, readfn_cmp, NULL, seekfn_cmp, closefn_cmp);
     }
 
@@ -345,4 +552,334 @@ FILE *asset_fopen(const char *fn, int *sz)
     return funopen(cookie, readfn_none, NULL, seekfn_none, closefn_none);
 }
 
+void *__asset_stream_open(int fd, int *sz)
+{
+    asset_header_t header;
+    if (!read_header(fd, &header))
+        return NULL;
+
+    if (sz) *sz = header.orig_size;
+    return cookie_cmp_open(fd, &header);
+}
+
+int __asset_stream_read(void *stream, void *buf, int len)
+{
+    cookie_cmp_t *cookie = stream;
+    if (cookie->index)
+        return readfn_chunked(cookie, buf, len);
+    return readfn_cmp(cookie, buf, len);
+}
+
+int __asset_stream_seek(void *stream, int pos)
+{
+    cookie_cmp_t *cookie = stream;
+    if (cookie->index)
+        return seekfn_chunked(cookie, pos, SEEK_SET);
+
+    if (pos < 0 || pos > cookie->size)
+        return -1;
+
+    // Seeking backward requires to restart decompressing from the start,
+    // while seeking forward decompresses and discards the data in between.
+    if (pos < cookie->pos) {
+        cookie->pos = 0;
+        lseek(cookie->fd, sizeof(asset_header_t), SEEK_SET);
+        cookie->reset(cookie->state);
+    }
+    return cookie_skip(cookie, pos);
+}
+
+void __asset_stream_close(void *stream)
+{
+    closefn_cmp(stream);
+}
+
+/**
+ * @brief Size of each DMA transfer issued by the asynchronous loader.
+ * 
+ * For files that are not chunked, the data is transferred in pieces of this
+ * size, so that each call to #asset_load_poll never stalls on a big DMA.
+ */
+#define ASSET_ASYNC_DMA_CHUNK       (16*1024)
+
+/** @brief Kind of asynchronous load being performed */
+typedef enum {
+    ASYNC_RAW,          ///< Uncompressed file, loaded as-is
+    ASYNC_INPLACE,      ///< Compressed file, decompressed in-place once fully loaded
+    ASYNC_CHUNKED,      ///< Chunked compressed file, decompressed block by block
+    ASYNC_SYNC,         ///< Fallback: the file is loaded synchronously in the first poll
+} async_kind_t;
+
+/** @brief State of an asynchronous asset load */
+struct asset_loader_s {
+    async_kind_t kind;              ///< Kind of load being performed
+    char *fn;                       ///< Filename (needed by the synchronous fallback)
+    int fd;                         ///< File descriptor
+    uint32_t rom_addr;              ///< Physical ROM address of the file (0 if not in ROM)
+    asset_compression_t *algo;      ///< Decompression algorithm (NULL if not compressed)
+    asset_header_t header;          ///< Asset header (if compressed)
+    uint8_t *buf;                   ///< Output buffer
+    int size;                       ///< Decompressed size of the file
+    int done;                       ///< Bytes of output already available
+    int cmp_offset;                 ///< Offset of the compressed data in buf (ASYNC_INPLACE)
+    int loaded;                     ///< Bytes of compressed data transferred so far
+    bool finished;                  ///< True when the load is complete
+    asset_chunk_index_t *index;     ///< Block index (ASYNC_CHUNKED)
+    uint8_t *stage;                 ///< Double buffer for compressed blocks (ASYNC_CHUNKED)
+    int slot_size;                  ///< Size of each of the two slots in the stage buffer
+    int next_block;                 ///< Next block to decompress (ASYNC_CHUNKED)
+    uint32_t t0;                    ///< Tick counter at the start of the load
+    asset_load_stats_t stats;       ///< Timing statistics
+};
+
+static bool async_pi_busy(void)
+{
+    return *PI_STATUS & 3;
+}
+
+/** @brief Pointer to the compressed data of a block within the double buffer */
+static uint8_t* async_block_ptr(asset_loader_t *ld, int block)
+{
+    // Keep the same 2-byte parity of the ROM address, as required by dma_read_async.
+    return ld->stage + (block & 1) * ld->slot_size + (ld->index->offsets[block] & 1);
+}
+
+/** @brief Fetch the compressed data of a block into its slot of the double buffer */
+static void async_block_fetch(asset_loader_t *ld, int block)
+{
+    uint8_t *dst = async_block_ptr(ld, block);
+    uint32_t offset = ld->index->offsets[block];
+    int cmp_size = ld->index->offsets[block+1] - offset;
+
+    if (ld->rom_addr) {
+        data_cache_hit_invalidate(ld->stage + (block & 1) * ld->slot_size, ld->slot_size);
+        dma_read_async(dst, ld->rom_addr + offset, cmp_size);
+    } else {
+        lseek(ld->fd, offset, SEEK_SET);
+        read(ld->fd, dst, cmp_size);
+    }
+}
+
+asset_loader_t* asset_load_async(const char *fn)
+{
+    asset_loader_t *ld = calloc(1, sizeof(asset_loader_t));
+    assertf(ld, "asset_load_async: out of memory");
+    ld->t0 = TICKS_READ();
+    ld->fn = strdup(fn);
+    ld->fd = asset_must_open(fn);
+    if (strncmp(fn, "rom:/", 5) == 0)
+        ld->rom_addr = __dfs_rom_addr_raw(fn+5) & 0x1FFFFFFF;
+    if (ld->rom_addr & 1)
+        ld->rom_addr = 0;   // misaligned for DMA, use standard reads
+
+    // Check if file is compressed
+    asset_header_t *header = &ld->header;
+    read(ld->fd, header, sizeof(asset_header_t));
+    if (memcmp(header->magic, ASSET_MAGIC, 3)) {
+        ld->kind = ASYNC_RAW;
+        ld->size = lseek(ld->fd, 0, SEEK_END);
+        lseek(ld->fd, 0, SEEK_SET);
+        int bufsize = (ld->size + 15) & ~15;
+        ld->buf = memalign(ASSET_ALIGNMENT, bufsize);
+        assertf(ld->buf, "asset_load_async: out of memory");
+        if (ld->rom_addr)
+            data_cache_hit_invalidate(ld->buf, bufsize);
+        return ld;
+    }
+
+    assertf(header->version == '3' || header->version == '4',
+        "unsupported asset version: %c\nMake sure to rebuild libdragon tools and your assets", header->version);
+    assertf(header->algo >= 1 && header->algo <= 3,
+        "unsupported compression algorithm: %d", header->algo);
+    ld->algo = &algos[header->algo-1];
+    assertf(ld->algo->decompress_full || ld->algo->decompress_full_inplace, 
+        "asset: compression level %d not initialized. Call asset_init_compression(%d) at initialization time", header->algo, header->algo);
+    ld->size = header->orig_size;
+
+    if (!ld->algo->decompress_full_inplace) {
+        // Only the streaming decompressor is available for this algorithm.
+        ld->kind = ASYNC_SYNC;
+        return ld;
+    }
+
+    if (header->flags & ASSET_FLAG_CHUNKED) {
+        ld->kind = ASYNC_CHUNKED;
+        ld->index = chunk_index_read(ld->fd);
+
+        // Allocate two slots big enough for the biggest compressed block.
+        int max_cmp_size = 0;
+        for (int i=0; i<ld->index->num_blocks; i++) {
+            int cmp_size = ld->index->offsets[i+1] - ld->index->offsets[i];
+            if (cmp_size > max_cmp_size) max_cmp_size = cmp_size;
+        }
+        ld->slot_size = (max_cmp_size + 1 + 15) & ~15;
+        ld->stage = memalign(ASSET_ALIGNMENT, ld->slot_size * 2);
+        // Add 8 bytes for the out-of-bounds writes of the assembly decompressors.
+        ld->buf = memalign(ASSET_ALIGNMENT, ld->size + 8);
+        assertf(ld->stage && ld->buf, "asset_load_async: out of memory");
+
+        // Start transferring the first block right away.
+        if (ld->rom_addr && ld->index->num_blocks > 0)
+            async_block_fetch(ld, 0);
+        return ld;
+    }
+
+    if (!(header->flags & ASSET_FLAG_INPLACE)) {
+        ld->kind = ASYNC_SYNC;
+        return ld;
+    }
+
+    // Same layout used by decompress_inplace(): the compressed data is
+    // loaded at the end of the output buffer, 4-byte aligned.
+    ld->kind = ASYNC_INPLACE;
+    int bufsize = ld->size + header->inplace_margin + 8;
+    ld->cmp_offset = bufsize - header->cmp_size;
+    while (ld->cmp_offset & 3) {
+        ld->cmp_offset++;
+        bufsize++;
+    }
+    bufsize = (bufsize + 15) & ~15;
+    ld->buf = memalign(ASSET_ALIGNMENT, bufsize);
+    assertf(ld->buf, "asset_load_async: out of memory");
+    if (ld->rom_addr) {
+        int align_cmp_offset = ld->cmp_offset & ~15;
+        data_cache_hit_invalidate(ld->buf+align_cmp_offset, bufsize-align_cmp_offset);
+    }
+    return ld;
+}
+
+/** @brief Transfer the next piece of a file. Returns true if all data has been requested. */
+static bool async_transfer(asset_loader_t *ld, uint8_t *dst, uint32_t offset, int total)
+{
+    int n = total - ld->loaded;
+    if (n > ASSET_ASYNC_DMA_CHUNK) n = ASSET_ASYNC_DMA_CHUNK;
+    if (n > 0) {
+        if (ld->rom_addr)
+            dma_read_async(dst + ld->loaded, ld->rom_addr + offset + ld->loaded, n);
+        else
+            read(ld->fd, dst + ld->loaded, n);
+        ld->loaded += n;
+    }
+    return ld->loaded == total;
+}
+
+static bool async_step(asset_loader_t *ld)
+{
+    uint32_t t;
+
+    switch (ld->kind) {
+    case ASYNC_RAW:
+        // Wait for the previous piece to arrive before requesting the next one
+        if (ld->rom_addr && async_pi_busy())
+            return false;
+        ld->done = ld->loaded;
+        if (ld->done == ld->size)
+            return true;
+        async_transfer(ld, ld->buf, 0, ld->size);
+        if (!ld->rom_addr)
+            ld->done = ld->loaded;
+        return ld->done == ld->size;
+
+    case ASYNC_INPLACE:
+        if (ld->rom_addr && async_pi_busy())
+            return false;
+        if (!async_transfer(ld, ld->buf + ld->cmp_offset, sizeof(asset_header_t), ld->header.cmp_size))
+            return false;
+
+        // The last piece is still being transferred: the decompressor will
+        // race with it, exactly like asset_load() does.
+        t = TICKS_READ();
+        int n = ld->algo->decompress_full_inplace(ld->buf + ld->cmp_offset, ld->header.cmp_size, ld->buf, ld->size); (void)n;
+        assertf(n == ld->size, "asset: decompression error on file %s: corrupted? (%d/%d)", ld->fn, n, ld->size);
+        ld->stats.decompress_ticks += TICKS_SINCE(t);
+        ld->done = ld->size;
+        return true;
+
+    case ASYNC_CHUNKED: {
+        int i = ld->next_block;
+        if (i == ld->index->num_blocks)
+            return true;
+
+        // The block is transferred while the previous one is decompressed.
+        // If it has not arrived yet, give control back to the caller.
+        if (ld->rom_addr && async_pi_busy())
+            return false;
+        if (!ld->rom_addr)
+            async_block_fetch(ld, i);
+
+        // Start fetching the next block before decompressing the current one,
+        // so that the transfer overlaps decompression. The decompressors race
+        // with any DMA in flight whose destination is below the source data,
+        // so this is done only when the next slot lies above the current one;
+        // otherwise the transfer is started right after decompression, and
+        // will overlap with whatever the caller does until the next poll.
+        bool prefetch = ld->rom_addr && i+1 < ld->index->num_blocks;
+        bool early = prefetch && (i & 1) == 0;
+        if (early)
+            async_block_fetch(ld, i+1);
+
+        int pos = i * ld->index->block_size;
+        int len = ld->size - pos < ld->index->block_size ? ld->size - pos : ld->index->block_size;
+        int cmp_size = ld->index->offsets[i+1] - ld->index->offsets[i];
+        t = TICKS_READ();
+        int n = ld->algo->decompress_full_inplace(async_block_ptr(ld, i), cmp_size, ld->buf + pos, len); (void)n;
+        assertf(n == len, "asset: decompression error on file %s: corrupted? (block %d: %d/%d)", ld->fn, i, n, len);
+        ld->stats.decompress_ticks += TICKS_SINCE(t);
+
+        if (prefetch && !early)
+            async_block_fetch(ld, i+1);
+        ld->next_block++;
+        ld->done = pos + len;
+        return ld->next_block == ld->index->num_blocks;
+    }
+
+    case ASYNC_SYNC:
+        t = TICKS_READ();
+        close(ld->fd);
+        ld->fd = -1;
+        ld->buf = asset_load(ld->fn, &ld->size);
+        ld->stats.decompress_ticks += TICKS_SINCE(t);
+        ld->done = ld->size;
+        return true;
+    }
+    return false;
+}
+
+bool asset_load_poll(asset_loader_t *ld, int *progress)
+{
+    if (!ld->finished) {
+        uint32_t t = TICKS_READ();
+        ld->finished = async_step(ld);
+        ld->stats.cpu_ticks += TICKS_SINCE(t);
+        ld->stats.num_polls++;
+        if (ld->finished)
+            ld->stats.total_ticks = TICKS_SINCE(ld->t0);
+    }
+    if (progress) *progress = ld->done;
+    return ld->finished;
+}
+
+void* asset_load_wait(asset_loader_t *ld, int *sz, asset_load_stats_t *stats)
+{
+    while (!asset_load_poll(ld, NULL)) {}
+
+    // Make sure no DMA is still writing into buffers we are about to free
+    dma_wait();
+
+    void *buf = ld->buf;
+    if (ld->kind != ASYNC_SYNC) {
+        void *ptr = realloc(buf, ld->size); (void)ptr;
+        assertf(buf == ptr, "asset: realloc moved the buffer"); // guaranteed by newlib
+    }
+    if (sz) *sz = ld->size;
+    if (stats) *stats = ld->stats;
+
+    if (ld->fd >= 0) close(ld->fd);
+    free(ld->index);
+    free(ld->stage);
+    free(ld->fn);
+    free(ld);
+    return buf;
+}
+
 #endif /* N64 */
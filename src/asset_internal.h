@@ -15,6 +15,7 @@
 #define ASSET_FLAG_WINSIZE_128K     0x0006  ///< 128 KiB window size
 #define ASSET_FLAG_WINSIZE_256K     0x0007  ///< 256 KiB window size
 #define ASSET_FLAG_INPLACE          0x0100  ///< Decompress in-place
+#define ASSET_FLAG_CHUNKED          0x0200  ///< Data is split in independent blocks (see #asset_chunk_index_t)
 #define ASSET_ALIGNMENT             32
 
 __attribute__((used))
@@ -52,6 +53,23 @@ typedef struct {
 
 _Static_assert(sizeof(asset_header_t) == 20, "invalid sizeof(asset_header_t)");
 
+/**
+ * @brief Block index of a chunked compressed asset
+ * 
+ * Chunked assets (version '4', flag #ASSET_FLAG_CHUNKED) are made of
+ * independently compressed blocks, each one decompressing to exactly
+ * @p block_size bytes (except the last one, which can be shorter). The index
+ * follows the asset header and allows to jump directly to the block containing
+ * any given offset, so that asset_fopen() can seek freely within the file.
+ * 
+ * The header's cmp_size field covers both the index and the compressed blocks.
+ */
+typedef struct {
+    uint32_t block_size;    ///< Decompressed size of each block
+    uint32_t num_blocks;    ///< Number of blocks
+    uint32_t offsets[];     ///< Offset of each block from the start of the file (num_blocks+1 entries)
+} asset_chunk_index_t;
+
 /** @brief A decompression algorithm used by the asset library */
 typedef struct {
     int state_size;     ///< Basic size of the decompression state (without ringbuffer)
@@ -75,4 +93,26 @@ typedef struct {
 
 FILE *must_fopen(const char *fn);
 
+/**
+ * @brief Open a streaming decompressor on a compressed file
+ *
+ * This is used by DragonFS to transparently decompress files compressed
+ * by mkdfs. The stream takes ownership of the file descriptor, which is
+ * closed by #__asset_stream_close.
+ *
+ * @param fd        File descriptor, positioned at the start of the file
+ * @param sz        If not NULL, filled with the decompressed size
+ * @return          The stream, or NULL if the file is not compressed
+ */
+void *__asset_stream_open(int fd, int *sz);
+
+/** @brief Read decompressed data from a stream, return the number of bytes read */
+int __asset_stream_read(void *stream, void *buf, int len);
+
+/** @brief Seek to an absolute position within the decompressed data, return the new position or -1 on error */
+int __asset_stream_seek(void *stream, int pos);
+
+/** @brief Close a stream and its file descriptor */
+void __asset_stream_close(void *stream);
+
 #endif
@@ -6,6 +6,7 @@
 #include "n64sys.h"
 #include "dma.h"
 #include "dragonfs.h"
+#include "dfsinternal.h"
 #include "debug.h"
 #include <malloc.h>
 #endif
@@ -322,7 +323,7 @@ void* decompress_aplib_full(const char *fn, int fd, size_t cmp_size, size_t size
     uint32_t rom_addr = 0;
     #ifdef N64
 	if (strncmp(fn, "rom:/", 5) == 0) {
-		rom_addr = (dfs_rom_addr(fn+5) & 0x1fffffff) + lseek(fd, 0, SEEK_CUR);
+		rom_addr = (__dfs_rom_addr_raw(fn+5) & 0x1fffffff) + lseek(fd, 0, SEEK_CUR);
 	}
     #endif
     void *buf = memalign(ASSET_ALIGNMENT, size + 8);
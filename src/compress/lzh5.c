@@ -13,6 +13,7 @@
 #include "utils.h"
 #include "n64sys.h"
 #include "dragonfs.h"
+#include "dfsinternal.h"
 #else
 #include <stdlib.h>
 #endif
@@ -558,7 +559,7 @@ void* decompress_lzh5_full(const char *fn, FILE *fp, size_t cmp_size, size_t siz
 	uint32_t rom_addr = 0;
 	#ifdef N64
 	if (strncmp(fn, "rom:/", 5) == 0) {
-		rom_addr = (dfs_rom_addr(fn+5) & 0x1fffffff) + ftell(fp);
+		rom_addr = (__dfs_rom_addr_raw(fn+5) & 0x1fffffff) + ftell(fp);
 	}
 	#endif
 
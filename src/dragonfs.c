@@ -10,6 +10,9 @@
 #include <errno.h>
 #include <malloc.h>
 #include <stdalign.h>
+#include <alloca.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "dragonfs.h"
 #include "n64sys.h"
 #include "dma.h"
@@ -17,6 +20,7 @@
 #include "system.h"
 #include "dfsinternal.h"
 #include "rompak_internal.h"
+#include "asset_internal.h"
 #include "utils.h"
 
 /**
@@ -51,11 +55,81 @@ static uint32_t directories[MAX_DIRECTORY_DEPTH];
 static uint32_t directory_top = 0;
 /** @brief Pointer to next directory entry set when doing a directory walk */
 static directory_entry_t *next_entry = 0;
+/** @brief Bucket table of the path index (NULL if the image has no index) */
+static uint32_t *index_buckets = NULL;
+/** @brief Number of buckets in the path index */
+static uint32_t index_num_buckets = 0;
+/** @brief Location of the first entry of the path index */
+static uint32_t index_entries = 0;
+/** @brief Location of the file table (0 if the image has no file table) */
+static uint32_t index_files = 0;
+/** @brief Number of files in the file table */
+static uint32_t index_num_files = 0;
+/** @brief File table, loaded on the first access by file ID */
+static struct dfs_file_entry *file_table = NULL;
+/** @brief True if the access trace is enabled (see #dfs_trace_enable) */
+static bool trace_enabled = false;
+/** @brief Size of the read-ahead buffer for files opened via stdio (0 = disabled) */
+static int readahead_size = 0;
+/** @brief Statistics of the read-ahead buffers */
+static dfs_readahead_stats_t readahead_stats;
+/** @brief Log an event of the access trace on the debug channel, with a timestamp */
+#define TRACE(fmt, ...) ({ \
+    if (trace_enabled) debugf("dfs: trace " fmt "\n", (unsigned long)TICKS_READ(), ##__VA_ARGS__); \
+})
+/** @brief Number of open file structures allocated at once by the pool */
+#define OPENFILE_POOL_CHUNK             32
+/** @brief Free list of open file structures (linked through their first word) */
+static dfs_open_file_t *openfile_free_list = NULL;
 /** @brief Convert an open file pointer to a handle */
 #define OPENFILE_TO_HANDLE(file)        ((int)PhysicalAddr(file))
 /** @brief Convert a handle to an open file pointer */
 #define HANDLE_TO_OPENFILE(handle)      ((dfs_open_file_t*)((uint32_t)(handle) | 0x80000000))
 
+/**
+ * @brief Allocate an open file structure from the pool
+ *
+ * Open file structures are allocated in chunks, and recycled through a free
+ * list, so that opening and closing files is O(1) and does not fragment the
+ * heap, even with hundreds of files open at the same time.
+ *
+ * @return The open file structure, or NULL if out of memory
+ */
+static dfs_open_file_t *openfile_alloc(void)
+{
+    if(!openfile_free_list)
+    {
+        dfs_open_file_t *chunk = malloc(OPENFILE_POOL_CHUNK * sizeof(dfs_open_file_t));
+
+        if(!chunk)
+        {
+            return NULL;
+        }
+
+        for(int i = 0; i < OPENFILE_POOL_CHUNK; i++)
+        {
+            *(dfs_open_file_t**)&chunk[i] = i < OPENFILE_POOL_CHUNK-1 ? &chunk[i+1] : NULL;
+        }
+        openfile_free_list = chunk;
+    }
+
+    dfs_open_file_t *file = openfile_free_list;
+    openfile_free_list = *(dfs_open_file_t**)file;
+    return file;
+}
+
+/**
+ * @brief Return an open file structure to the pool
+ *
+ * @param[in] file
+ *            Open file structure allocated by #openfile_alloc
+ */
+static void openfile_free(dfs_open_file_t *file)
+{
+    *(dfs_open_file_t**)file = openfile_free_list;
+    openfile_free_list = file;
+}
+
 /**
  * @brief Read a sector from cartspace
  *
@@ -546,6 +620,228 @@ static int recurse_path(const char * const path, int mode, directory_entry_t **d
     return ret;
 }
 
+/**
+ * @brief Load the path index of the filesystem, if present
+ *
+ * The bucket table is kept in RAM, so that each lookup then requires a single
+ * DMA of the (few) entries of the bucket.
+ *
+ * @param[in] index_loc
+ *            Location of the index (0 if the image has no index)
+ */
+static void index_init(uint32_t index_loc)
+{
+    free(index_buckets);
+    free(file_table);
+    index_buckets = NULL;
+    file_table = NULL;
+    index_files = 0;
+
+    if(!index_loc)
+    {
+        /* Old image, lookups will walk the directories */
+        return;
+    }
+
+    struct dfs_index_header header __attribute__((aligned(16)));
+    data_cache_hit_writeback_invalidate(&header, sizeof(header));
+    dma_read(&header, index_loc, sizeof(header));
+
+    if(header.magic != DFS_INDEX_MAGIC || header.version < 1 || header.version > DFS_INDEX_VERSION)
+    {
+        /* Unknown index, ignore it */
+        return;
+    }
+
+    int table_size = (header.num_buckets + 1) * sizeof(uint32_t);
+    index_buckets = memalign(16, ROUND_UP(table_size, 16));
+    if(!index_buckets)
+    {
+        return;
+    }
+
+    data_cache_hit_writeback_invalidate(index_buckets, ROUND_UP(table_size, 16));
+    dma_read(index_buckets, index_loc + sizeof(header), table_size);
+
+    index_num_buckets = header.num_buckets;
+    index_entries = index_loc + sizeof(header) + table_size;
+
+    if(header.version >= 2)
+    {
+        /* The file table follows the entries */
+        index_files = index_entries + header.num_entries * sizeof(struct dfs_index_entry);
+        index_num_files = header.num_entries;
+    }
+}
+
+/**
+ * @brief Get the file table entry of a file given its ID
+ *
+ * The file table is loaded in RAM on the first call, so that all subsequent
+ * accesses require no DMA at all.
+ *
+ * @param[in] id
+ *            ID of the file (as generated by mkdfs)
+ *
+ * @return A pointer to the file table entry, or NULL if the ID is invalid
+ *         or the image has no file table.
+ */
+static struct dfs_file_entry *get_file_entry(int id)
+{
+    if(!index_files || id < 0 || id >= index_num_files)
+    {
+        return NULL;
+    }
+
+    if(!file_table)
+    {
+        int size = index_num_files * sizeof(struct dfs_file_entry);
+        file_table = memalign(16, ROUND_UP(size, 16));
+        if(!file_table)
+        {
+            return NULL;
+        }
+
+        data_cache_hit_writeback_invalidate(file_table, ROUND_UP(size, 16));
+        dma_read(file_table, index_files, size);
+    }
+
+    return &file_table[id];
+}
+
+/**
+ * @brief Look up a file through the path index
+ *
+ * The index only contains full paths, so it can be used only for absolute
+ * paths, or relative paths when the current directory is the root. Paths
+ * containing "." or ".." components are left to the directory walk too.
+ *
+ * @param[in]  path
+ *             Path of the file to find
+ * @param[out] flags
+ *             Flags of the file (as in #directory_entry::flags)
+ * @param[out] start
+ *             Location of the start of the file
+ *
+ * @return DFS_ESUCCESS if the file was found, DFS_ENOFILE if it does not exist,
+ *         or 1 if the index cannot be used for this path.
+ */
+static int index_lookup(const char *path, uint32_t *flags, uint32_t *start)
+{
+    if(!index_buckets || (path[0] != '/' && directory_top != 0))
+    {
+        return 1;
+    }
+
+    /* Hash the normalized path: no leading slash, no empty components,
+     * components truncated as done by the directory walk. */
+    uint64_t hash = DFS_HASH_INIT;
+    bool first = true;
+
+    while(*path)
+    {
+        if(*path == '/')
+        {
+            path++;
+            continue;
+        }
+
+        int len = 0;
+        while(path[len] && path[len] != '/')
+        {
+            len++;
+        }
+
+        if((len == 1 && path[0] == '.') || (len == 2 && path[0] == '.' && path[1] == '.'))
+        {
+            return 1;
+        }
+
+        if(!first)
+        {
+            hash = dfs_hash_update(hash, "/", 1);
+        }
+        hash = dfs_hash_update(hash, path, MIN(len, MAX_FILENAME_LEN));
+        first = false;
+        path += len;
+    }
+
+    uint32_t hash_hi = hash >> 32;
+    uint32_t hash_lo = hash;
+    uint32_t bucket = hash_lo & (index_num_buckets - 1);
+    uint32_t idx = index_buckets[bucket];
+    uint32_t end = index_buckets[bucket+1];
+
+    /* Fetch the entries of the bucket (usually just a few, so a single DMA) */
+    struct dfs_index_entry entries[16] __attribute__((aligned(16)));
+    while(idx < end)
+    {
+        int n = MIN(end - idx, sizeof(entries) / sizeof(entries[0]));
+
+        data_cache_hit_writeback_invalidate(entries, sizeof(entries));
+        dma_read(entries, index_entries + idx * sizeof(struct dfs_index_entry), n * sizeof(struct dfs_index_entry));
+
+        for(int i = 0; i < n; i++)
+        {
+            if(entries[i].hash_lo == hash_lo && entries[i].hash_hi == hash_hi)
+            {
+                *flags = entries[i].flags;
+                *start = entries[i].file_pointer ? entries[i].file_pointer + base_ptr : 0;
+                return DFS_ESUCCESS;
+            }
+        }
+
+        idx += n;
+    }
+
+    return DFS_ENOFILE;
+}
+
+/**
+ * @brief Find a file given its path
+ *
+ * Use the path index if possible, otherwise walk the directories.
+ *
+ * @param[in]  path
+ *             Path of the file to find
+ * @param[out] flags
+ *             Size and flags of the file (as in #directory_entry::flags)
+ * @param[out] start
+ *             Location of the start of the file
+ *
+ * @return DFS_ESUCCESS on success, or a negative error on failure.
+ */
+static int find_file(const char * const path, uint32_t *flags, uint32_t *start)
+{
+    int ret = index_lookup(path, flags, start);
+
+    if(ret == DFS_ESUCCESS)
+    {
+        return DFS_ESUCCESS;
+    }
+    if(ret != 1)
+    {
+        return ret;
+    }
+
+    directory_entry_t *dirent;
+    ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+
+    if(ret != DFS_ESUCCESS)
+    {
+        /* File not found, or other error */
+        return ret;
+    }
+
+    /* We now have the pointer to the file entry */
+    directory_entry_t t_node;
+    grab_sector(dirent, &t_node);
+
+    *flags = t_node.flags;
+    *start = get_start_location(&t_node);
+    return DFS_ESUCCESS;
+}
+
 /**
  * @brief Helper functioner to initialize the filesystem
  *
@@ -567,6 +863,9 @@ static int __dfs_init(uint32_t base_fs_loc)
         base_ptr = base_fs_loc;
         clear_directory();
 
+        /* Load the path index if present */
+        index_init(id_node.file_pointer ? id_node.file_pointer + base_ptr : 0);
+
         /* Good FS */
         return DFS_ESUCCESS;
     }
@@ -586,7 +885,14 @@ int dfs_chdir(const char * const path)
         return DFS_EBADINPUT;
     }
 
-    return recurse_path(path, WALK_CHDIR, 0, TYPE_ANY);
+    int ret = recurse_path(path, WALK_CHDIR, 0, TYPE_ANY);
+
+    /* Relative paths in the trace are resolved by mkdfs against this */
+    if(ret == DFS_ESUCCESS)
+    {
+        TRACE("chdir %lu %s", path);
+    }
+    return ret;
 }
 
 int dfs_dir_findfirst(const char * const path, char *buf)
@@ -615,7 +921,7 @@ int dfs_dir_findfirst(const char * const path, char *buf)
     /* Set up directory to point to next entry */
     next_entry = get_next_entry(&t_node);
 
-    return get_flags(&t_node);
+    return FILETYPE(get_flags(&t_node));
 }
 
 int dfs_dir_findnext(char *buf)
@@ -638,7 +944,7 @@ int dfs_dir_findnext(char *buf)
     /* Set up directory to point to next entry */
     next_entry = get_next_entry(&t_node);
 
-    return get_flags(&t_node);
+    return FILETYPE(get_flags(&t_node));
 }
 
 /**
@@ -648,6 +954,11 @@ int dfs_dir_findnext(char *buf)
  * to open the file specified.  Supports absolute and relative
  * paths
  *
+ * If the filesystem image contains a path index (created by mkdfs by
+ * default), absolute paths are resolved with a single small DMA, irrespective
+ * of the number of files in the directories. Relative paths are resolved
+ * through the index only when the current directory is the root.
+ *
  * @param[in] path
  *            Path of the file to open
  *
@@ -656,8 +967,8 @@ int dfs_dir_findnext(char *buf)
 int dfs_open(const char * const path)
 {
     /* Try to find file */
-    directory_entry_t *dirent;
-    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+    uint32_t flags, start;
+    int ret = find_file(path, &flags, &start);
 
     if(ret != DFS_ESUCCESS)
     {
@@ -666,22 +977,62 @@ int dfs_open(const char * const path)
     }
 
     /* Try to find a free slot */
-    dfs_open_file_t *file = malloc(sizeof(dfs_open_file_t));
+    dfs_open_file_t *file = openfile_alloc();
 
     if(!file)
     {
         return DFS_ENOMEM;
     }
 
-    /* We now have the pointer to the file entry */
-    directory_entry_t t_node;
-    grab_sector(dirent, &t_node);
-
     /* Set up file handle */
-    file->size = get_size(&t_node);
+    file->size = flags & 0x0FFFFFFF;
+    file->loc = 0;
+    file->cart_start_loc = start;
+    file->ra_buf = NULL;
+    file->compressed = (flags >> 28) & FLAGS_COMPRESSED;
+    file->stream = NULL;
+
+    TRACE("open %lu %x %s", OPENFILE_TO_HANDLE(file), path);
+    return OPENFILE_TO_HANDLE(file);
+}
+
+/**
+ * @brief Open a file given its ID
+ *
+ * File IDs are assigned by mkdfs, which can export them as a C header
+ * (see the --header option). Opening a file by ID does not require any
+ * path lookup: the file table is loaded in RAM on the first call, and
+ * all subsequent calls do not access the ROM at all.
+ *
+ * @param[in] id
+ *            ID of the file to open
+ *
+ * @return A valid file handle to reference the file by or a negative error on failure.
+ */
+int dfs_open_by_index(int id)
+{
+    struct dfs_file_entry *entry = get_file_entry(id);
+
+    if(!entry)
+    {
+        return index_files ? DFS_ENOFILE : DFS_EBADFS;
+    }
+
+    dfs_open_file_t *file = openfile_alloc();
+
+    if(!file)
+    {
+        return DFS_ENOMEM;
+    }
+
+    file->size = entry->flags & 0x0FFFFFFF;
     file->loc = 0;
-    file->cart_start_loc = get_start_location(&t_node);
+    file->cart_start_loc = entry->file_pointer ? entry->file_pointer + base_ptr : 0;
+    file->ra_buf = NULL;
+    file->compressed = (entry->flags >> 28) & FLAGS_COMPRESSED;
+    file->stream = NULL;
 
+    TRACE("openid %lu %x %d", OPENFILE_TO_HANDLE(file), id);
     return OPENFILE_TO_HANDLE(file);
 }
 
@@ -703,7 +1054,16 @@ int dfs_close(uint32_t handle)
     }
 
     /* Free the open file */
-    free(file);
+    if(file->ra_buf)
+    {
+        /* Make sure that no prefetch is still writing into the buffer */
+        if(file->ra_pending)
+        {
+            dma_wait();
+        }
+        free(file->ra_buf);
+    }
+    openfile_free(file);
 
     return DFS_ESUCCESS;
 }
@@ -807,51 +1167,19 @@ int dfs_tell(uint32_t handle)
 }
 
 /**
- * @brief Read data from a file
- * 
- * Note that no caching is performed: if you need to read small amounts
- * (eg: one byte at a time), consider using standard C API instead (fopen())
- * which performs internal buffering to avoid too much overhead.
- * 
+ * @brief Read data from the current location of a file, without any caching
+ *
+ * @param[in]  file
+ *             Open file to read from
  * @param[out] buf
  *             Buffer to read into
- * @param[in]  size
- *             Size of each element to read
- * @param[in]  count
- *             Number of elements to read
- * @param[in]  handle
- *             A valid file handle as returned from #dfs_open.
+ * @param[in]  to_read
+ *             Number of bytes to read (must not exceed the end of the file)
  *
- * @return The actual number of bytes read or a negative value on failure.
+ * @return The number of bytes read.
  */
-int dfs_read(void * const buf, int size, int count, uint32_t handle)
+static int read_direct(dfs_open_file_t *file, void * const buf, int to_read)
 {
-    /* This is where we do all the work */
-    dfs_open_file_t *file = HANDLE_TO_OPENFILE(handle);
-
-    if(!file)
-    {
-        return DFS_EBADHANDLE;
-    }
-
-    /* What are they doing? */
-    if(!buf)
-    {
-        return DFS_EBADINPUT;
-    }
-
-    int to_read = size * count;
-
-    /* Bounds check to make sure we don't read past the end */
-    if(file->loc + to_read > file->size)
-    {
-        /* It will, lets shorten it */
-        to_read = file->size - file->loc;
-    }
-
-    if (!to_read)
-        return 0;
-
     /* Fast-path. If possibly, we want to DMA directly into the destination
      * buffer, without using any intermediate buffers. We can do that only if
      * the buffer and the ROM location have the same 2-byte phase.
@@ -906,6 +1234,57 @@ int dfs_read(void * const buf, int size, int count, uint32_t handle)
     return (void*)data - buf;
 }
 
+/**
+ * @brief Read data from a file
+ * 
+ * Note that no caching is performed: if you need to read small amounts
+ * (eg: one byte at a time), consider using standard C API instead (fopen())
+ * which performs internal buffering to avoid too much overhead.
+ * 
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  size
+ *             Size of each element to read
+ * @param[in]  count
+ *             Number of elements to read
+ * @param[in]  handle
+ *             A valid file handle as returned from #dfs_open.
+ *
+ * @return The actual number of bytes read or a negative value on failure.
+ */
+int dfs_read(void * const buf, int size, int count, uint32_t handle)
+{
+    /* This is where we do all the work */
+    dfs_open_file_t *file = HANDLE_TO_OPENFILE(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    /* What are they doing? */
+    if(!buf)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    int to_read = size * count;
+
+    /* Bounds check to make sure we don't read past the end */
+    if(file->loc + to_read > file->size)
+    {
+        /* It will, lets shorten it */
+        to_read = file->size - file->loc;
+    }
+
+    if (!to_read)
+        return 0;
+
+    TRACE("read %lu %x %lu %d", (int)handle, (unsigned long)file->loc, to_read);
+
+    return read_direct(file, buf, to_read);
+}
+
 /**
  * @brief Return the file size of an open file
  *
@@ -941,15 +1320,18 @@ int dfs_size(uint32_t handle)
  * @param[in] path
  *            Name of the file
  *
+ * Files compressed by mkdfs (see `--compress`) cannot be accessed this way,
+ * as their ROM contents are compressed: this function asserts on them.
+ *
  * @return A pointer to the physical address of the file body, or 0
- *         if the file was not found.
+ *         if the file was not found or is compressed.
  * 
  */
 uint32_t dfs_rom_addr(const char *path)
 {
     /* Try to find file */
-    directory_entry_t *dirent;
-    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+    uint32_t flags, start;
+    int ret = find_file(path, &flags, &start);
 
     if(ret != DFS_ESUCCESS)
     {
@@ -957,12 +1339,67 @@ uint32_t dfs_rom_addr(const char *path)
         return 0;
     }
 
-    /* We now have the pointer to the file entry */
-    directory_entry_t t_node;
-    grab_sector(dirent, &t_node);
+    if((flags >> 28) & FLAGS_COMPRESSED)
+    {
+        assertf(0, "dfs_rom_addr: %s is compressed by mkdfs and cannot be accessed by ROM address", path);
+        return 0;
+    }
+
+    TRACE("addr %lu %s", path);
 
     /* Return the starting location in ROM */
-    return get_start_location(&t_node);
+    return start;
+}
+
+uint32_t __dfs_rom_addr_raw(const char *path)
+{
+    uint32_t flags, start;
+
+    if(find_file(path, &flags, &start) != DFS_ESUCCESS)
+    {
+        return 0;
+    }
+
+    TRACE("addr %lu %s", path);
+    return start;
+}
+
+/**
+ * @brief Return the physical address and size of a file given its ID
+ *
+ * This is the equivalent of #dfs_rom_addr for a file ID (see
+ * #dfs_open_by_index).
+ *
+ * @param[in]  id
+ *             ID of the file
+ * @param[out] size
+ *             If not NULL, will contain the size of the file in bytes
+ *
+ * @return A pointer to the physical address of the file body, or 0
+ *         if the ID is invalid or the file is compressed.
+ */
+uint32_t dfs_rom_addr_by_index(int id, int *size)
+{
+    struct dfs_file_entry *entry = get_file_entry(id);
+
+    if(!entry)
+    {
+        return 0;
+    }
+
+    if((entry->flags >> 28) & FLAGS_COMPRESSED)
+    {
+        assertf(0, "dfs_rom_addr_by_index: file %d is compressed by mkdfs and cannot be accessed by ROM address", id);
+        return 0;
+    }
+
+    if(size)
+    {
+        *size = entry->flags & 0x0FFFFFFF;
+    }
+
+    TRACE("addrid %lu %d", id);
+    return entry->file_pointer ? entry->file_pointer + base_ptr : 0;
 }
 
 /**
@@ -1008,7 +1445,7 @@ static void *__open( char *name, int flags )
     /* Always want a consistent interface */
     dfs_chdir("/");
 
-    /* We disregard flags here */
+    /* We disregard flags here, except for DFS_O_RAW */
     int handle = dfs_open( name );
     if (handle <= 0) {
         switch (handle) {
@@ -1021,6 +1458,39 @@ static void *__open( char *name, int flags )
         }
         return NULL;
     }
+
+    dfs_open_file_t *file = HANDLE_TO_OPENFILE(handle);
+
+    /* Compressed files are transparently decompressed. The decompressor
+     * reads the compressed data through a second, raw file descriptor. */
+    if (file->compressed && !(flags & DFS_O_RAW)) {
+        char *raw_name = alloca(strlen(name) + 6);
+        sprintf(raw_name, "rom:/%s", name);
+
+        int fd = open(raw_name, O_RDONLY | DFS_O_RAW);
+        int size = 0;
+        file->stream = fd >= 0 ? __asset_stream_open(fd, &size) : NULL;
+        if (!file->stream) {
+            if (fd >= 0) close(fd);
+            dfs_close(handle);
+            errno = EIO;
+            return NULL;
+        }
+
+        /* From now on, the handle tracks the position in the decompressed data */
+        file->size = size;
+        return (void *)handle;
+    }
+
+    /* Allocate the read-ahead buffer, if enabled. There is no need for it
+     * to be larger than the file itself. */
+    if (readahead_size > 0 && file->size > 0) {
+        file->ra_size = ROUND_UP(MIN(file->size, (uint32_t)readahead_size), 16);
+        file->ra_buf = memalign(16, file->ra_size);
+        file->ra_rom = 0;
+        file->ra_len = 0;
+        file->ra_pending = false;
+    }
     return (void *)handle;
 }
 
@@ -1068,11 +1538,60 @@ static int __fstat( void *file, struct stat *st )
  */
 static int __lseek( void *file, int ptr, int dir )
 {
+    dfs_open_file_t *f = HANDLE_TO_OPENFILE(file);
+    uint32_t old_loc = f->loc;
+
     dfs_seek( (uint32_t)file, ptr, dir );
 
+    /* Move the decompression stream to the new position */
+    if (f->stream && f->loc != old_loc && __asset_stream_seek(f->stream, f->loc) < 0) {
+        f->loc = old_loc;
+        errno = EINVAL;
+        return -1;
+    }
+
     return dfs_tell( (uint32_t)file );
 }
 
+/**
+ * @brief Fill the read-ahead buffer of a file
+ *
+ * @param[in] file
+ *            Open file with a read-ahead buffer
+ * @param[in] rom
+ *            ROM address of the data to read (must be within the file)
+ * @param[in] async
+ *            If true, just start the DMA without waiting for it
+ */
+static void readahead_fill(dfs_open_file_t *file, uint32_t rom, bool async)
+{
+    /* Start at an even address, so that the DMA can go straight into
+     * the (aligned) buffer. */
+    uint32_t start = rom & ~1;
+    uint32_t end = MIN(start + file->ra_size, file->cart_start_loc + file->size);
+
+    if (file->ra_pending) {
+        dma_wait();
+        file->ra_pending = false;
+    }
+
+    file->ra_rom = start;
+    file->ra_len = end > start ? end - start : 0;
+    if (!file->ra_len)
+        return;
+
+    /* The buffer is not accessed by the CPU until the DMA is finished, so
+     * it is enough to invalidate it once here. */
+    data_cache_hit_invalidate(file->ra_buf, file->ra_size);
+    dma_read_async(file->ra_buf, (start | 0x10000000) & 0x1FFFFFFF, file->ra_len);
+    if (async) {
+        file->ra_pending = true;
+        readahead_stats.prefetches++;
+    } else {
+        dma_wait();
+    }
+}
+
 /**
  * @brief Newlib-compatible read
  *
@@ -1087,7 +1606,66 @@ static int __lseek( void *file, int ptr, int dir )
  */
 static int __read( void *file, uint8_t *ptr, int len )
 {
-    return dfs_read( ptr, 1, len, (uint32_t)file );
+    dfs_open_file_t *f = HANDLE_TO_OPENFILE(file);
+
+    if (f->stream) {
+        if (len > (int)(f->size - f->loc))
+            len = f->size - f->loc;
+        int n = len > 0 ? __asset_stream_read(f->stream, ptr, len) : 0;
+        if (n > 0) f->loc += n;
+        return n;
+    }
+
+    if (!f->ra_buf || !ptr)
+        return dfs_read( ptr, 1, len, (uint32_t)file );
+
+    if (f->loc + len > f->size)
+        len = f->size - f->loc;
+    if (len <= 0)
+        return 0;
+
+    TRACE("read %lu %x %lu %d", (int)file, (unsigned long)f->loc, len);
+
+    bool miss = false;
+    uint8_t *data = ptr;
+
+    while (len > 0) {
+        uint32_t rom = f->cart_start_loc + f->loc;
+
+        if (rom >= f->ra_rom && rom < f->ra_rom + f->ra_len) {
+            /* Serve the data from the buffer, waiting for the prefetch if
+             * it is still in progress. */
+            int n = MIN((uint32_t)len, f->ra_rom + f->ra_len - rom);
+            if (f->ra_pending) {
+                dma_wait();
+                f->ra_pending = false;
+            }
+            memcpy(data, f->ra_buf + (rom - f->ra_rom), n);
+            f->loc += n; data += n; len -= n;
+
+            /* If the buffer has been consumed, start prefetching the next
+             * chunk of the file, which will be likely needed by the next read. */
+            if (rom + n == f->ra_rom + f->ra_len)
+                readahead_fill(f, f->ra_rom + f->ra_len, true);
+            continue;
+        }
+
+        miss = true;
+
+        /* Large reads go straight into the destination buffer */
+        if (len >= f->ra_size) {
+            data += read_direct(f, data, len);
+            break;
+        }
+
+        readahead_fill(f, rom, false);
+    }
+
+    if (miss)
+        readahead_stats.misses++;
+    else
+        readahead_stats.hits++;
+    return data - ptr;
 }
 
 /**
@@ -1100,6 +1678,11 @@ static int __read( void *file, uint8_t *ptr, int len )
  */
 static int __close( void *file )
 {
+    dfs_open_file_t *f = HANDLE_TO_OPENFILE(file);
+
+    /* Close the decompression stream and its raw file descriptor */
+    if (f->stream)
+        __asset_stream_close(f->stream);
     return dfs_close( (uint32_t)file );
 }
 
@@ -1245,6 +1828,26 @@ int dfs_init(uint32_t base_fs_loc)
     return DFS_ESUCCESS;
 }
 
+void dfs_set_readahead(int size)
+{
+    readahead_size = size;
+}
+
+void dfs_get_readahead_stats(dfs_readahead_stats_t *stats)
+{
+    *stats = readahead_stats;
+}
+
+void dfs_reset_readahead_stats(void)
+{
+    memset(&readahead_stats, 0, sizeof(readahead_stats));
+}
+
+void dfs_trace_enable(bool enable)
+{
+    trace_enabled = enable;
+}
+
 /**
  * @brief Convert DFS error code into an error string
  */
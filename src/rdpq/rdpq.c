@@ -468,6 +468,7 @@ void rdpq_init()
     rdpq_config = RDPQ_CFG_DEFAULT;
     rdpq_tracking.autosync = 0;
     rdpq_tracking.mode_freeze = false;
+    rdpq_tracking.tlut_id = 0;
 
     // Register an interrupt handler for DP interrupts, and activate them.
     register_DP_handler(__rdpq_interrupt);
@@ -586,6 +587,10 @@ extern inline void __rdpq_autosync_use(uint32_t res);
  * The SYNC command will then reset the "use" status of each respective resource.
  */
 void __rdpq_autosync_change(uint32_t res) {
+    // A TMEM load might overwrite the palettes
+    if (res & AUTOSYNC_TMEMS)
+        rdpq_tracking.tlut_id = 0;
+
     res &= rdpq_tracking.autosync;
     if (res) {
         if ((res & AUTOSYNC_TILES) && (rdpq_config & RDPQ_CFG_AUTOSYNCTILE))
@@ -780,6 +785,8 @@ void __rdpq_block_run(rdpq_block_t *block)
             // we don't know the cycle type after we run the block
             .cycle_type_known = 0,
             .cycle_type_frozen = 0,
+            // we don't know which palettes are loaded in TMEM
+            .tlut_id = 0,
         };
     }
 }
@@ -16,6 +16,8 @@ extern bool __rdpq_inited;
 
 /** @brief Public rdpq_fence API, redefined it */
 extern void rdpq_fence(void);
+/** @brief Public rdpq_sync_full API, redefined it */
+extern void rdpq_sync_full(void (*callback)(void*), void* arg);
 
 ///@cond
 typedef struct rdpq_block_s rdpq_block_t;
@@ -56,6 +58,15 @@ typedef struct {
     /** @brief 0=unknown, 1=standard, 2=copy/fill  */
     uint8_t cycle_type_known : 2;
     uint8_t cycle_type_frozen : 2;
+    /**
+     * @brief Shared palette currently loaded in TMEM (0 = unknown).
+     * 
+     * This is set by rdpq_sprite when it uploads the palette of a sprite
+     * with a palette ID (see #sprite_get_palette_id), and combines the ID
+     * with the TLUT slot. Any TMEM load resets it, except for color-indexed
+     * textures loaded by rdpq_tex, as they cannot overlap the palettes.
+     */
+    uint32_t tlut_id;
 } rdpq_tracking_t;
 
 extern rdpq_tracking_t rdpq_tracking;
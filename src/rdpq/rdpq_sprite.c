@@ -8,6 +8,7 @@
 #include "rdpq.h"
 #include "rdpq_sprite.h"
 #include "rdpq_sprite_internal.h"
+#include "rdpq_internal.h"
 #include "rdpq_mode.h"
 #include "rdpq_tex.h"
 #include "sprite.h"
@@ -26,11 +27,23 @@ static void sprite_upload_palette(sprite_t *sprite, int palidx, bool set_mode)
 
     if (tlut_mode != TLUT_NONE) {
         // Load the palette (if any). We account for sprites being CI4
-        // but without embedded palette: mksprite doesn't create sprites like
-        // this today, but it could in the future (eg: sharing a palette across
-        // multiple sprites).
+        // but without embedded palette.
         uint16_t *pal = sprite_get_palette(sprite);
-        if (pal) rdpq_tex_upload_tlut(pal, palidx*16, fmt == FMT_CI4 ? 16 : 256);
+        if (!pal) return;
+
+        // If the palette is shared with other sprites (mksprite --palette-group),
+        // skip the upload when the same palette is still loaded in the same slot.
+        // Slot 16 is used for CI8, whose palette covers the whole TLUT area.
+        uint32_t tlut_id = 0;
+        uint16_t pal_id = sprite_get_palette_id(sprite);
+        if (pal_id) {
+            tlut_id = (pal_id << 5) | (fmt == FMT_CI4 ? palidx : 16);
+            if (rdpq_tracking.tlut_id == tlut_id)
+                return;
+        }
+
+        rdpq_tex_upload_tlut(pal, palidx*16, fmt == FMT_CI4 ? 16 : 256);
+        rdpq_tracking.tlut_id = tlut_id;
     }
 }
 
@@ -12,6 +12,7 @@
 #include "rdpq_rect.h"
 #include "rdpq_tex.h"
 #include "rdpq_tex_internal.h"
+#include "rdpq_internal.h"
 #include "utils.h"
 #include <math.h>
 
@@ -320,10 +321,19 @@ int tex_loader_load(tex_loader_t *tload, int s0, int t0, int s1, int t1)
     assertf(s0 <= s1, "Invalid texture load: s0:%d s1:%d", s0, s1);
     assertf(t0 <= t1, "Invalid texture load: t0:%d t1:%d", t0, t1);
     int mem = texload_set_rect(tload, s0, t0, s1, t1);
+
+    // Color-indexed textures live in the lower half of TMEM, so loading
+    // them does not affect the palettes currently loaded.
+    tex_format_t fmt = surface_get_format(tload->tex);
+    uint32_t tlut_id = rdpq_tracking.tlut_id;
+
     if (tload->rect.can_load_block && (t0 & 1) == 0)
         tload->load_block(tload, s0, t0, s1, t1);
     else
         tload->load_tile(tload, s0, t0, s1, t1);
+
+    if (fmt == FMT_CI4 || fmt == FMT_CI8)
+        rdpq_tracking.tlut_id = tlut_id;
     return mem;
 }
 
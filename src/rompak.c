@@ -12,6 +12,11 @@
 #include <stdlib.h>
 
 #define TOC_MAGIC    0x544F4330         ///< Magic ID "TOC0"
+#define TOC_MAX_SIZE        1024        ///< Maximum size of the TOC (as created by n64tool)
+#define TOC_MIN_ENTRY_SIZE  8           ///< Minimum size of an entry (offset + a short name)
+#define TOC_MAX_ENTRIES     ((TOC_MAX_SIZE - sizeof(header_t)) / TOC_MIN_ENTRY_SIZE)  ///< Maximum number of entries
+#define TOC_HASH_BUCKETS    16          ///< Number of buckets in the hash tables (power of two)
+#define TOC_HASH_END        0xFF        ///< End of a hash chain
 
 /** @brief ROMPAK TOC header */
 typedef struct {
@@ -27,6 +32,48 @@ typedef struct {
     char name[];            ///< Name of the file
 } entry_t;
 
+/**
+ * @brief TOC cached in RAM
+ * 
+ * The TOC is read with a single DMA the first time it is needed. Entries are
+ * then indexed by two small hash tables (one on the full name, one on the
+ * extension), so that lookups do not need any further PI access. The cache
+ * is statically allocated because lookups can happen in the exception
+ * handler (eg: symbolizing a backtrace), where the heap cannot be trusted.
+ */
+static struct {
+    bool loaded;                                    ///< True if the TOC has been loaded (or is missing)
+    header_t header;                                ///< Header of the TOC (num_entries is 0 if missing)
+    uint8_t name_bucket[TOC_HASH_BUCKETS];          ///< First entry of each bucket (hash of the name)
+    uint8_t ext_bucket[TOC_HASH_BUCKETS];           ///< First entry of each bucket (hash of the extension)
+    uint8_t name_next[TOC_MAX_ENTRIES];             ///< Next entry in the same name bucket
+    uint8_t ext_next[TOC_MAX_ENTRIES];              ///< Next entry in the same extension bucket
+    alignas(16) uint8_t data[TOC_MAX_SIZE];         ///< Raw TOC (header + entries)
+} toc;
+
+/** @brief FNV-1a hash of a string */
+static uint32_t name_hash(const char *s)
+{
+    uint32_t hash = 0x811c9dc5;
+    while (*s) {
+        hash ^= (uint8_t)*s++;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+/** @brief Extension of a file name, including the dot (empty string if none) */
+static const char *name_ext(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext ? ext : name + strlen(name);
+}
+
+static entry_t* toc_entry(int idx)
+{
+    return (entry_t*)(toc.data + sizeof(header_t) + idx * toc.header.entry_size);
+}
+
 static bool extension_match(const char *ext, const char *name)
 {
     int ext_len = strlen(ext);
@@ -37,57 +84,100 @@ static bool extension_match(const char *ext, const char *name)
     return strcmp(ext, name + name_len - ext_len) == 0;
 }
 
-uint32_t rompak_search_ext(const char *ext)
+static void toc_load(void)
 {
-    static bool rompak_corrupted = false;
-    static uint32_t toc_addr = 0;
+    toc.loaded = true;
+    memset(toc.name_bucket, TOC_HASH_END, sizeof(toc.name_bucket));
+    memset(toc.ext_bucket, TOC_HASH_END, sizeof(toc.ext_bucket));
 
-    if (rompak_corrupted) {
-        return 0;
-    }
+    // Search for TOC at the beginning of ROM. We want to be lenient to
+    // various IPL3 shenigans (eg: IPL3 that doesn't load at 0x1000). In
+    // the standard situation, the TOC is at 0x1000 immediately after IPL3,
+    // and that's the first position where we look. We then search for
+    // a few 16-byte aligned addresses just in case, before punting
+    const int TOC_ADDR = 0x10001000;
+    uint32_t toc_addr = 0;
 
-    if (toc_addr == 0) {
-        // Search for TOC at the beginning of ROM. We want to be lenient to
-        // various IPL3 shenigans (eg: IPL3 that doesn't load at 0x1000). In
-        // the standard situation, the TOC is at 0x1000 immediately after IPL3,
-        // and that's the first position where we look. We then search for
-        // a few 16-byte aligned addresses just in case, before punting
-        const int TOC_ADDR = 0x10001000;
-
-        for (int i=0; i<1024; i++) {
-            if (io_read(TOC_ADDR + i*16) == TOC_MAGIC) {
-                toc_addr = TOC_ADDR + i*16;
-                break;
-            }
-        }
-        if (!toc_addr) {
-            rompak_corrupted = true;
-            return 0;
+    for (int i=0; i<1024; i++) {
+        if (io_read(TOC_ADDR + i*16) == TOC_MAGIC) {
+            toc_addr = TOC_ADDR + i*16;
+            break;
         }
     }
+    if (!toc_addr)
+        return;
 
-    header_t header;
-    data_cache_hit_writeback_invalidate(&header, sizeof(header_t));
-    dma_read(&header, toc_addr, sizeof(header_t));
+    header_t *header = (header_t*)toc.data;
+    data_cache_hit_writeback_invalidate(toc.data, sizeof(toc.data));
+    dma_read(toc.data, toc_addr, sizeof(toc.data));
 
-    // These asserts prevent a miscompiled TOC from causing a hard-to-diagnose
-    // stack overflow because of alloca. The number 1024 is arbitrary, we just
+    // These asserts prevent a miscompiled TOC from causing out-of-bounds
+    // accesses to the cache. The TOC created by n64tool is always 1 KiB; we just
     // want to protect against important corruptions (eg: little-endian / big-endian mistakes).
-    if (header.entry_size >= 1024 || header.num_entries >= 1024) {
-        rompak_corrupted = true;
-        assertf(header.entry_size < 1024, "Corrupted rompak TOC: entry size too big (0x%lx)", header.entry_size);
-        assertf(header.num_entries < 1024, "Corrupted rompak TOC: too many entries (0x%lx)", header.num_entries);
-        return 0;
+    if (header->entry_size < TOC_MIN_ENTRY_SIZE || header->entry_size >= TOC_MAX_SIZE ||
+        header->num_entries > (TOC_MAX_SIZE - sizeof(header_t)) / header->entry_size) {
+        assertf(header->entry_size >= TOC_MIN_ENTRY_SIZE && header->entry_size < TOC_MAX_SIZE,
+            "Corrupted rompak TOC: invalid entry size (0x%lx)", header->entry_size);
+        assertf(header->num_entries <= (TOC_MAX_SIZE - sizeof(header_t)) / header->entry_size,
+            "Corrupted rompak TOC: too many entries (0x%lx)", header->num_entries);
+        return;
     }
 
-    entry_t *entry = alloca(header.entry_size);
-    for (int i=0; i < header.num_entries; i++) {
-        data_cache_hit_writeback_invalidate(entry, header.entry_size);
-        dma_read(entry, toc_addr + sizeof(header_t) + i*header.entry_size, header.entry_size);
+    toc.header = *header;
 
-        if (extension_match(ext, entry->name))
+    // Insert the entries in reverse order, so that chains are in TOC order and
+    // lookups return the first matching file, as a linear scan would.
+    for (int i=toc.header.num_entries-1; i >= 0; i--) {
+        entry_t *entry = toc_entry(i);
+        entry->name[toc.header.entry_size - sizeof(entry_t) - 1] = 0;
+
+        int nb = name_hash(entry->name) & (TOC_HASH_BUCKETS-1);
+        toc.name_next[i] = toc.name_bucket[nb];
+        toc.name_bucket[nb] = i;
+
+        int eb = name_hash(name_ext(entry->name)) & (TOC_HASH_BUCKETS-1);
+        toc.ext_next[i] = toc.ext_bucket[eb];
+        toc.ext_bucket[eb] = i;
+    }
+}
+
+uint32_t rompak_search_ext(const char *ext)
+{
+    if (!toc.loaded)
+        toc_load();
+
+    // The hash table indexes the extension after the last dot. Multi-dot
+    // extensions (eg: ".z64.sym") are matched by scanning the cached entries.
+    if (ext[0] != '.' || strchr(ext+1, '.')) {
+        for (int i=0; i < toc.header.num_entries; i++) {
+            entry_t *entry = toc_entry(i);
+            if (extension_match(ext, entry->name))
+                return 0x10000000 + entry->offset;
+        }
+        return 0;
+    }
+
+    int idx = toc.ext_bucket[name_hash(ext) & (TOC_HASH_BUCKETS-1)];
+    while (idx != TOC_HASH_END) {
+        entry_t *entry = toc_entry(idx);
+        if (strcmp(ext, name_ext(entry->name)) == 0)
             return 0x10000000 + entry->offset;
+        idx = toc.ext_next[idx];
     }
+    return 0;
+}
 
+uint32_t rompak_search_name(const char *name)
+{
+    if (!toc.loaded)
+        toc_load();
+
+    int idx = toc.name_bucket[name_hash(name) & (TOC_HASH_BUCKETS-1)];
+    while (idx != TOC_HASH_END) {
+        entry_t *entry = toc_entry(idx);
+        if (strcmp(name, entry->name) == 0)
+            return 0x10000000 + entry->offset;
+        idx = toc.name_next[idx];
+    }
     return 0;
 }
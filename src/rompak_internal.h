@@ -25,6 +25,9 @@
  * should not typically use rompak directly, but rather use the
  * DragonFS (which is itself a single file in the rompak).
  * 
+ * The TOC is read from ROM only once, the first time a file is searched, and
+ * then kept in RAM, so that lookups are cheap and do not access the PI bus.
+ * 
  * @{
  */
 
@@ -43,6 +46,16 @@
  */
 uint32_t rompak_search_ext(const char *ext);
 
+/**
+ * @brief Search a file in the rompak by its full name
+ * 
+ * @param name    Name of the file to search for (will be matched case
+ *                sensitively), e.g. "mygame.dfs".
+ * @return        Physical address of the file in the ROM, or 0 if the file
+ *                doesn't exist or the TOC is not present.
+ */
+uint32_t rompak_search_name(const char *name);
+
 /** @} */
 
 #endif
@@ -105,17 +105,24 @@
  * 
  * ## Buffer swapping
  * 
- * Internally, double buffering is used to implement the queue. The size of
- * each of the buffers is RSPQ_DRAM_LOWPRI_BUFFER_SIZE. When a buffer is full,
- * the queue engine writes a #RSPQ_CMD_JUMP command with the address of the
- * other buffer, to tell the RSP to jump there when it is done. 
+ * Internally, a ring of buffers is used to implement the queue. By default,
+ * the lowpri queue uses two buffers of RSPQ_DRAM_LOWPRI_BUFFER_SIZE words
+ * (double buffering), but both the size and the number of buffers can be
+ * configured via #rspq_init_config. The highpri queue always uses two buffers.
+ * When a buffer is full, the queue engine writes a #RSPQ_CMD_JUMP command with
+ * the address of the next buffer in the ring, to tell the RSP to jump there
+ * when it is done. 
  * 
- * Moreover, just before the jump, the engine also enqueue a #RSPQ_CMD_WRITE_STATUS
- * command that sets the SP_STATUS_SIG_BUFDONE_LOW signal. This is used to
- * keep track when the RSP has finished processing a buffer, so that we know
- * it becomes free again for more commands.
+ * Moreover, just before the jump, the engine also enqueues a #RSPQ_CMD_DMA
+ * command that writes 8 non-zero bytes of DMEM into the "done" flag of the
+ * buffer (an uncached array with one flag per buffer). This is used to keep
+ * track when the RSP has finished processing a buffer, so that we know it
+ * becomes free again for more commands. A single SP signal (as used in the
+ * past) is not enough to track more than two buffers.
  * 
- * This logic is implemented in #rspq_next_buffer.
+ * This logic is implemented in #rspq_next_buffer, which also accounts the
+ * number of switches and the CPU time spent waiting for a buffer to become
+ * free (see #rspq_get_buffer_stats).
  *
  * ## Blocks
  * 
@@ -143,6 +150,28 @@
  * is then used as call slot in both all future calls to the block, and by
  * the RSPQ_CMD_RET command placed at the end of the block itself.
  * 
+ * ## Recordings
+ * 
+ * Recordings (#rspq_rec_t) are blocks written with a private copy of the
+ * writer state: #rspq_rec_begin swaps all the global variables involved in
+ * writing commands (#rspq_ctx, #rspq_cur_pointer, #rspq_block, the rdpq block
+ * state, etc.) with those stored in the recording, and #rspq_rec_end swaps
+ * them back. Since the swap only touches globals and is always undone, a
+ * writer preempted by an interrupt handler that records is not affected.
+ * 
+ * #rspq_rec_submit terminates the block and appends it to a list of pending
+ * recordings (this is the only step done with interrupts disabled). The list
+ * is enqueued as block calls into the lowpri queue as soon as it is safe, that
+ * is when the caller is not in an interrupt handler, nor in highpri mode or
+ * writing a block. A single syncpoint after the calls tells when the blocks
+ * can be freed (RDP static buffers are only freed by #rspq_wait).
+ * 
+ * Recordings submitted via #rspq_rec_submit_unordered are tagged with the
+ * first overlay they use, and #rspq_rec_schedule groups consecutive unordered
+ * recordings by that tag before they are enqueued. This reduces the number of
+ * overlay loads, which the RSP counts in #rsp_queue_t (see
+ * #rspq_get_overlay_stats).
+ * 
  * ## Highpri queue
  * 
  * The high priority queue is implemented as an alternative couple of buffers,
@@ -183,6 +212,16 @@
  *    buffers, RSP will generate an interrupt to inform the debugging
  *    code that it needs to finish dumping the previous RDP buffer.
  * 
+ * ## Profiler
+ * 
+ * When RSPQ_PROFILE is enabled, the main loop reads the DP clock counter
+ * just before jumping to each command, and again when the command returns
+ * to the loop, and stores a sample (command ID, elapsed cycles, and cycles
+ * spent in RSPQ_RdpWait) in a small ring in DMEM. When the ring is full, it is
+ * flushed via DMA to a RDRAM buffer. Once per frame, #rspq_profile_next_frame
+ * waits for the RSP to go idle, accumulates both the RDRAM buffer and the
+ * partial ring into per-command statistics, and resets the RSP state.
+ * 
  */
 
 #include "rsp.h"
@@ -194,6 +233,7 @@
 #include "rdpq/rdpq_internal.h"
 #include "rdpq/rdpq_debug_internal.h"
 #include "interrupt.h"
+#include "cop0.h"
 #include "utils.h"
 #include "n64sys.h"
 #include "debug.h"
@@ -220,6 +260,14 @@ _Static_assert(RSPQ_DMEM_BUFFER_SIZE >= (RSPQ_MAX_COMMAND_SIZE + 2) * 4);
 // Check that the maximum command size is actually supported by the 
 // internal command descriptor format.
 _Static_assert(RSPQ_MAX_COMMAND_SIZE * 4 <= RSPQ_DESCRIPTOR_MAX_SIZE);
+
+// Overlay indices are stored in the overlay table as byte offsets
+// into the descriptor array, within a 4-bit ID space.
+_Static_assert(RSPQ_MAX_OVERLAY_COUNT <= RSPQ_OVERLAY_ID_COUNT);
+
+// The buffer done flag is written via DMA from rspq_dram_addr, which
+// must thus be 8-byte aligned in DMEM (see rspq_next_buffer).
+_Static_assert((RSPQ_DATA_ADDRESS + offsetof(rsp_queue_t, rspq_dram_addr)) % 8 == 0);
 /// @endcond
 
 /** @brief Smaller version of rspq_write that writes to an arbitrary pointer */
@@ -243,6 +291,18 @@ _Static_assert(RSPQ_MAX_COMMAND_SIZE * 4 <= RSPQ_DESCRIPTOR_MAX_SIZE);
     ptr += 3; \
 })
 
+/** @brief Smaller version of rspq_write that writes to an arbitrary pointer */
+#define rspq_append4(ptr, cmd, arg1, arg2, arg3, arg4) ({ \
+    ((volatile uint32_t*)(ptr))[1] = (arg2); \
+    ((volatile uint32_t*)(ptr))[2] = (arg3); \
+    ((volatile uint32_t*)(ptr))[3] = (arg4); \
+    ((volatile uint32_t*)(ptr))[0] = ((cmd)<<24) | (arg1); \
+    ptr += 4; \
+})
+
+/** @brief Number of words reserved at the end of each queue buffer (DMA + JUMP, see #rspq_next_buffer) */
+#define RSPQ_BUFFER_EPILOG_SIZE  5
+
 static void rspq_crash_handler(rsp_snapshot_t *state);
 static void rspq_assert_handler(rsp_snapshot_t *state, uint16_t assert_code);
 
@@ -273,8 +333,8 @@ rsp_ucode_t *rspq_overlay_ucodes[RSPQ_MAX_OVERLAY_COUNT];
  * 
  * This structure contains the state of a RSP queue as it is built by the CPU.
  * It is instantiated two times: one for the lwopri queue, and one for the
- * highpri queue. It contains the two buffers used in the double buffering
- * scheme, and some metadata about the queue.
+ * highpri queue. It contains the ring of buffers used by the queue, and some
+ * metadata about the queue.
  * 
  * The current write pointer is stored in the "cur" field. The "sentinel" field
  * contains the pointer to the last byte at which a new command can start,
@@ -297,12 +357,11 @@ rsp_ucode_t *rspq_overlay_ucodes[RSPQ_MAX_OVERLAY_COUNT];
  * pointers point inside the block memory.
  */
 typedef struct {
-    void *buffers[2];                   ///< The two buffers used to build the RSP queue
+    void *buffers[RSPQ_DRAM_MAX_BUFFER_COUNT]; ///< The ring of buffers used to build the RSP queue
+    int buf_count;                      ///< Number of buffers in the ring
     int buf_size;                       ///< Size of each buffer in 32-bit words
     int buf_idx;                        ///< Index of the buffer currently being written to.
-    uint32_t sp_status_bufdone;         ///< SP status bit to signal that one buffer has been run by RSP
-    uint32_t sp_wstatus_set_bufdone;    ///< SP mask to set the bufdone bit
-    uint32_t sp_wstatus_clear_bufdone;  ///< SP mask to clear the bufdone bit
+    volatile uint64_t *buf_done;        ///< Per-buffer flags (uncached), set to non-zero by RSP when done with a buffer
     volatile uint32_t *cur;             ///< Current write pointer within the active buffer
     volatile uint32_t *sentinel;        ///< Current write sentinel within the active buffer
 } rspq_ctx_t;
@@ -328,6 +387,53 @@ rspq_block_t *rspq_block;
 /** @brief Size of the current block memory buffer (in 32-bit words). */
 static int rspq_block_size;
 
+/**
+ * @brief State of a writer, saved by #rspq_rec_begin and restored by #rspq_rec_end.
+ * 
+ * These are all the global variables that are involved in writing commands.
+ */
+typedef struct {
+    rspq_ctx_t *ctx;                    ///< Saved #rspq_ctx
+    volatile uint32_t *cur;             ///< Saved #rspq_cur_pointer
+    volatile uint32_t *sentinel;        ///< Saved #rspq_cur_sentinel
+    rspq_block_t *block;                ///< Saved #rspq_block
+    int block_size;                     ///< Saved #rspq_block_size
+    struct rspq_rec_s *rec;             ///< Saved #rspq_rec
+    rdpq_block_state_t rdp_block_state; ///< Saved rdpq block state
+    rdpq_tracking_t rdp_tracking;       ///< Saved rdpq tracking state
+} rspq_rec_state_t;
+
+/**
+ * @brief A recording (see #rspq_rec_begin).
+ * 
+ * A recording is implemented as a block which is written with its own
+ * copy of the writer state. Submitted recordings are run as blocks.
+ */
+typedef struct rspq_rec_s {
+    rspq_rec_state_t state;             ///< Recording state (or state of the interrupted writer, if active)
+    bool active;                        ///< True between #rspq_rec_begin and #rspq_rec_end
+} rspq_rec_t;
+
+/** @brief Current recording being written, or NULL. */
+static rspq_rec_t *rspq_rec;
+/** @brief First submitted recording not yet enqueued */
+static rspq_block_t *rspq_rec_pending_head;
+/** @brief Last submitted recording not yet enqueued */
+static rspq_block_t *rspq_rec_pending_tail;
+/** @brief Recordings enqueued and waiting to be freed */
+static rspq_block_t *rspq_rec_done;
+/** @brief Last SYNC_FULL enqueued after recordings with RDP commands */
+static uint32_t rspq_rec_rdp_sync;
+/** @brief Last SYNC_FULL enqueued after recordings with RDP commands that RDP has completed */
+static volatile uint32_t rspq_rec_rdp_sync_done;
+/** @brief Number of unordered recordings moved by the scheduler (see #rspq_rec_schedule) */
+static uint32_t rspq_rec_scheduled;
+/** @brief Value of the RSP overlay load counter at the last #rspq_reset_overlay_stats */
+static uint32_t rspq_overlay_loads_base;
+
+/** @brief State of block creation in rdpq (see rdpq.c) */
+extern rdpq_block_state_t rdpq_block_state;
+
 /** @brief ID that will be used for the next syncpoint that will be created. */
 static int rspq_syncpoints_genid;
 /** @brief ID of the last syncpoint reached by RSP. */
@@ -339,7 +445,18 @@ static bool rspq_is_running;
 /** @brief Dummy state used for overlay 0 */
 static uint64_t dummy_overlay_state[2];
 
+#if RSPQ_PROFILE
+/** @brief RDRAM buffer where the RSP flushes the profiling samples */
+static uint32_t *rspq_profile_buffer;
+/** @brief Profiling statistics accumulated so far */
+static rspq_profile_data_t rspq_profile_data;
+#endif
+
+/** @brief Statistics on the queue buffers (see #rspq_get_buffer_stats) */
+static rspq_buffer_stats_t rspq_buffer_stats;
+
 static void rspq_flush_internal(void);
+static void rspq_rec_run_pending(void);
 
 /** @brief RSP interrupt handler, used for syncpoints. */
 static void rspq_sp_interrupt(void) 
@@ -391,7 +508,7 @@ static void rspq_crash_handler(rsp_snapshot_t *state)
 {
     rsp_queue_t *rspq = (rsp_queue_t*)(state->dmem + RSPQ_DATA_ADDRESS);
     uint32_t cur = rspq->rspq_dram_addr + state->gpr[28];
-    uint32_t dmem_buffer = RSPQ_DEBUG ? 0x160 : 0x100;
+    uint32_t dmem_buffer = RSPQ_DMEM_BUFFER_ADDRESS;
 
     int ovl_idx; const char *ovl_name; uint8_t ovl_id;
     rspq_get_current_ovl(rspq, &ovl_idx, &ovl_id, &ovl_name);
@@ -403,12 +520,11 @@ static void rspq_crash_handler(rsp_snapshot_t *state)
     printf("RSPQ: RDP     DRAM address: %08lx\n", rspq->rspq_rdp_buffers[1]);
     printf("RSPQ: Current Overlay: %s (%x)\n", ovl_name, ovl_id);
 
-    // Dump the command queue in DMEM. In debug mode, there is a marker to check
-    // if we know the correct address. TODO: find a way to expose the symbols
-    // from rsp_queue.inc.
+    // Dump the command queue in DMEM. There is a marker to check if we know
+    // the correct address. TODO: find a way to expose the symbols from
+    // rsp_queue.inc.
     debugf("RSPQ: Command queue:\n");
-    if (RSPQ_DEBUG)
-        assertf(((uint32_t*)state->dmem)[dmem_buffer/4-1] == RSPQ_DEBUG_MARKER, 
+    assertf(((uint32_t*)state->dmem)[dmem_buffer/4-1] == RSPQ_DEBUG_MARKER, 
             "invalid RSPQ_DMEM_BUFFER address; please update rspq_crash_handler()");
     for (int j=0;j<4;j++) {        
         for (int i=0;i<16;i++)
@@ -443,7 +559,7 @@ static void rspq_assert_invalid_command(rsp_snapshot_t *state)
     int ovl_idx; const char *ovl_name; uint8_t ovl_id;
     rspq_get_current_ovl(rspq, &ovl_idx, &ovl_id, &ovl_name);
 
-    uint32_t dmem_buffer = RSPQ_DEBUG ? 0x160 : 0x100;
+    uint32_t dmem_buffer = RSPQ_DMEM_BUFFER_ADDRESS;
     uint32_t cur = dmem_buffer + state->gpr[28];
     printf("Invalid command\nCommand %02x not found in overlay %s (0x%01x)\n", state->dmem[cur], ovl_name, ovl_id);
 }
@@ -561,45 +677,65 @@ static void rspq_start(void)
 }
 
 /** @brief Initialize a rspq_ctx_t structure */
-static void rspq_init_context(rspq_ctx_t *ctx, int buf_size)
+static void rspq_init_context(rspq_ctx_t *ctx, int buf_size, int buf_count)
 {
     memset(ctx, 0, sizeof(rspq_ctx_t));
-    ctx->buffers[0] = malloc_uncached(buf_size * sizeof(uint32_t));
-    ctx->buffers[1] = malloc_uncached(buf_size * sizeof(uint32_t));
-    memset(ctx->buffers[0], 0, buf_size * sizeof(uint32_t));
-    memset(ctx->buffers[1], 0, buf_size * sizeof(uint32_t));
+    for (int i=0; i<buf_count; i++) {
+        ctx->buffers[i] = malloc_uncached(buf_size * sizeof(uint32_t));
+        memset(ctx->buffers[i], 0, buf_size * sizeof(uint32_t));
+    }
+    // All buffers start as free. Buffer 0 is the one being written, so its
+    // flag is cleared; it will be set by the RSP when it is done with it.
+    ctx->buf_done = malloc_uncached(buf_count * sizeof(uint64_t));
+    for (int i=0; i<buf_count; i++)
+        ctx->buf_done[i] = 1;
+    ctx->buf_done[0] = 0;
+    ctx->buf_count = buf_count;
     ctx->buf_idx = 0;
     ctx->buf_size = buf_size;
     ctx->cur = ctx->buffers[0];
-    ctx->sentinel = ctx->cur + buf_size - RSPQ_MAX_COMMAND_SIZE;
+    ctx->sentinel = ctx->cur + buf_size - RSPQ_MAX_COMMAND_SIZE - RSPQ_BUFFER_EPILOG_SIZE;
 }
 
 static void rspq_close_context(rspq_ctx_t *ctx)
 {
-    free_uncached(ctx->buffers[1]);
-    free_uncached(ctx->buffers[0]);
+    free_uncached((void*)ctx->buf_done);
+    for (int i=ctx->buf_count-1; i>=0; i--)
+        free_uncached(ctx->buffers[i]);
 }
 
 void rspq_init(void)
+{
+    rspq_init_config(NULL);
+}
+
+void rspq_init_config(const rspq_config_t *config)
 {
     // Do nothing if rspq_init has already been called
     if (rspq_initialized)
         return;
 
+    rspq_config_t cfg = config ? *config : (rspq_config_t){0};
+    if (!cfg.lowpri_buffer_size)  cfg.lowpri_buffer_size = RSPQ_DRAM_LOWPRI_BUFFER_SIZE;
+    if (!cfg.lowpri_buffer_count) cfg.lowpri_buffer_count = RSPQ_DRAM_LOWPRI_BUFFER_COUNT;
+    if (!cfg.highpri_buffer_size) cfg.highpri_buffer_size = RSPQ_DRAM_HIGHPRI_BUFFER_SIZE;
+    assertf(cfg.lowpri_buffer_count >= 2 && cfg.lowpri_buffer_count <= RSPQ_DRAM_MAX_BUFFER_COUNT,
+        "invalid lowpri buffer count: %d (must be 2..%d)", cfg.lowpri_buffer_count, RSPQ_DRAM_MAX_BUFFER_COUNT);
+    assertf(cfg.lowpri_buffer_size >= (RSPQ_MAX_COMMAND_SIZE + RSPQ_BUFFER_EPILOG_SIZE) * 2,
+        "lowpri buffer size too small: %d words", cfg.lowpri_buffer_size);
+    assertf(cfg.highpri_buffer_size >= (RSPQ_MAX_COMMAND_SIZE + RSPQ_BUFFER_EPILOG_SIZE) * 2,
+        "highpri buffer size too small: %d words", cfg.highpri_buffer_size);
+
     rspq_ctx = NULL;
     rspq_cur_pointer = NULL;
     rspq_cur_sentinel = NULL;
 
     // Allocate RSPQ contexts
-    rspq_init_context(&lowpri, RSPQ_DRAM_LOWPRI_BUFFER_SIZE);
-    lowpri.sp_status_bufdone = SP_STATUS_SIG_BUFDONE_LOW;
-    lowpri.sp_wstatus_set_bufdone = SP_WSTATUS_SET_SIG_BUFDONE_LOW;
-    lowpri.sp_wstatus_clear_bufdone = SP_WSTATUS_CLEAR_SIG_BUFDONE_LOW;
-
-    rspq_init_context(&highpri, RSPQ_DRAM_HIGHPRI_BUFFER_SIZE);
-    highpri.sp_status_bufdone = SP_STATUS_SIG_BUFDONE_HIGH;
-    highpri.sp_wstatus_set_bufdone = SP_WSTATUS_SET_SIG_BUFDONE_HIGH;
-    highpri.sp_wstatus_clear_bufdone = SP_WSTATUS_CLEAR_SIG_BUFDONE_HIGH;
+    rspq_init_context(&lowpri, cfg.lowpri_buffer_size, cfg.lowpri_buffer_count);
+    rspq_init_context(&highpri, cfg.highpri_buffer_size, 2);
+    rspq_reset_buffer_stats();
+    rspq_overlay_loads_base = 0;
+    rspq_rec_scheduled = 0;
 
     // Start in low-priority mode
     rspq_switch_context(&lowpri);
@@ -626,6 +762,13 @@ void rspq_init(void)
     rspq_data.tables.overlay_descriptors[0].state = PhysicalAddr(dummy_overlay_state);
     rspq_data.tables.overlay_descriptors[0].data_size = sizeof(uint64_t)*2;
     rspq_data.current_ovl = 0;
+
+#if RSPQ_PROFILE
+    rspq_profile_buffer = malloc_uncached(RSPQ_PROFILE_BUFFER_SIZE);
+    rspq_data.profile_rdram_ptr = PhysicalAddr(rspq_profile_buffer);
+    rspq_data.profile_rdram_end = rspq_data.profile_rdram_ptr + RSPQ_PROFILE_BUFFER_SIZE;
+    rspq_profile_reset();
+#endif
     
     // Init syncpoints
     rspq_syncpoints_genid = 0;
@@ -681,6 +824,24 @@ void rspq_close(void)
     rspq_close_context(&highpri);
     rspq_close_context(&lowpri);
 
+    // Free the submitted recordings. The RSP is halted, so none of them
+    // is in use anymore.
+    while (rspq_rec_done) {
+        rspq_block_t *next = rspq_rec_done->next;
+        rspq_block_free(rspq_rec_done);
+        rspq_rec_done = next;
+    }
+    while (rspq_rec_pending_head) {
+        rspq_block_t *next = rspq_rec_pending_head->next;
+        rspq_block_free(rspq_rec_pending_head);
+        rspq_rec_pending_head = next;
+    }
+    rspq_rec_pending_tail = NULL;
+
+#if RSPQ_PROFILE
+    free_uncached(rspq_profile_buffer);
+#endif
+
     set_SP_interrupt(0);
     unregister_SP_handler(rspq_sp_interrupt);
 }
@@ -818,10 +979,19 @@ static uint32_t rspq_overlay_register_internal(rsp_ucode_t *overlay_ucode, uint3
     uint32_t rspq_text_size = rsp_queue_text_end - rsp_queue_text_start;
     uint32_t rspq_data_size = rsp_queue_data_end - rsp_queue_data_start;
 
-    assertf(memcmp(rsp_queue_text_start, overlay_ucode->code, rspq_text_size) == 0,
-        "Common code of overlay %s does not match!", overlay_ucode->name);
-    assertf(memcmp(rsp_queue_data_start, overlay_ucode->data, rspq_data_size) == 0,
-        "Common data of overlay %s does not match!", overlay_ucode->name);
+    // This is checked also in release builds: the queue engine code differs
+    // depending on RSPQ_DEBUG, so an overlay built with a different setting
+    // than libdragon would otherwise silently misbehave.
+    if (memcmp(rsp_queue_text_start, overlay_ucode->code, rspq_text_size) != 0) {
+        assertf(0, "Common code of overlay %s does not match!\n"
+            "(libdragon and the overlay must be built with the same RSPQ_DEBUG / NDEBUG setting)", overlay_ucode->name);
+        abort();
+    }
+    if (memcmp(rsp_queue_data_start, overlay_ucode->data, rspq_data_size) != 0) {
+        assertf(0, "Common data of overlay %s does not match!\n"
+            "(libdragon and the overlay must be built with the same RSPQ_DEBUG / NDEBUG setting)", overlay_ucode->name);
+        abort();
+    }
 
     void *overlay_code = overlay_ucode->code + rspq_text_size;
     void *overlay_data = overlay_ucode->data + rspq_data_size;
@@ -939,8 +1109,8 @@ void rspq_overlay_unregister(uint32_t overlay_id)
  * 
  * If we're creating a block, we need to allocate a new buffer from the heap.
  * Otherwise, if we're writing into either the lowpri or the highpri queue,
- * we need to switch buffer (double buffering strategy), making sure the
- * other buffer has been already fully executed by the RSP.
+ * we need to switch to the next buffer in the ring, making sure it has
+ * been already fully executed by the RSP.
  */
 __attribute__((noinline))
 void rspq_next_buffer(void) {
@@ -966,34 +1136,43 @@ void rspq_next_buffer(void) {
     // commands.
     if (rdpq_trace) rdpq_trace();
 
-    // Wait until the previous buffer is executed by the RSP.
+    // Wait until the next buffer in the ring is executed by the RSP.
     // We cannot write to it if it's still being executed.
     // FIXME: this should probably transition to a sync-point,
     // so that the kernel can switch away while waiting. Even
     // if the overhead of an interrupt is obviously higher.
+    int prev_idx = rspq_ctx->buf_idx;
+    int next_idx = prev_idx + 1 == rspq_ctx->buf_count ? 0 : prev_idx + 1;
     MEMORY_BARRIER();
-    if (!(*SP_STATUS & rspq_ctx->sp_status_bufdone)) {
+    if (!rspq_ctx->buf_done[next_idx]) {
+        uint32_t t0 = TICKS_READ();
         rspq_flush_internal();
         RSP_WAIT_LOOP(200) {
-            if (*SP_STATUS & rspq_ctx->sp_status_bufdone)
+            if (rspq_ctx->buf_done[next_idx])
                 break;
         }
+        rspq_buffer_stats.stalls++;
+        rspq_buffer_stats.stall_ticks += TICKS_SINCE(t0);
     }
+    rspq_ctx->buf_done[next_idx] = 0;
     MEMORY_BARRIER();
-    *SP_STATUS = rspq_ctx->sp_wstatus_clear_bufdone;
-    MEMORY_BARRIER();
+    rspq_buffer_stats.buffer_switches++;
 
-    // Switch current buffer
-    rspq_ctx->buf_idx = 1-rspq_ctx->buf_idx;
-    uint32_t *new = rspq_ctx->buffers[rspq_ctx->buf_idx];
+    // Switch current buffer, keeping room for the epilog at the end.
+    rspq_ctx->buf_idx = next_idx;
+    uint32_t *new = rspq_ctx->buffers[next_idx];
     volatile uint32_t *prev = rspq_switch_buffer(new, rspq_ctx->buf_size, true);
+    rspq_cur_sentinel -= RSPQ_BUFFER_EPILOG_SIZE;
 
-    // Terminate the previous buffer with an op to set SIG_BUFDONE
+    // Terminate the previous buffer with a DMA that sets its done flag
     // (to notify when the RSP finishes the buffer), plus a jump to
-    // the new buffer.
-    rspq_append1(prev, RSPQ_CMD_WRITE_STATUS, rspq_ctx->sp_wstatus_set_bufdone);
+    // the new buffer. The DMA copies a non-zero word pair from DMEM
+    // (the current RDRAM queue address), and it is asynchronous as
+    // nothing in the RSP depends on it.
+    rspq_append4(prev, RSPQ_CMD_DMA, PhysicalAddr(&rspq_ctx->buf_done[prev_idx]),
+        RSPQ_DATA_ADDRESS + offsetof(rsp_queue_t, rspq_dram_addr), sizeof(uint64_t) - 1, 0xFFFF8000);
     rspq_append1(prev, RSPQ_CMD_JUMP, PhysicalAddr(new));
-    assert(prev+1 < (uint32_t*)(rspq_ctx->buffers[1-rspq_ctx->buf_idx]) + rspq_ctx->buf_size);
+    assert(prev <= (uint32_t*)(rspq_ctx->buffers[prev_idx]) + rspq_ctx->buf_size);
     rspq_flush_internal();
 }
 
@@ -1028,6 +1207,7 @@ void rspq_flush(void)
     // If we are recording a block, flushes can be ignored.
     if (rspq_block) return;
 
+    rspq_rec_run_pending();
     rspq_flush_internal();
     if (rdpq_trace) rdpq_trace();
 }
@@ -1109,45 +1289,64 @@ void rspq_highpri_sync(void)
     }
 }
 
-void rspq_block_begin(void)
+/** @brief Allocate a new block and redirect the write pointers into it */
+static void rspq_block_start(void)
 {
-    assertf(!rspq_block, "a block was already being created");
-    assertf(rspq_ctx != &highpri, "cannot create a block in highpri mode");
-
     // Allocate a new block (at minimum size) and initialize it.
     rspq_block_size = RSPQ_BLOCK_MIN_SIZE;
     rspq_block = malloc_uncached(sizeof(rspq_block_t) + rspq_block_size*sizeof(uint32_t));
     rspq_block->nesting_level = 0;
     rspq_block->rdp_block = NULL;
+    rspq_block->next = NULL;
+    rspq_block->syncpoint = 0;
+    rspq_block->rdp_sync = 0;
+    rspq_block->sched_key = -1;
 
     // Switch to the block buffer. From now on, all rspq_writes will
     // go into the block.
-    rspq_switch_context(NULL);
     rspq_switch_buffer(rspq_block->cmds, rspq_block_size, true);
 
     __rdpq_block_begin();
 }
 
-rspq_block_t* rspq_block_end(void)
+/** @brief Terminate the block being written, and return it */
+static rspq_block_t* rspq_block_finish(void)
 {
-    assertf(rspq_block, "a block was not being created");
-
     // Terminate the block with a RET command, encoding
     // the nesting level which is used as stack slot by RSP.
     rspq_append1(rspq_cur_pointer, RSPQ_CMD_RET, rspq_block->nesting_level<<2);
 
-    // Switch back to the normal display list
-    rspq_switch_context(&lowpri);
-
     // Save pointer to rdpq block (if any)
     rspq_block->rdp_block = __rdpq_block_end();
 
-    // Return the created block
     rspq_block_t *b = rspq_block;
     rspq_block = NULL;
     return b;
 }
 
+void rspq_block_begin(void)
+{
+    assertf(!rspq_block, "a block was already being created");
+    assertf(rspq_ctx != &highpri, "cannot create a block in highpri mode");
+
+    rspq_switch_context(NULL);
+    rspq_block_start();
+}
+
+rspq_block_t* rspq_block_end(void)
+{
+    assertf(rspq_block, "a block was not being created");
+    assertf(!rspq_rec, "cannot end a block while recording");
+
+    rspq_block_t *b = rspq_block_finish();
+
+    // Switch back to the normal display list
+    rspq_switch_context(&lowpri);
+
+    // Return the created block
+    return b;
+}
+
 void rspq_block_free(rspq_block_t *block)
 {
     // Free RDP blocks first
@@ -1221,6 +1420,286 @@ void rspq_block_run_rsp(int nesting_level)
     }    
 }
 
+/**
+ * @brief Swap the writer state stored in a recording with the global one.
+ * 
+ * When a recording is not active, its state structure contains the state
+ * of the recording itself; when it is active, it contains the state of the
+ * writer that was interrupted by #rspq_rec_begin. So swapping is all that
+ * is needed both to begin and to end recording.
+ * 
+ * The swap only touches global variables (and never the contexts), so it
+ * is transparent to a writer that was preempted in the middle of a write.
+ */
+static void rspq_rec_swap(rspq_rec_t *rec)
+{
+    rspq_rec_state_t cur = {
+        .ctx = rspq_ctx,
+        .cur = rspq_cur_pointer,
+        .sentinel = rspq_cur_sentinel,
+        .block = rspq_block,
+        .block_size = rspq_block_size,
+        .rec = rspq_rec,
+        .rdp_block_state = rdpq_block_state,
+        .rdp_tracking = rdpq_tracking,
+    };
+    rspq_rec_state_t *st = &rec->state;
+
+    rspq_ctx = st->ctx;
+    rspq_cur_pointer = st->cur;
+    rspq_cur_sentinel = st->sentinel;
+    rspq_block = st->block;
+    rspq_block_size = st->block_size;
+    rspq_rec = st->rec;
+    rdpq_block_state = st->rdp_block_state;
+    rdpq_tracking = st->rdp_tracking;
+
+    *st = cur;
+}
+
+rspq_rec_t* rspq_rec_new(void)
+{
+    rspq_rec_t *rec = malloc(sizeof(rspq_rec_t));
+    memset(rec, 0, sizeof(rspq_rec_t));
+    return rec;
+}
+
+void rspq_rec_free(rspq_rec_t *rec)
+{
+    assertf(!rec->active, "cannot free a recording while recording");
+    if (rec->state.block) {
+        rspq_rec_swap(rec);
+        rspq_block_t *block = rspq_block_finish();
+        rspq_rec_swap(rec);
+        rspq_block_free(block);
+    }
+    free(rec);
+}
+
+void rspq_rec_begin(rspq_rec_t *rec)
+{
+    assertf(!rec->active, "recording already started");
+
+    rspq_rec_swap(rec);
+    rec->active = true;
+    rspq_rec = rec;
+
+    // If the recording is empty, allocate a new block to record into.
+    if (!rspq_block)
+        rspq_block_start();
+}
+
+void rspq_rec_end(rspq_rec_t *rec)
+{
+    assertf(rec->active && rspq_rec == rec, "recording not started or not the last one started");
+
+    rec->active = false;
+    rspq_rec_swap(rec);
+}
+
+/** @brief True if the caller can write into the lowpri queue without racing with another writer */
+static bool rspq_rec_can_run(void)
+{
+    // We must not be in an interrupt handler (or with interrupts disabled,
+    // which we cannot tell apart), as we might have preempted a writer.
+    // Also, we must not be writing a block.
+    return rspq_ctx == &lowpri && !rspq_block && (C0_STATUS() & C0_STATUS_IE);
+}
+
+/** @brief RDP interrupt callback: RDP has run all the recordings before a SYNC_FULL */
+static void rspq_rec_rdp_done(void *arg)
+{
+    rspq_rec_rdp_sync_done = (uint32_t)arg;
+}
+
+/**
+ * @brief Free the submitted recordings that have been run by the RSP.
+ * 
+ * Recordings that contain RDP commands are freed only after the RDP has
+ * completed the SYNC_FULL enqueued after them (or when @p rdp_idle is true),
+ * because RDP might still be reading from their static buffers
+ * (see #__rdpq_block_end).
+ */
+static void rspq_rec_collect(bool rdp_idle)
+{
+    rspq_block_t **prev = &rspq_rec_done;
+    while (*prev) {
+        rspq_block_t *block = *prev;
+        bool rdp_done = rdp_idle || !block->rdp_block ||
+            (int32_t)(rspq_rec_rdp_sync_done - block->rdp_sync) >= 0;
+        if (rspq_syncpoint_check(block->syncpoint) && rdp_done) {
+            *prev = block->next;
+            rspq_block_free(block);
+        } else {
+            prev = &block->next;
+        }
+    }
+}
+
+/**
+ * @brief Find the index of the first overlay used by a block (0 if none).
+ * 
+ * Only the first chunk of the block is scanned. Internal commands are skipped
+ * using their sizes from the internal command table of rsp_queue.
+ */
+static int rspq_block_first_overlay(rspq_block_t *block)
+{
+    uint16_t *internal_table = (uint16_t*)(rsp_queue.data + 
+        ROUND_UP(RSPQ_DATA_ADDRESS + sizeof(rsp_queue_t), 16) + 32);
+    uint32_t *ptr = block->cmds;
+    uint32_t *end = block->cmds + RSPQ_BLOCK_MIN_SIZE;
+
+    while (ptr < end) {
+        uint32_t cmd = *ptr >> 24;
+        if (cmd >> 4)
+            return rspq_data.tables.overlay_table[cmd >> 4] / sizeof(rspq_overlay_t);
+        if (cmd == RSPQ_CMD_INVALID || cmd == RSPQ_CMD_JUMP || cmd == RSPQ_CMD_RET)
+            break;
+        ptr += ((internal_table[cmd] >> 8) & RSPQ_DESCRIPTOR_SIZE_MASK) / 4;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reorder a list of submitted recordings to reduce overlay switches.
+ * 
+ * Each sequence of consecutive unordered recordings is grouped by overlay,
+ * with groups sorted by first appearance, and recordings within a group kept
+ * in submission order. Ordered recordings are never moved.
+ */
+static rspq_block_t* rspq_rec_schedule(rspq_block_t *list)
+{
+    rspq_block_t *head = NULL, **tail = &head;
+
+    while (list) {
+        if (list->sched_key < 0) {
+            rspq_block_t *b = list;
+            list = b->next;
+            *tail = b; tail = &b->next;
+            continue;
+        }
+
+        // Detach the sequence of unordered recordings starting here
+        rspq_block_t *run = list;
+        rspq_block_t **p = &list->next;
+        while (*p && (*p)->sched_key >= 0)
+            p = &(*p)->next;
+        list = *p;
+        *p = NULL;
+
+        // Move out all the recordings with the same key as the first one,
+        // until the sequence is empty.
+        while (run) {
+            int key = run->sched_key;
+            rspq_block_t **q = &run;
+            while (*q) {
+                rspq_block_t *b = *q;
+                if (b->sched_key != key) {
+                    q = &b->next;
+                    continue;
+                }
+                if (q != &run) rspq_rec_scheduled++;
+                *q = b->next;
+                *tail = b; tail = &b->next;
+            }
+        }
+    }
+
+    *tail = NULL;
+    return head;
+}
+
+/** @brief Enqueue the pending submitted recordings into the lowpri queue */
+static void rspq_rec_run_pending(void)
+{
+    if (!rspq_rec_pending_head || !rspq_rec_can_run())
+        return;
+
+    disable_interrupts();
+    rspq_block_t *block = rspq_rec_pending_head;
+    rspq_rec_pending_head = rspq_rec_pending_tail = NULL;
+    enable_interrupts();
+
+    block = rspq_rec_schedule(block);
+
+    // Run all the recordings, and use a single syncpoint to know
+    // when they can be freed.
+    rspq_block_t *last = NULL;
+    bool rdp = false;
+    for (rspq_block_t *b = block; b; b = b->next) {
+        rspq_block_run(b);
+        rdp |= b->rdp_block != NULL;
+        last = b;
+    }
+    rspq_syncpoint_t sync_id = rspq_syncpoint_new();
+    for (rspq_block_t *b = block; b; b = b->next)
+        b->syncpoint = sync_id;
+
+    // If any recording contains RDP commands, also enqueue a SYNC_FULL: its
+    // interrupt tells us when RDP is done reading their static buffers.
+    if (rdp) {
+        uint32_t rdp_sync = ++rspq_rec_rdp_sync;
+        rdpq_sync_full(rspq_rec_rdp_done, (void*)rdp_sync);
+        for (rspq_block_t *b = block; b; b = b->next)
+            b->rdp_sync = rdp_sync;
+    }
+
+    last->next = rspq_rec_done;
+    rspq_rec_done = block;
+    rspq_rec_collect(false);
+}
+
+/** @brief Terminate a recording and append it to the pending list */
+static void rspq_rec_submit_internal(rspq_rec_t *rec, bool unordered)
+{
+    assertf(!rec->active, "cannot submit a recording while recording");
+    if (!rec->state.block)
+        return;
+
+    rspq_rec_swap(rec);
+    rspq_block_t *block = rspq_block_finish();
+    rspq_rec_swap(rec);
+    if (unordered)
+        block->sched_key = rspq_block_first_overlay(block);
+
+    // Append to the list of pending recordings. This is the only part
+    // that must be atomic, as submissions can happen from interrupts.
+    disable_interrupts();
+    if (rspq_rec_pending_tail)
+        rspq_rec_pending_tail->next = block;
+    else
+        rspq_rec_pending_head = block;
+    rspq_rec_pending_tail = block;
+    enable_interrupts();
+}
+
+void rspq_rec_submit(rspq_rec_t *rec)
+{
+    rspq_rec_submit_internal(rec, false);
+    rspq_rec_run_pending();
+}
+
+void rspq_rec_submit_unordered(rspq_rec_t *rec)
+{
+    // Keep it pending, so that it can be batched with the next ones.
+    rspq_rec_submit_internal(rec, true);
+}
+
+void rspq_get_overlay_stats(rspq_overlay_stats_t *stats)
+{
+    // The counter is a single word written by the RSP, so it can be read
+    // directly from DMEM even while the RSP is running.
+    uint32_t loads = SP_DMEM[(RSPQ_DATA_ADDRESS + offsetof(rsp_queue_t, ovl_loads)) / 4];
+    stats->overlay_loads = loads - rspq_overlay_loads_base;
+    stats->scheduled_recordings = rspq_rec_scheduled;
+}
+
+void rspq_reset_overlay_stats(void)
+{
+    rspq_overlay_loads_base = SP_DMEM[(RSPQ_DATA_ADDRESS + offsetof(rsp_queue_t, ovl_loads)) / 4];
+    rspq_rec_scheduled = 0;
+}
+
 void rspq_noop()
 {
     rspq_int_write(RSPQ_CMD_NOOP);
@@ -1276,6 +1755,9 @@ void rspq_syncpoint_wait(rspq_syncpoint_t sync_id)
 
 void rspq_wait(void)
 {
+    // Enqueue the recordings submitted so far, so that we wait for them too.
+    rspq_rec_run_pending();
+
     // Check if the RDPQ module was initialized.
     if (__rdpq_inited) {
         // If so, a full sync requires also waiting for RDP to finish.
@@ -1291,6 +1773,9 @@ void rspq_wait(void)
     // Wait until RSP has finished processing the queue
     rspq_syncpoint_wait(rspq_syncpoint_new());
 
+    // Now both RSP and RDP are idle, so all run recordings can be freed.
+    rspq_rec_collect(true);
+
     // Update the tracing engine (if enabled)
     if (rdpq_trace) rdpq_trace();
 }
@@ -1321,6 +1806,135 @@ void rspq_signal(uint32_t signal)
 /// @endcond
 
 /* Extern inline instantiations. */
+#if RSPQ_PROFILE
+/** @brief Accumulate a batch of profiling samples (see RSPQ_PROFILE_SAMPLES in rsp_queue.inc) */
+static void rspq_profile_accumulate(uint32_t *samples, int num_samples)
+{
+    for (int i=0; i<num_samples; i++) {
+        uint32_t cycles = samples[i*2+0] & 0xFFFFFF;
+        rspq_profile_cmd_t *cmd = &rspq_profile_data.commands[samples[i*2+0] >> 24];
+        cmd->calls++;
+        cmd->total_cycles += cycles;
+        cmd->rdp_stall_cycles += samples[i*2+1];
+        if (cycles > cmd->max_cycles)
+            cmd->max_cycles = cycles;
+    }
+}
+
+/** @brief Get the name of the overlay of a command, and the index of the command within it */
+static const char* rspq_profile_ovl_name(uint8_t cmd_id, int *cmd_idx)
+{
+    int ovl_id = cmd_id >> 4;
+    *cmd_idx = cmd_id;
+    if (ovl_id == 0)
+        return "rspq";
+
+    int ovl_idx = rspq_data.tables.overlay_table[ovl_id] / sizeof(rspq_overlay_t);
+    if (ovl_idx == 0 || !rspq_overlay_ucodes[ovl_idx])
+        return "?";
+
+    // Overlays with more than 16 commands span multiple consecutive IDs
+    while (ovl_id > 1 && rspq_data.tables.overlay_table[ovl_id-1] == ovl_idx * sizeof(rspq_overlay_t))
+        ovl_id--;
+    *cmd_idx = cmd_id - (ovl_id << 4);
+    return rspq_overlay_ucodes[ovl_idx]->name;
+}
+#endif
+
+void rspq_profile_next_frame(void)
+{
+#if RSPQ_PROFILE
+    // Wait until the RSP has run all the commands and went idle, so that
+    // the profiling state in DMEM can be read and reset without races.
+    rspq_wait();
+    rsp_wait();
+
+    static rsp_queue_t state;
+    rsp_read_data(&state, sizeof(rsp_queue_t), RSPQ_DATA_ADDRESS);
+
+    // Samples already flushed to RDRAM
+    int num_samples = (state.profile_rdram_ptr - PhysicalAddr(rspq_profile_buffer)) / 8;
+    rspq_profile_accumulate(rspq_profile_buffer, num_samples);
+
+    // Samples still in the DMEM ring
+    if (state.profile_count) {
+        static uint32_t ring[RSPQ_PROFILE_SAMPLES_SIZE / 4] __attribute__((aligned(16)));
+        rsp_read_data(ring, RSPQ_PROFILE_SAMPLES_SIZE, RSPQ_PROFILE_SAMPLES_ADDRESS);
+        rspq_profile_accumulate(ring, state.profile_count / 8);
+    }
+
+    rspq_profile_data.dropped_samples += state.profile_dropped;
+    rspq_profile_data.frame_count++;
+
+    // Start collecting the next frame
+    state.profile_count = 0;
+    state.profile_rdram_ptr = PhysicalAddr(rspq_profile_buffer);
+    state.profile_dropped = 0;
+    data_cache_hit_writeback(&state, sizeof(rsp_queue_t));
+    rsp_load_data(&state, sizeof(rsp_queue_t), RSPQ_DATA_ADDRESS);
+#endif
+}
+
+void rspq_get_buffer_stats(rspq_buffer_stats_t *stats)
+{
+    memcpy(stats, &rspq_buffer_stats, sizeof(rspq_buffer_stats_t));
+}
+
+void rspq_reset_buffer_stats(void)
+{
+    memset(&rspq_buffer_stats, 0, sizeof(rspq_buffer_stats_t));
+}
+
+void rspq_profile_get_data(rspq_profile_data_t *data)
+{
+#if RSPQ_PROFILE
+    memcpy(data, &rspq_profile_data, sizeof(rspq_profile_data_t));
+#else
+    memset(data, 0, sizeof(rspq_profile_data_t));
+#endif
+}
+
+void rspq_profile_reset(void)
+{
+#if RSPQ_PROFILE
+    memset(&rspq_profile_data, 0, sizeof(rspq_profile_data_t));
+#endif
+}
+
+void rspq_profile_dump(void)
+{
+#if RSPQ_PROFILE
+    rspq_profile_data_t *data = &rspq_profile_data;
+    uint32_t frames = data->frame_count ? data->frame_count : 1;
+    uint32_t rcp_mhz = RCP_FREQUENCY / 1000000;
+    uint64_t total_cycles = 0, total_stall = 0;
+
+    debugf("RSPQ profile: %lu frames (per-frame averages)\n", (uint32_t)data->frame_count);
+    debugf("%-16s %4s %8s %8s %8s %8s\n", "overlay", "cmd", "calls", "us", "max us", "stall us");
+    for (int i=0; i<RSPQ_PROFILE_CMD_COUNT; i++) {
+        rspq_profile_cmd_t *cmd = &data->commands[i];
+        if (!cmd->calls)
+            continue;
+        int cmd_idx;
+        const char *name = rspq_profile_ovl_name(i, &cmd_idx);
+        debugf("%-16s 0x%02x %8lu %8lu %8lu %8lu\n", name, cmd_idx,
+            (uint32_t)(cmd->calls / frames),
+            (uint32_t)(cmd->total_cycles / frames / rcp_mhz),
+            cmd->max_cycles / rcp_mhz,
+            (uint32_t)(cmd->rdp_stall_cycles / frames / rcp_mhz));
+        total_cycles += cmd->total_cycles;
+        total_stall += cmd->rdp_stall_cycles;
+    }
+    debugf("Total RSP busy: %lu us/frame (RDP stall: %lu us/frame)\n",
+        (uint32_t)(total_cycles / frames / rcp_mhz), (uint32_t)(total_stall / frames / rcp_mhz));
+    if (data->dropped_samples)
+        debugf("WARNING: %lu samples dropped (RSPQ_PROFILE_BUFFER_SIZE is too small)\n",
+            (uint32_t)data->dropped_samples);
+#else
+    debugf("RSPQ profile: profiler disabled (set RSPQ_PROFILE to 1 in rspq_constants.h)\n");
+#endif
+}
+
 extern inline rspq_write_t rspq_write_begin(uint32_t ovl_id, uint32_t cmd_id, int size);
 extern inline void rspq_write_arg(rspq_write_t *w, uint32_t value);
 extern inline void rspq_write_end(rspq_write_t *w);
@@ -160,6 +160,10 @@ typedef struct rdpq_block_s rdpq_block_t;
 typedef struct rspq_block_s {
     uint32_t nesting_level;     ///< Nesting level of the block
     rdpq_block_t *rdp_block;    ///< Option RDP static buffer (with RDP commands)
+    struct rspq_block_s *next;  ///< Next block in the list of submitted recordings (see #rspq_rec_submit)
+    int syncpoint;              ///< Syncpoint after which a submitted recording has been run
+    uint32_t rdp_sync;          ///< SYNC_FULL after which RDP is done with a submitted recording (see #rspq_rec_submit)
+    int sched_key;              ///< Overlay index used to batch unordered recordings (-1 if ordered)
     uint32_t cmds[];            ///< Block contents (commands)
 } rspq_block_t;
 
@@ -227,12 +231,35 @@ typedef struct rsp_queue_s {
     uint8_t rdp_syncfull_ongoing;        ///< True if a SYNC_FULL is currently ongoing
     uint8_t rdpq_debug;                  ///< Debug mode flag
     uint8_t __padding0;
+    uint32_t ovl_loads;                  ///< Number of overlay loads (see #rspq_get_overlay_stats)
     int16_t current_ovl;                 ///< Current overlay index
+#if RSPQ_PROFILE
+    uint16_t profile_count;              ///< Bytes used in the DMEM ring of profiling samples
+    uint32_t profile_rdram_ptr;          ///< RDRAM address where the next samples will be flushed
+    uint32_t profile_rdram_end;          ///< End of the RDRAM buffer of profiling samples
+    uint32_t profile_cur_cmd;            ///< ID of the command being executed (0 if none)
+    uint32_t profile_start;              ///< DP clock at dispatch of the current command
+    uint32_t profile_stall;              ///< RDP stall cycles of the current command
+    uint32_t profile_stall_start;        ///< DP clock at the start of the current RDP wait
+    uint32_t profile_dropped;            ///< Number of samples dropped because the RDRAM buffer was full
+#endif
 } __attribute__((aligned(16), packed)) rsp_queue_t;
 
 /** @brief Address of the RSPQ data header in DMEM (see #rsp_queue_t) */
 #define RSPQ_DATA_ADDRESS                32
 
+/** 
+ * @brief Address of the RSPQ command buffer in DMEM (RSPQ_DMEM_BUFFER in rsp_queue.inc)
+ * 
+ * In rsp_queue.inc, #rsp_queue_t is followed by the banner (32 bytes), the
+ * internal command table (24 bytes), and the debug marker (8 bytes). The layout
+ * is the same irrespective of #RSPQ_DEBUG.
+ */
+#define RSPQ_DMEM_BUFFER_ADDRESS         (RSPQ_DATA_ADDRESS + sizeof(rsp_queue_t) + 0x38 + 0x8)
+
+/** @brief Address of the ring of profiling samples in DMEM (RSPQ_PROFILE_SAMPLES in rsp_queue.inc) */
+#define RSPQ_PROFILE_SAMPLES_ADDRESS     (RSPQ_DMEM_BUFFER_ADDRESS + RSPQ_DMEM_BUFFER_SIZE)
+
 /** @brief ID of the last syncpoint reached by RSP. */
 extern volatile int __rspq_syncpoints_done;
 
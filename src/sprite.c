@@ -163,6 +163,13 @@ uint16_t* sprite_get_palette(sprite_t *sprite) {
     return (void*)sprite + sx->pal_file_pos;
 }
 
+uint16_t sprite_get_palette_id(sprite_t *sprite) {
+    sprite_ext_t *sx = __sprite_ext(sprite);
+    if(!sx || !sx->pal_file_pos)
+        return 0;
+    return sx->pal_id;
+}
+
 surface_t sprite_get_tile(sprite_t *sprite, int h, int v) {
     static int tile_width = 0, tile_height = 0;
 
@@ -30,7 +30,7 @@ typedef struct sprite_ext_s {
     } lods[7];                  ///< Information on the available LODs (if detail is present, it's always at position 6)
     struct {
         uint16_t flags;             ///< Generic Flags for the sprite
-        uint16_t padding;           ///< Padding
+        uint16_t pal_id;            ///< ID of the palette shared with other sprites (0 = not shared)
     };
     /// @brief RDP texture parameters
     struct texparms_s {
@@ -89,19 +89,34 @@ typedef struct
 /** @brief Extract bits from word */
 #define BITS(v, b, e)  ((unsigned int)(v) << (31-(e)) >> (31-(e)+(b))) 
 
-/** @brief Number of buckets file handles are divided into */
-#define HANDLE_MAX_BUCKETS         32
+/** @brief Number of buckets file handles are divided into (limited by the fileno format) */
+#define HANDLE_MAX_BUCKETS         64
 /** @brief Size of each bucket of file handles */
 #define HANDLE_BUCKET_SIZE         32
 
+/**
+ * @brief A bucket of file handles
+ *
+ * Free slots are linked together in a free list (through the next_free
+ * array), so that both allocating and freeing a slot is O(1).
+ */
+typedef struct
+{
+    /** @brief Handles (NULL if the slot is free) */
+    void *handles[HANDLE_BUCKET_SIZE];
+    /** @brief For free slots, global index of the next free slot (-1 for the end of the list) */
+    int16_t next_free[HANDLE_BUCKET_SIZE];
+} handle_bucket_t;
+
 /** @brief First bucket of file handles (allocated statically) */
-static void *handle_first_bucket[HANDLE_BUCKET_SIZE];
+static handle_bucket_t handle_first_bucket;
 /** @brief Array of buckets of file handles */
-static void **handle_map[HANDLE_MAX_BUCKETS] = { handle_first_bucket };
+static handle_bucket_t *handle_map[HANDLE_MAX_BUCKETS] = { &handle_first_bucket };
 /** @brief Number of allocated handle buckets (start from 1, as the first one is allocated statically) */
-static int handle_buckets_count = 1;    
-/** @brief Number of open handles */
-static int handle_open_count;
+static int handle_buckets_count = 1;
+/** @brief Global index (bucket index * bucket size + position) of the first free slot,
+ *         -1 if there is none, -2 if the free list has not been initialized yet */
+static int handle_free_head = -2;
 
 /** @brief Create a fileno.
  * 
@@ -258,34 +273,6 @@ static int __strcmp( const char * const a, const char * const b )
     return __strncmp( a, b, -1 );
 }
 
-/**
- * @brief Simple implementation of rand()
- * 
- * @param state         Random state
- * @return uint32_t     New random value
- */
-static uint32_t __rand( uint32_t *state )
-{
-	uint32_t x = *state;
-	x ^= x << 13;
-	x ^= x >> 7;
-	x ^= x << 5;
-	return *state = x;
-}
-
-/**
- * @brief Generate a random number in range [0..n[
- * 
- * @param state         Random state
- * @param n             Upper bound (exclusive)
- * @return uint32_t     Random number
- */
-static inline uint32_t __randn( uint32_t *state, int n )
-{
-    if(__builtin_constant_p( n )) return __rand( state ) % n;
-    return ((uint64_t)__rand( state ) * n) >> 32;
-}
-
 int attach_filesystem( const char * const prefix, filesystem_t *filesystem )
 {
     /* Sanity checking */
@@ -378,6 +365,23 @@ int detach_filesystem( const char * const prefix )
     return -2;
 }
 
+/**
+ * @brief Add all the slots of a bucket to the free list of file handles
+ *
+ * @param bkt_idx       Index of the bucket
+ */
+static void __link_handle_bucket( int bkt_idx )
+{
+    handle_bucket_t *bkt = handle_map[bkt_idx];
+
+    for( int i = 0; i < HANDLE_BUCKET_SIZE - 1; i++ )
+    {
+        bkt->next_free[i] = bkt_idx * HANDLE_BUCKET_SIZE + i + 1;
+    }
+    bkt->next_free[HANDLE_BUCKET_SIZE - 1] = handle_free_head;
+    handle_free_head = bkt_idx * HANDLE_BUCKET_SIZE;
+}
+
 /**
  * @brief Allocate a new fileno for the given handle
  * 
@@ -387,51 +391,57 @@ int detach_filesystem( const char * const prefix )
  */
 static int __allocate_fileno( void *handle, int fs_index )
 {
-    /* Allocate whenever the handle map is full at 75% to avoid wasting too
-     * much time looking for an empty ID. */
-    if( !handle_buckets_count || 
-        (handle_buckets_count < HANDLE_MAX_BUCKETS &&
-         handle_open_count + (handle_open_count>>2) > handle_buckets_count * HANDLE_BUCKET_SIZE) )
+    /* The statically allocated bucket is linked on first use */
+    if( handle_free_head == -2 )
+    {
+        handle_free_head = -1;
+        __link_handle_bucket( 0 );
+    }
+
+    /* If there are no free slots, allocate a new bucket */
+    if( handle_free_head < 0 )
     {
-        void *mem = calloc( HANDLE_BUCKET_SIZE, sizeof( void* ) );
+        if( handle_buckets_count == HANDLE_MAX_BUCKETS )
+        {
+            /* All slots are full. Set ENFILE and return error */
+            errno = ENFILE;
+            return -1;
+        }
+
+        handle_bucket_t *mem = calloc( 1, sizeof( handle_bucket_t ) );
         if( !mem ) 
         {
             errno = ENOMEM;
             return -1;
         }
-        handle_map[handle_buckets_count++] = mem;
+        handle_map[handle_buckets_count] = mem;
+        __link_handle_bucket( handle_buckets_count++ );
     }
 
-    /* Select a random bucket and a random initial position. This should
-     * help finding an empty slot fast enough. Use the handle pointer
-     * as seed; avoid using C0_COUNT because aggressively changing fileno
-     * might cause some headaches during debugging sessions. */
-    uint32_t rand_state = (uint32_t)handle ^ (uint32_t)fs_index;
-    uint32_t bkt_idx = handle_buckets_count > 1 ? __randn( &rand_state, handle_buckets_count ) : 0;
-    uint32_t bkt_pos = __randn( &rand_state, HANDLE_BUCKET_SIZE );
+    /* Pop the first free slot */
+    int bkt_idx = handle_free_head / HANDLE_BUCKET_SIZE;
+    int bkt_pos = handle_free_head % HANDLE_BUCKET_SIZE;
+    handle_bucket_t *bkt = handle_map[bkt_idx];
 
-    /* Go through all buckets and positions and look for an empty slot. */
-    for (int i=0; i<handle_buckets_count; i++)
-    {
-        for (int j=0; j<HANDLE_BUCKET_SIZE; j++)
-        {
-            if (handle_map[bkt_idx][bkt_pos] == 0)
-            {
-                handle_map[bkt_idx][bkt_pos] = handle;
-                handle_open_count++;
-                return FILENO_MAKE( bkt_idx, bkt_pos, fs_index );
-            }
-            bkt_pos = (bkt_pos+1) % HANDLE_BUCKET_SIZE;
-        }
+    handle_free_head = bkt->next_free[bkt_pos];
+    bkt->handles[bkt_pos] = handle;
+    return FILENO_MAKE( bkt_idx, bkt_pos, fs_index );
+}
 
-        bkt_idx++;
-        if (bkt_idx == handle_buckets_count)
-            bkt_idx = 0;
-    }
+/**
+ * @brief Free the slot of a fileno, so that it can be reused
+ *
+ * @param fileno        Fileno to free (must be valid)
+ */
+static void __free_fileno( int fileno )
+{
+    int bkt_idx = FILENO_GET_BUCKET_IDX( fileno );
+    int bkt_pos = FILENO_GET_BUCKET_POS( fileno );
+    handle_bucket_t *bkt = handle_map[bkt_idx];
 
-    /* All slots are full. Set ENFILE and return error */
-    errno = ENFILE;
-    return -1;
+    bkt->handles[bkt_pos] = 0;
+    bkt->next_free[bkt_pos] = handle_free_head;
+    handle_free_head = bkt_idx * HANDLE_BUCKET_SIZE + bkt_pos;
 }
 
 /**
@@ -537,12 +547,12 @@ static void **__get_fs_handle( int fileno )
     int bkt_pos = FILENO_GET_BUCKET_POS( fileno );
     
     if ( bkt_idx >= handle_buckets_count || bkt_pos >= HANDLE_BUCKET_SIZE ||
-         handle_map[bkt_idx][bkt_pos] == 0 )
+         handle_map[bkt_idx]->handles[bkt_pos] == 0 )
     {
         return 0;
     }
 
-    return &handle_map[bkt_idx][bkt_pos];
+    return &handle_map[bkt_idx]->handles[bkt_pos];
 }
 
 /**
@@ -602,9 +612,8 @@ int close( int fileno )
     /* Access the filesystem handle */
     void *handle = *handle_ptr;
 
-    /* Clear the map slot */
-    *handle_ptr = 0;
-    handle_open_count--;
+    /* Free the map slot */
+    __free_fileno( fileno );
 
     /* Tell the filesystem to close the file */
     return fs->close( handle );
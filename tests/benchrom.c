@@ -0,0 +1,346 @@
+#include <libdragon.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <rspq_constants.h>
+#include "../src/asset_internal.h"
+
+/**********************************************************************
+ * DECOMPRESSION BENCHMARK
+ *
+ * The ROM filesystem contains a corpus of representative files (see
+ * tests/Makefile), each one stored in a directory per compression level:
+ * rom:/c0 (uncompressed), rom:/c1 (LZ4), rom:/c2 (aPLib), rom:/c3 (Shrinkler).
+ *
+ * For each file and level, the benchmark measures:
+ *   * full:   asset_load() (in-place decompression racing with DMA)
+ *   * stream: asset_fopen() + fread() in small chunks
+ *
+ * and reports throughput (MB/s of decompressed data), CPU ticks per
+ * decompressed byte and peak heap memory (measured for stream, estimated from
+ * the asset header for full, marked with '~'). Results are printed both on
+ * screen and on the debug log. The host-side counterpart reporting
+ * compression ratio and speed on the same corpus is tools/common/assetbench.
+ *
+ * The ROM filesystem also contains directories of increasing size
+ * (rom:/dfs/d16 ... rom:/dfs/d1024), used to measure the latency of
+ * dfs_open() against the number of entries, both through the path index
+ * (absolute paths) and through the directory walk (relative paths from
+ * within the directory, which cannot use the index), and the latency of
+ * dfs_open_by_index().
+ *
+ * Then, the corpus is read via stdio in small chunks with different
+ * sizes of the DFS read-ahead buffer (see dfs_set_readahead).
+ *
+ * Finally, the throughput of the RSP queue is measured in commands per
+ * second, both for tiny rspq no-ops and for small rdpq commands. Build both
+ * libdragon and the benchmark with and without N64_RELEASE=1 to compare the
+ * debug and release configurations of rspq/rdpq.
+ **********************************************************************/
+
+#define NUM_LEVELS      4
+#define NUM_ITERATIONS  4
+#define STREAM_CHUNK    1024
+#define DFS_SAMPLES     16
+#define SMALL_READ      64
+
+static const char *level_names[NUM_LEVELS] = { "none", "lz4", "aplib", "shrink" };
+
+typedef struct {
+	uint32_t ticks;         // Best time out of all iterations
+	int peak_mem;           // Peak heap memory in bytes
+	bool peak_estimated;    // True if peak_mem is estimated rather than measured
+	bool ok;                // True if decompressed data matches the original
+} bench_result_t;
+
+// Print on both the screen and the debug log
+#define OUT(msg, ...) ({ printf(msg, ##__VA_ARGS__); debugf(msg, ##__VA_ARGS__); })
+
+static int heap_used(void)
+{
+	return mallinfo().uordblks;
+}
+
+// Estimate of the memory used by asset_load() at its peak: the output buffer
+// plus the in-place decompression margin (see decompress_inplace in asset.c).
+// The actual peak cannot be measured, as temporary buffers are freed before
+// asset_load() returns.
+static int full_peak_memory(const char *fn, int size)
+{
+	FILE *f = fopen(fn, "rb");
+	asset_header_t header;
+	fread(&header, 1, sizeof(header), f);
+	fclose(f);
+
+	if (memcmp(header.magic, ASSET_MAGIC, 3))
+		return size;
+	if (header.flags & ASSET_FLAG_CHUNKED)
+		return size;
+	if (!(header.flags & ASSET_FLAG_INPLACE))
+		return size + header.cmp_size;
+	return size + header.inplace_margin + 8 + 16;
+}
+
+static bench_result_t bench_full(const char *fn, const uint8_t *ref, int ref_size)
+{
+	bench_result_t res = { .ticks = UINT32_MAX, .ok = true };
+
+	for (int i=0; i<NUM_ITERATIONS; i++) {
+		data_cache_writeback_invalidate_all();
+
+		int size;
+		uint32_t t0 = TICKS_READ();
+		uint8_t *buf = asset_load(fn, &size);
+		uint32_t t = TICKS_SINCE(t0);
+
+		if (t < res.ticks) res.ticks = t;
+		if (size != ref_size || memcmp(buf, ref, size))
+			res.ok = false;
+		free(buf);
+	}
+
+	res.peak_mem = full_peak_memory(fn, ref_size);
+	res.peak_estimated = true;
+	return res;
+}
+
+static bench_result_t bench_stream(const char *fn, const uint8_t *ref, int ref_size)
+{
+	bench_result_t res = { .ticks = UINT32_MAX, .ok = true };
+	static uint8_t chunk[STREAM_CHUNK];
+
+	for (int i=0; i<NUM_ITERATIONS; i++) {
+		data_cache_writeback_invalidate_all();
+
+		int mem0 = heap_used();
+		int pos = 0, n;
+		uint32_t t0 = TICKS_READ();
+		FILE *f = asset_fopen(fn, NULL);
+		while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+			// The decompression state and the stdio buffer are all allocated
+			// by now, so this is the peak memory for the streaming mode.
+			if (pos == 0) {
+				int mem = heap_used() - mem0;
+				if (mem > res.peak_mem) res.peak_mem = mem;
+			}
+			if (pos + n > ref_size || memcmp(chunk, ref + pos, n))
+				res.ok = false;
+			pos += n;
+		}
+		fclose(f);
+		uint32_t t = TICKS_SINCE(t0);
+
+		if (t < res.ticks) res.ticks = t;
+		if (pos != ref_size)
+			res.ok = false;
+	}
+
+	return res;
+}
+
+static void print_result(const char *mode, int level, int size, bench_result_t *res)
+{
+	float secs = (float)res->ticks / TICKS_PER_SECOND;
+	float mbs = size / secs / (1024*1024);
+	float tpb = (float)res->ticks / size;
+
+	OUT("  %-6s %-6s %7.2f MB/s %6.2f t/B %c%4d KB%s\n", level_names[level], mode,
+		mbs, tpb, res->peak_estimated ? '~' : ' ', (res->peak_mem + 1023) / 1024,
+		res->ok ? "" : " MISMATCH!");
+}
+
+static void bench_file(const char *name)
+{
+	char fn[256];
+
+	// Load the uncompressed file as reference
+	int ref_size;
+	snprintf(fn, sizeof(fn), "rom:/c0/%s", name);
+	uint8_t *ref = asset_load(fn, &ref_size);
+
+	OUT("%s (%d KB)\n", name, ref_size / 1024);
+	for (int level=0; level<NUM_LEVELS; level++) {
+		snprintf(fn, sizeof(fn), "rom:/c%d/%s", level, name);
+
+		bench_result_t full = bench_full(fn, ref, ref_size);
+		print_result("full", level, ref_size, &full);
+
+		// Shrinkler does not support streaming decompression
+		if (level == 3)
+			continue;
+		bench_result_t stream = bench_stream(fn, ref, ref_size);
+		print_result("stream", level, ref_size, &stream);
+	}
+
+	free(ref);
+}
+
+static const int dfs_dir_sizes[] = { 16, 64, 256, 1024 };
+
+// Average time of dfs_open()+dfs_close() on a sample of the files of a directory.
+// Files are named f0000.dat, f0001.dat, etc.; use prefix 'm' to open missing files.
+static uint32_t bench_dfs_open(const char *dir, char prefix, int num_files)
+{
+	char fn[64];
+	uint32_t total = 0;
+
+	for (int i=0; i<DFS_SAMPLES; i++) {
+		snprintf(fn, sizeof(fn), "%s%c%04d.dat", dir, prefix, i * num_files / DFS_SAMPLES);
+
+		uint32_t best = UINT32_MAX;
+		for (int j=0; j<NUM_ITERATIONS; j++) {
+			uint32_t t0 = TICKS_READ();
+			int fh = dfs_open(fn);
+			if (fh >= 0) dfs_close(fh);
+			uint32_t t = TICKS_SINCE(t0);
+			if (t < best) best = t;
+		}
+		total += best;
+	}
+
+	return total / DFS_SAMPLES;
+}
+
+static void bench_dfs(void)
+{
+	char dir[64];
+
+	OUT("\nDFS open latency (us)\n");
+	OUT("  %5s %6s %6s %9s %9s\n", "files", "index", "walk", "miss idx", "miss walk");
+	for (int i=0; i<sizeof(dfs_dir_sizes)/sizeof(dfs_dir_sizes[0]); i++) {
+		int n = dfs_dir_sizes[i];
+		snprintf(dir, sizeof(dir), "/dfs/d%d/", n);
+		uint32_t t_index = bench_dfs_open(dir, 'f', n);
+		uint32_t t_miss_index = bench_dfs_open(dir, 'm', n);
+
+		dfs_chdir(dir);
+		uint32_t t_walk = bench_dfs_open("", 'f', n);
+		uint32_t t_miss_walk = bench_dfs_open("", 'm', n);
+		dfs_chdir("/");
+
+		OUT("  %5d %6d %6d %9d %9d\n", n, (int)TICKS_TO_US(t_index), (int)TICKS_TO_US(t_walk),
+			(int)TICKS_TO_US(t_miss_index), (int)TICKS_TO_US(t_miss_walk));
+	}
+
+	// Opening by file ID does not depend on the directory size. Any ID works
+	// for this, so there is no need for the header generated by mkdfs.
+	uint32_t total = 0;
+	dfs_close(dfs_open_by_index(0));	// Load the file table
+	for (int i=0; i<DFS_SAMPLES; i++) {
+		uint32_t t0 = TICKS_READ();
+		int fh = dfs_open_by_index(i);
+		if (fh >= 0) dfs_close(fh);
+		total += TICKS_SINCE(t0);
+	}
+	OUT("  by ID: %d us\n", (int)TICKS_TO_US(total / DFS_SAMPLES));
+}
+
+static const int readahead_sizes[] = { 0, 4096, 16384, 65536 };
+
+// Read all the corpus via stdio in small chunks, with different sizes of
+// the read-ahead buffer
+static void bench_readahead(char names[][256], int num_files)
+{
+	static uint8_t chunk[SMALL_READ];
+	char fn[256];
+
+	OUT("\nStdio reads of %d bytes\n", SMALL_READ);
+	OUT("  %9s %8s %7s %7s\n", "readahead", "MB/s", "hits", "misses");
+	for (int i=0; i<sizeof(readahead_sizes)/sizeof(readahead_sizes[0]); i++) {
+		dfs_set_readahead(readahead_sizes[i]);
+		dfs_reset_readahead_stats();
+
+		int total = 0;
+		uint32_t t0 = TICKS_READ();
+		for (int j=0; j<num_files; j++) {
+			snprintf(fn, sizeof(fn), "rom:/c0/%s", names[j]);
+			FILE *f = fopen(fn, "rb");
+			setvbuf(f, NULL, _IONBF, 0);
+			int n;
+			while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+				total += n;
+			fclose(f);
+		}
+		uint32_t t = TICKS_SINCE(t0);
+
+		dfs_readahead_stats_t stats;
+		dfs_get_readahead_stats(&stats);
+		OUT("  %9d %8.2f %7lu %7lu\n", readahead_sizes[i],
+			total / ((float)t / TICKS_PER_SECOND) / (1024*1024),
+			(unsigned long)stats.hits, (unsigned long)stats.misses);
+	}
+	dfs_set_readahead(0);
+}
+
+#define RSPQ_BENCH_CMDS     16384
+
+// Commands per second processed by the RSP queue for a command generator
+static uint32_t bench_rspq_run(void (*cmd)(int))
+{
+	uint32_t best = UINT32_MAX;
+	for (int i=0; i<NUM_ITERATIONS; i++) {
+		rspq_wait();
+		uint32_t t0 = TICKS_READ();
+		for (int j=0; j<RSPQ_BENCH_CMDS; j++)
+			cmd(j);
+		rspq_wait();
+		uint32_t t = TICKS_SINCE(t0);
+		if (t < best) best = t;
+	}
+	return (uint64_t)RSPQ_BENCH_CMDS * TICKS_PER_SECOND / best;
+}
+
+static void cmd_noop(int i) { rspq_noop(); }
+static void cmd_prim_color(int i) { rdpq_set_prim_color(RGBA32(i, i, i, 0xFF)); }
+
+static void bench_rspq(void)
+{
+	rspq_init();
+	rdpq_init();
+
+	OUT("\nRSP queue throughput (%s build)\n", RSPQ_DEBUG ? "debug" : "release");
+	OUT("  rspq_noop:           %8lu cmds/s\n", bench_rspq_run(cmd_noop));
+	OUT("  rdpq_set_prim_color: %8lu cmds/s\n", bench_rspq_run(cmd_prim_color));
+
+	rdpq_close();
+	rspq_close();
+}
+
+int main() {
+	console_init();
+	console_set_debug(false);
+	debug_init_isviewer();
+	debug_init_usblog();
+
+	if (dfs_init( DFS_DEFAULT_LOCATION ) != DFS_ESUCCESS) {
+		printf("Invalid ROM: cannot initialize DFS\n");
+		return 0;
+	}
+
+	asset_init_compression(2);
+	asset_init_compression(3);
+
+	OUT("libdragon decompression benchmark (%s)\n\n", sys_bbplayer() ? "iQue" : "N64");
+
+	// Collect the corpus first, as opening files while walking the
+	// directory would interfere with the walk.
+	static char names[64][256];
+	int num_files = 0;
+	dir_t dir;
+	int err = dir_findfirst("rom:/c0", &dir);
+	while (err == 0 && num_files < 64) {
+		if (dir.d_type == DT_REG)
+			strcpy(names[num_files++], dir.d_name);
+		err = dir_findnext("rom:/c0", &dir);
+	}
+
+	for (int i=0; i<num_files; i++)
+		bench_file(names[i]);
+
+	bench_dfs();
+	bench_readahead(names, num_files);
+	bench_rspq();
+
+	console_set_debug(true);
+	OUT("\nBenchmark finished\n");
+}
@@ -1,3 +1,6 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include "../include/dfsinternal.h"
 
 void test_dfs_read(TestContext *ctx) {
 	int fh = dfs_open("counter.dat");
@@ -88,3 +91,104 @@ void test_dfs_rom_addr(TestContext *ctx) {
 
 	ASSERT_EQUAL_MEM(buf1, buf2, 128, "DMA ROM access is different");
 }
+
+#define DFS_NUM_HANDLES 600
+
+void test_dfs_handles(TestContext *ctx) {
+	static int fds[DFS_NUM_HANDLES];
+	int num_open = 0;
+	DEFER(for (int i=0; i<num_open; i++) close(fds[i]));
+
+	// Open the same file many times, each handle at a different offset
+	for (int i=0; i<DFS_NUM_HANDLES; i++) {
+		fds[i] = open("rom:/counter.dat", O_RDONLY);
+		ASSERT(fds[i] >= 0, "cannot open handle #%d", i);
+		num_open++;
+		ASSERT_EQUAL_SIGNED(lseek(fds[i], i*7 % 4096, SEEK_SET), i*7 % 4096, "invalid seek on handle #%d", i);
+		for (int j=0; j<i; j++)
+			ASSERT(fds[i] != fds[j], "duplicated fileno %d (#%d and #%d)", fds[i], i, j);
+	}
+
+	// Check that all handles kept their own position
+	for (int i=DFS_NUM_HANDLES-1; i>=0; i--) {
+		uint8_t b;
+		ASSERT_EQUAL_SIGNED(read(fds[i], &b, 1), 1, "cannot read handle #%d", i);
+		ASSERT_EQUAL_HEX(b, (i*7 % 4096) & 0xFF, "invalid data on handle #%d", i);
+	}
+
+	// Close and reopen handles in random order
+	for (int k=0; k<DFS_NUM_HANDLES*4; k++) {
+		int i = RANDN(DFS_NUM_HANDLES);
+		ASSERT_EQUAL_SIGNED(close(fds[i]), 0, "cannot close handle #%d", i);
+		fds[i] = open("rom:/counter.dat", O_RDONLY);
+		ASSERT(fds[i] >= 0, "cannot reopen handle #%d", i);
+		lseek(fds[i], i, SEEK_SET);
+
+		uint8_t b;
+		ASSERT_EQUAL_SIGNED(read(fds[i], &b, 1), 1, "cannot read handle #%d", i);
+		ASSERT_EQUAL_HEX(b, i & 0xFF, "invalid data on reopened handle #%d", i);
+	}
+
+	// Closed filenos must not be valid anymore
+	int fd = fds[--num_open];
+	ASSERT_EQUAL_SIGNED(close(fd), 0, "cannot close handle");
+	ASSERT_EQUAL_SIGNED(close(fd), -1, "double close succeeded");
+}
+
+void test_dfs_compressed(TestContext *ctx) {
+	// counter.z.dat is a copy of counter.dat that mkdfs stores compressed
+	// (see MKDFS_FLAGS in the Makefile), and is transparently decompressed.
+	int fd = open("rom:/counter.z.dat", O_RDONLY);
+	ASSERT(fd >= 0, "counter.z.dat not found");
+	DEFER(close(fd));
+
+	uint8_t buf[256];
+	ASSERT_EQUAL_SIGNED(read(fd, buf, 256), 256, "short read");
+	for (int i=0; i<256; i++)
+		ASSERT_EQUAL_HEX(buf[i], i, "invalid data at offset %d", i);
+
+	// Seek forward, backward and relative to the end
+	ASSERT_EQUAL_SIGNED(lseek(fd, 1000, SEEK_SET), 1000, "invalid forward seek");
+	ASSERT_EQUAL_SIGNED(read(fd, buf, 16), 16, "short read after forward seek");
+	for (int i=0; i<16; i++)
+		ASSERT_EQUAL_HEX(buf[i], (1000+i) & 0xFF, "invalid data after forward seek");
+
+	ASSERT_EQUAL_SIGNED(lseek(fd, 300, SEEK_SET), 300, "invalid backward seek");
+	ASSERT_EQUAL_SIGNED(read(fd, buf, 16), 16, "short read after backward seek");
+	for (int i=0; i<16; i++)
+		ASSERT_EQUAL_HEX(buf[i], (300+i) & 0xFF, "invalid data after backward seek");
+
+	ASSERT_EQUAL_SIGNED(lseek(fd, -8, SEEK_END), 4096-8, "invalid seek from end");
+	ASSERT_EQUAL_SIGNED(read(fd, buf, 16), 8, "invalid read at end of file");
+	for (int i=0; i<8; i++)
+		ASSERT_EQUAL_HEX(buf[i], (4096-8+i) & 0xFF, "invalid data at end of file");
+
+	// A raw open gives access to the compressed contents
+	int rawfd = open("rom:/counter.z.dat", O_RDONLY | DFS_O_RAW);
+	ASSERT(rawfd >= 0, "raw open of counter.z.dat failed");
+	DEFER(close(rawfd));
+
+	ASSERT_EQUAL_SIGNED(read(rawfd, buf, 4), 4, "short raw read");
+	ASSERT_EQUAL_MEM(buf, (uint8_t*)"DCA", 3, "raw contents are not a compressed asset");
+	int rawsize = lseek(rawfd, 0, SEEK_END);
+	ASSERT(rawsize > 0 && rawsize < 4096, "invalid raw size: %d", rawsize);
+
+	// The asset library reads the compressed payload directly from ROM
+	int size;
+	uint8_t *data = asset_load("rom:/counter.z.dat", &size);
+	ASSERT(data, "asset_load failed");
+	DEFER(free(data));
+	ASSERT_EQUAL_SIGNED(size, 4096, "invalid size from asset_load");
+	for (int i=0; i<size; i++)
+		ASSERT_EQUAL_HEX(data[i], i & 0xFF, "invalid data from asset_load at offset %d", i);
+
+	FILE *f = asset_fopen("rom:/counter.z.dat", &size);
+	ASSERT(f, "asset_fopen failed");
+	DEFER(fclose(f));
+	ASSERT_EQUAL_SIGNED(size, 4096, "invalid size from asset_fopen");
+	for (int pos=0; pos<size; pos+=sizeof(buf)) {
+		ASSERT_EQUAL_SIGNED(fread(buf, 1, sizeof(buf), f), sizeof(buf), "short read from asset_fopen");
+		for (int i=0; i<sizeof(buf); i++)
+			ASSERT_EQUAL_HEX(buf[i], (pos+i) & 0xFF, "invalid data from asset_fopen at offset %d", pos+i);
+	}
+}
@@ -496,6 +496,30 @@ void test_rdpq_block_nested(TestContext *ctx)
     ASSERT_EQUAL_HEX(rdp_stream[5]>>56, 0xFB, "SET_ENV_COLOR not in position 3");
 }
 
+void test_rdpq_rec_free(TestContext *ctx)
+{
+    RDPQ_INIT();
+
+    rspq_rec_t *rec = rspq_rec_new();
+    DEFER(rspq_rec_free(rec));
+
+    // Submit recordings with RDP commands like in a frame loop, without
+    // ever calling rspq_wait: they must be freed anyway after RDP runs them.
+    int mem_start = 0;
+    for (int i=0; i<64; i++) {
+        rspq_rec_begin(rec);
+        rdpq_set_prim_color(RGBA32(i, i, i, i));
+        rspq_rec_end(rec);
+        rspq_rec_submit(rec);
+        rspq_flush();
+        wait_ms(1);
+        if (i == 8) mem_start = mallinfo().uordblks;
+    }
+
+    int mem_end = mallinfo().uordblks;
+    ASSERT(mem_end - mem_start < 1024, "recordings are not freed: %d bytes leaked", mem_end - mem_start);
+}
+
 void test_rdpq_change_other_modes(TestContext *ctx)
 {
     RDPQ_INIT();
@@ -6,6 +6,7 @@
 #include <rdp.h>
 #include <rdpq_constants.h>
 #include "test_rspq_constants.h"
+#include "../src/rspq/rspq_internal.h"
 
 #define ASSERT_GP_BACKWARD           0xF001   // Also defined in rsp_test.S
 #define ASSERT_TOO_MANY_NOPS         0xF002
@@ -245,6 +246,166 @@ void test_rspq_high_load(TestContext *ctx)
     ASSERT_EQUAL_UNSIGNED(*actual_sum, expected_sum, "Possibly not all commands have been executed!");
 }
 
+void test_rspq_buffer_config(TestContext *ctx)
+{
+    // Use a ring of small buffers, to force many buffer switches
+    // and wrap around the ring several times.
+    rspq_init_config(&(rspq_config_t){
+        .lowpri_buffer_size = 0x100,
+        .lowpri_buffer_count = 4,
+    });
+    DEFER(rspq_close());
+
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    uint64_t expected_sum = 0;
+
+    for (uint32_t i = 0; i < 0x1000; i++)
+    {
+        switch (RANDN(3))
+        {
+            case 0:
+                rspq_test_4(1);
+                break;
+            case 1:
+                rspq_test_8(1);
+                break;
+            case 2:
+                rspq_test_16(1);
+                break;
+        }
+
+        ++expected_sum;
+    }
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_output(actual_sum);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, expected_sum, "Possibly not all commands have been executed!");
+
+    rspq_buffer_stats_t stats;
+    rspq_get_buffer_stats(&stats);
+    ASSERT(stats.buffer_switches >= 8, "too few buffer switches: %lu", stats.buffer_switches);
+    ASSERT(stats.stalls <= stats.buffer_switches, "more stalls than switches: %lu/%lu", stats.stalls, stats.buffer_switches);
+
+    rspq_reset_buffer_stats();
+    rspq_get_buffer_stats(&stats);
+    ASSERT_EQUAL_UNSIGNED(stats.buffer_switches, 0, "stats not reset");
+}
+
+void test_rspq_rec(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_rec_t *rec1 = rspq_rec_new();
+    DEFER(rspq_rec_free(rec1));
+    rspq_rec_t *rec2 = rspq_rec_new();
+    DEFER(rspq_rec_free(rec2));
+
+    uint64_t actual_sum[3][2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, sizeof(actual_sum));
+
+    // Interleave writes to the two recordings and the main queue
+    rspq_rec_begin(rec1);
+    rspq_test_4(0x1);
+    rspq_rec_end(rec1);
+
+    rspq_test_4(0x10);
+
+    rspq_rec_begin(rec2);
+    rspq_test_4(0x100);
+        // Nested recording, like an interrupt handler would do
+        rspq_rec_begin(rec1);
+        rspq_test_4(0x2);
+        rspq_test_output(actual_sum[0]);
+        rspq_rec_end(rec1);
+    rspq_test_output(actual_sum[1]);
+    rspq_rec_end(rec2);
+
+    rspq_test_output(actual_sum[2]);
+
+    // Recordings must run in submission order, after the main queue
+    rspq_rec_submit(rec2);
+    rspq_rec_submit(rec1);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+
+    ASSERT_EQUAL_HEX(actual_sum[2][0], 0x10, "main queue sum is wrong");
+    ASSERT_EQUAL_HEX(actual_sum[1][0], 0x110, "first submitted recording sum is wrong");
+    ASSERT_EQUAL_HEX(actual_sum[0][0], 0x113, "second submitted recording sum is wrong");
+
+    // Recordings are reusable after submission
+    data_cache_hit_writeback_invalidate(actual_sum, sizeof(actual_sum));
+    rspq_rec_begin(rec1);
+    rspq_test_4(0x1000);
+    rspq_test_output(actual_sum[0]);
+    rspq_rec_end(rec1);
+    rspq_rec_submit(rec1);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+
+    ASSERT_EQUAL_HEX(actual_sum[0][0], 0x1113, "reused recording sum is wrong");
+}
+
+void test_rspq_rec_unordered(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_rec_t *recs[3];
+    for (int i=0; i<3; i++)
+        recs[i] = rspq_rec_new();
+    DEFER(for (int i=0; i<3; i++) rspq_rec_free(recs[i]));
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    // Make sure the test overlay is loaded, and start counting from here
+    rspq_test_4(0x10);
+    rspq_wait();
+    rspq_reset_overlay_stats();
+
+    // Interleave recordings of the two overlays
+    rspq_rec_begin(recs[0]);
+    rspq_test_4(0x1);
+    rspq_rec_end(recs[0]);
+
+    rspq_rec_begin(recs[1]);
+    rspq_test2(0x1234, 0x5678);
+    rspq_rec_end(recs[1]);
+
+    rspq_rec_begin(recs[2]);
+    rspq_test_4(0x2);
+    rspq_rec_end(recs[2]);
+
+    for (int i=0; i<3; i++)
+        rspq_rec_submit_unordered(recs[i]);
+    rspq_flush();
+
+    rspq_test_output(actual_sum);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+
+    ASSERT_EQUAL_HEX(actual_sum[0], 0x13, "Possibly not all commands have been executed!");
+
+    // The scheduler must have run recs[2] before recs[1], so only two overlay
+    // switches were needed (test -> test2 -> test), instead of three.
+    rspq_overlay_stats_t stats;
+    rspq_get_overlay_stats(&stats);
+    ASSERT_EQUAL_UNSIGNED(stats.scheduled_recordings, 1, "wrong number of scheduled recordings");
+    ASSERT_EQUAL_UNSIGNED(stats.overlay_loads, 2, "wrong number of overlay loads");
+}
+
 void test_rspq_flush(TestContext *ctx)
 {
     TEST_RSPQ_PROLOG();
@@ -815,3 +976,40 @@ void test_rspq_rdp_dynamic_switch(TestContext *ctx)
     }
 }
 
+void test_rspq_profile(TestContext *ctx)
+{
+    if (!RSPQ_PROFILE)
+        SKIP("RSPQ_PROFILE is disabled (run testrom_prof.z64)");
+
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    // Start from a clean frame
+    rspq_profile_next_frame();
+    rspq_profile_reset();
+
+    // Enough commands to flush the DMEM ring to RDRAM a few times
+    const int count = 100;
+    for (int i = 0; i < count; i++) {
+        rspq_noop();
+        rspq_test_4(i);
+    }
+    rspq_profile_next_frame();
+
+    static rspq_profile_data_t data;
+    rspq_profile_get_data(&data);
+    ASSERT_EQUAL_UNSIGNED(data.frame_count, 1, "wrong number of frames");
+    ASSERT_EQUAL_UNSIGNED(data.dropped_samples, 0, "samples were dropped");
+
+    rspq_profile_cmd_t *noop = &data.commands[RSPQ_CMD_NOOP];
+    rspq_profile_cmd_t *test4 = &data.commands[test_ovl_id >> 24];
+    ASSERT_EQUAL_UNSIGNED(noop->calls, count, "wrong number of noops");
+    ASSERT_EQUAL_UNSIGNED(test4->calls, count, "wrong number of test commands");
+    ASSERT(test4->total_cycles > 0, "test command took no time");
+    ASSERT(test4->max_cycles * count >= test4->total_cycles, "max cycles is not the maximum");
+
+    rspq_profile_reset();
+    rspq_profile_get_data(&data);
+    ASSERT_EQUAL_UNSIGNED(data.commands[RSPQ_CMD_NOOP].calls, 0, "stats not reset");
+}
@@ -8,9 +8,25 @@
 #include <dirent.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <time.h>
+
+#include "../common/assetcache.c"
+#include "../common/parallel.h"
+
+/** @brief Version of the audioconv64 output, for the asset cache (bump when the output changes) */
+#define AUDIOCONV_CACHE_VERSION   "1"
 
 bool flag_verbose = false;
 bool flag_debug = false;
+assetcache_t cache;
+
+// Parallel conversion (-j): each file is converted by a child process, which
+// receives child_args (the options seen so far) plus its input/output files.
+int num_jobs = 1;
+parallel_job_t *jobs = NULL;
+int num_queued = 0, cap_queued = 0;
+const char **child_args = NULL;
+int num_child_args = 0;
 
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 	#define LE32_TO_HOST(i) __builtin_bswap32(i)
@@ -72,6 +88,9 @@ void usage(void) {
 	printf("   -o / --output <dir>       Specify output directory\n");
 	printf("   -v / --verbose            Verbose mode\n");
 	printf("   -d / --debug              Dump uncompressed files in output directory for debugging\n");
+	printf("   -j / --jobs <N>           Convert files in parallel using N processes (0 = one per CPU, default: 1)\n");
+	printf("   --cache-dir <dir>         Reuse previous conversions stored in the specified cache directory\n");
+	printf("   --cache-size <MiB>        Maximum size of the cache directory (0 = unlimited, default: %d)\n", (int)(ASSETCACHE_DEFAULT_MAX_SIZE / (1024*1024)));
 	printf("\n");
 	printf("WAV/MP3 options:\n");
 	printf("   --wav-mono                Force mono output\n");
@@ -79,6 +98,8 @@ void usage(void) {
 	printf("   --wav-compress <0|1>      Enable compression: 0=none, 1=vadpcm (default)\n");
 	printf("   --wav-loop <true|false>   Activate playback loop by default\n");
 	printf("   --wav-loop-offset <N>     Set looping offset (in samples; default: 0)\n");
+	printf("   --wav-threads <N>         Number of threads for VADPCM compression (default: one per CPU)\n");
+	printf("   --wav-benchmark           Report VADPCM compression speed, compared to a single thread\n");
 	printf("\n");
 	printf("YM options:\n");
 	printf("   --ym-compress <true|false>  Compress output file\n");
@@ -93,28 +114,60 @@ char* changeext(const char* fn, char *ext) {
 	return strdup(buf);
 }
 
-void convert(char *infn, char *outfn1) {
+typedef int (*converter_t)(const char *infn, const char *outfn);
+
+// Select the converter for a file, given its extension
+bool select_converter(char *infn, converter_t *conv, char **outext) {
 	char *ext = strrchr(infn, '.');
 	if (!ext) {
 		fprintf(stderr, "unknown file type: %s\n", infn);
-		return;
+		return false;
 	}
 
 	if (strcasecmp(ext, ".wav") == 0 || strcasecmp(ext, ".aiff") == 0 || strcasecmp(ext, ".mp3") == 0) {
-		char *outfn = changeext(outfn1, ".wav64");
-		wav_convert(infn, outfn);
-		free(outfn);
+		*conv = wav_convert; *outext = ".wav64";
 	} else if (strcasecmp(ext, ".xm") == 0) {
-		char *outfn = changeext(outfn1, ".xm64");
-		xm_convert(infn, outfn);
-		free(outfn);
+		*conv = xm_convert; *outext = ".xm64";
 	} else if (strcasecmp(ext, ".ym") == 0) {
-		char *outfn = changeext(outfn1, ".ym64");
-		ym_convert(infn, outfn);
-		free(outfn);
+		*conv = ym_convert; *outext = ".ym64";
 	} else {
 		fprintf(stderr, "WARNING: ignoring unknown file: %s\n", infn);
+		return false;
+	}
+	return true;
+}
+
+// Number of conversions that failed (reflected in the exit status)
+int num_failed = 0;
+
+void convert(char *infn, char *outfn1) {
+	converter_t conv; char *outext;
+	if (!select_converter(infn, &conv, &outext))
+		return;
+
+	char *outfn = changeext(outfn1, outext);
+
+	// Debug mode writes additional files that are not cached, so always convert
+	assetcache_key_t key;
+	bool use_cache = cache.dir && !flag_debug;
+	if (use_cache) {
+		assetcache_key_init(&key, "audioconv64", AUDIOCONV_CACHE_VERSION);
+		assetcache_key_add_parm(&key, "type=%s", outext);
+		assetcache_key_add_parm(&key, "wav=%d,%d,%d,%d,%d ym=%d",
+			flag_wav_looping, flag_wav_looping_offset, flag_wav_compress, flag_wav_resample, flag_wav_mono,
+			flag_ym_compress);
+		use_cache = assetcache_key_add_file(&key, infn);
+	}
+
+	if (use_cache && assetcache_fetch(&cache, &key, outfn)) {
+		if (flag_verbose)
+			fprintf(stderr, "cache hit: %s => %s\n", infn, outfn);
+	} else if (conv(infn, outfn) != 0) {
+		num_failed++;
+	} else if (use_cache) {
+		assetcache_store(&cache, &key, outfn);
 	}
+	free(outfn);
 }
 
 bool exists(const char *path) {
@@ -124,14 +177,35 @@ bool exists(const char *path) {
 
 bool isfile(const char *path) {
 	struct stat st;
-	stat(path, &st);
-	return (st.st_mode & S_IFREG) != 0;
+	return stat(path, &st) == 0 && (st.st_mode & S_IFREG) != 0;
 }
 
 bool isdir(const char *path) {
 	struct stat st;
-	stat(path, &st);
-	return (st.st_mode & S_IFDIR) != 0;
+	return stat(path, &st) == 0 && (st.st_mode & S_IFDIR) != 0;
+}
+
+// Queue the conversion of a file as a job for parallel_run. The child process
+// is invoked with the exact output path, so it produces the same file that
+// convert() would.
+void queue_convert(char *infn, char *outfn1) {
+	converter_t conv; char *outext;
+	if (!select_converter(infn, &conv, &outext))
+		return;
+
+	const char **argv = calloc(num_child_args + 4, sizeof(char*));
+	int n = 0;
+	for (int i=0; i<num_child_args; i++)
+		argv[n++] = child_args[i];
+	argv[n++] = "-o";
+	argv[n++] = strdup(outfn1);
+	argv[n++] = strdup(infn);
+
+	if (num_queued == cap_queued) {
+		cap_queued = cap_queued ? cap_queued * 2 : 64;
+		jobs = realloc(jobs, cap_queued * sizeof(parallel_job_t));
+	}
+	jobs[num_queued++] = (parallel_job_t){ .name = argv[n-1], .argv = argv };
 }
 
 void walkdir(char *inpath, char *outpath, void (*func)(char *, char*)) {
@@ -188,10 +262,53 @@ int main(int argc, char *argv[]) {
 	}
 
 	char *outdir = ".";
+	char *cache_dir = NULL; int cache_size = ASSETCACHE_DEFAULT_MAX_SIZE / (1024*1024);
 
+	// Look for the cache and jobs options first, so that they apply to all files
 	int i;
+	for (i=1; i<argc-1; i++) {
+		if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			char extra;
+			if (sscanf(argv[i+1], "%d%c", &num_jobs, &extra) != 1 || num_jobs < 0) {
+				fprintf(stderr, "invalid argument for %s: %s\n", argv[i], argv[i+1]);
+				return 1;
+			}
+			if (num_jobs == 0) num_jobs = parallel_num_cpus();
+		}
+		if (!strcmp(argv[i], "--cache-dir"))
+			cache_dir = argv[i+1];
+		if (!strcmp(argv[i], "--cache-size")) {
+			char extra;
+			if (sscanf(argv[i+1], "%d%c", &cache_size, &extra) != 1 || cache_size < 0) {
+				fprintf(stderr, "invalid argument for %s: %s\n", argv[i], argv[i+1]);
+				return 1;
+			}
+		}
+	}
+	if (num_jobs > 1) {
+		// Children share the cache directory (stores are atomic). Each job
+		// already runs on its own core, so by default do not spread the VADPCM
+		// compression on multiple threads (an explicit --wav-threads overrides this).
+		char *cache_size_arg; asprintf(&cache_size_arg, "%d", cache_size);
+		child_args = calloc(argc + 8, sizeof(char*));
+		child_args[num_child_args++] = argv[0];
+		child_args[num_child_args++] = "--wav-threads";
+		child_args[num_child_args++] = "1";
+		if (cache_dir) {
+			child_args[num_child_args++] = "--cache-dir";
+			child_args[num_child_args++] = cache_dir;
+			child_args[num_child_args++] = "--cache-size";
+			child_args[num_child_args++] = cache_size_arg;
+		}
+	} else if (cache_dir && !assetcache_init(&cache, cache_dir, (uint64_t)cache_size * 1024 * 1024))
+		return 1;
+
 	for (i=1; i<argc; i++) {
-		if (argv[i][0] == '-') {	
+		if (argv[i][0] == '-') {
+			// Forward conversion options to the children (-o, -j and the cache
+			// options are handled separately).
+			int first_arg = i;
+
 			if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
 				flag_verbose = true;
 			} else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
@@ -251,6 +368,18 @@ int main(int argc, char *argv[]) {
 					fprintf(stderr, "invalid argument for --wav-resample: %s\n", argv[i]);
 					return 1;
 				}
+			} else if (!strcmp(argv[i], "--wav-threads")) {
+				if (++i == argc) {
+					fprintf(stderr, "missing argument for --wav-threads\n");
+					return 1;
+				}
+				char extra;
+				if (sscanf(argv[i], "%d%c", &flag_wav_threads, &extra) != 1 || flag_wav_threads < 0) {
+					fprintf(stderr, "invalid argument for --wav-threads: %s\n", argv[i]);
+					return 1;
+				}
+			} else if (!strcmp(argv[i], "--wav-benchmark")) {
+				flag_wav_benchmark = true;
 			} else if (!strcmp(argv[i], "--ym-compress")) {
 				if (++i == argc) {
 					fprintf(stderr, "missing argument for --ym-compress\n");
@@ -264,19 +393,56 @@ int main(int argc, char *argv[]) {
 					fprintf(stderr, "invalid boolean argument for --ym-compress: %s\n", argv[i]);
 					return 1;
 				}
+			} else if (!strcmp(argv[i], "--cache-dir") || !strcmp(argv[i], "--cache-size") ||
+					   !strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+				// Already parsed above
+				if (++i == argc) {
+					fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+					return 1;
+				}
+				continue;
 			} else {
 				fprintf(stderr, "invalid option: %s\n", argv[i]);
 				return 1;
 			}
+			if (child_args && strcmp(argv[first_arg], "-o") && strcmp(argv[first_arg], "--output")) {
+				for (int j=first_arg; j<=i; j++)
+					child_args[num_child_args++] = argv[j];
+			}
 		} else {
 			// Positional argument. It's either a file or a directory. Convert it
 			if (!exists(argv[i])) {
 				fprintf(stderr, "ERROR: file %s does not exist\n", argv[i]);
 			} else {
-				walkdir(argv[i], outdir, convert);
+				walkdir(argv[i], outdir, child_args ? queue_convert : convert);
 			}
 		}
 	}
 
-	return 0;
+	if (child_args) {
+		// Run the queued conversions. The output of each job is buffered and
+		// flushed in order, so logs stay grouped per file.
+		int failed = parallel_run(jobs, num_queued, num_jobs, stderr);
+		for (int j=0; j<num_queued; j++) {
+			// The output and input paths are the last two arguments of each
+			// job. Jobs queued earlier have fewer child arguments, so find
+			// the end of each argv.
+			int n = 0;
+			while (jobs[j].argv[n]) n++;
+			free((char*)jobs[j].argv[n-2]);
+			free((char*)jobs[j].argv[n-1]);
+			free(jobs[j].argv);
+		}
+		free(jobs);
+		free(child_args);
+		if (failed)
+			return 1;
+	}
+
+	if (cache.dir) {
+		assetcache_close(&cache);
+		if (flag_verbose)
+			assetcache_print_stats(&cache, stderr);
+	}
+	return num_failed ? 1 : 0;
 }
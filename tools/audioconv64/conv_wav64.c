@@ -32,6 +32,8 @@ int flag_wav_looping_offset = 0;
 int flag_wav_compress = 1;
 int flag_wav_resample = 0;
 bool flag_wav_mono = false;
+int flag_wav_threads = 0;
+bool flag_wav_benchmark = false;
 
 typedef struct {
 	int16_t *samples;
@@ -40,6 +42,91 @@ typedef struct {
 	int sampleRate;
 } wav_data_t;
 
+enum { kPREDICTORS = 4 };
+
+typedef struct {
+	struct vadpcm_params parms;				// Encoder parameters
+	struct vadpcm_vector *codebook;			// Output codebook for this channel
+	int nframes;							// Number of frames to encode
+	int16_t *samples;						// Input samples for this channel (not interleaved)
+	void *dest;								// Output VADPCM frames
+	vadpcm_error err;						// Encoding result
+} vadpcm_channel_t;
+
+static double wav_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* vadpcm_encode_channel(void *arg) {
+	vadpcm_channel_t *ch = arg;
+	void *scratch = malloc(vadpcm_encode_scratch_size(ch->nframes));
+	ch->err = vadpcm_encode(&ch->parms, ch->codebook, ch->nframes, ch->dest, ch->samples, scratch);
+	free(scratch);
+	return NULL;
+}
+
+/**
+ * @brief Encode all channels of a waveform into VADPCM
+ * 
+ * Channels are encoded in parallel, and each encoder gets its share of the
+ * threads for the analysis of the samples. The output does not depend on the
+ * number of threads.
+ * 
+ * @param wav 			Input waveform (interleaved samples)
+ * @param nframes 		Number of VADPCM frames per channel
+ * @param nthreads 		Number of threads to use
+ * @param codebook 		Output codebooks (one after the other for each channel)
+ * @param dest 			Output frames (one channel after the other)
+ * @return true 		on success
+ * @return false 		on error
+ */
+static bool vadpcm_encode_channels(wav_data_t *wav, int nframes, int nthreads, struct vadpcm_vector *codebook, void *dest) {
+	int cnt = nframes * kVADPCMFrameSampleCount;
+	vadpcm_channel_t *chans = calloc(wav->channels, sizeof(vadpcm_channel_t));
+	for (int i=0; i<wav->channels; i++) {
+		vadpcm_channel_t *ch = &chans[i];
+		ch->parms.predictor_count = kPREDICTORS;
+		ch->parms.thread_count = nthreads / wav->channels;
+		ch->codebook = codebook + kPREDICTORS * kVADPCMEncodeOrder * i;
+		ch->nframes = nframes;
+		ch->dest = (uint8_t*)dest + i * nframes * kVADPCMFrameByteSize;
+		ch->samples = malloc(cnt * sizeof(int16_t));
+		for (int j=0; j<cnt; j++)
+			ch->samples[j] = wav->samples[i + j*wav->channels];
+	}
+
+	if (nthreads > 1 && wav->channels > 1) {
+		pthread_t *threads = calloc(wav->channels, sizeof(pthread_t));
+		bool *started = calloc(wav->channels, sizeof(bool));
+		for (int i=1; i<wav->channels; i++) {
+			started[i] = pthread_create(&threads[i], NULL, vadpcm_encode_channel, &chans[i]) == 0;
+			if (!started[i])
+				vadpcm_encode_channel(&chans[i]);
+		}
+		vadpcm_encode_channel(&chans[0]);
+		for (int i=1; i<wav->channels; i++)
+			if (started[i]) pthread_join(threads[i], NULL);
+		free(started);
+		free(threads);
+	} else {
+		for (int i=0; i<wav->channels; i++)
+			vadpcm_encode_channel(&chans[i]);
+	}
+
+	bool ok = true;
+	for (int i=0; i<wav->channels; i++) {
+		if (ok && chans[i].err != 0) {
+			fprintf(stderr, "VADPCM encoding error: %s\n", vadpcm_error_name(chans[i].err));
+			ok = false;
+		}
+		free(chans[i].samples);
+	}
+	free(chans);
+	return ok;
+}
+
 static size_t read_wav(const char *infn, wav_data_t *out)
 {
 	drwav wav;
@@ -262,29 +349,39 @@ int wav_convert(const char *infn, const char *outfn) {
 			cnt = newcnt;
 		}
 
-		enum { kPREDICTORS = 4 };
-
 		assert(cnt % kVADPCMFrameSampleCount == 0);
 		int nframes = cnt / kVADPCMFrameSampleCount;
-		void *scratch = malloc(vadpcm_encode_scratch_size(nframes));
 		struct vadpcm_vector *codebook = alloca(kPREDICTORS * kVADPCMEncodeOrder * wav.channels * sizeof(struct vadpcm_vector));
-		struct vadpcm_params parms = { .predictor_count = kPREDICTORS };
 		void *dest = malloc(nframes * kVADPCMFrameByteSize * wav.channels);
+		int nthreads = flag_wav_threads ? flag_wav_threads : parallel_num_cpus();
 		
 		if (flag_verbose)
-			fprintf(stderr, "  compressing into VADPCM format (%d frames)\n", nframes);
-
-		int16_t *schan = malloc(cnt * sizeof(int16_t));
-		uint8_t *destchan = dest;
-		for (int i=0; i<wav.channels; i++) {
-			for (int j=0; j<cnt; j++)
-				schan[j] = wav.samples[i + j*wav.channels];
-			vadpcm_error err = vadpcm_encode(&parms, codebook + kPREDICTORS * kVADPCMEncodeOrder * i, nframes, destchan, schan, scratch);
-			if (err != 0) {
-				fprintf(stderr, "VADPCM encoding error: %s\n", vadpcm_error_name(err));
+			fprintf(stderr, "  compressing into VADPCM format (%d frames, %d threads)\n", nframes, nthreads);
+
+		double t0 = wav_time();
+		if (!vadpcm_encode_channels(&wav, nframes, nthreads, codebook, dest))
+			return 1;
+		double elapsed = wav_time() - t0;
+
+		if (flag_verbose || flag_wav_benchmark)
+			fprintf(stderr, "  VADPCM: %.3f s, %.0f frames/sec (%d threads)\n",
+				elapsed, nframes * wav.channels / elapsed, nthreads);
+
+		if (flag_wav_benchmark) {
+			// Encode again using a single thread, and check that the output is identical
+			struct vadpcm_vector *codebook1 = alloca(kPREDICTORS * kVADPCMEncodeOrder * wav.channels * sizeof(struct vadpcm_vector));
+			void *dest1 = malloc(nframes * kVADPCMFrameByteSize * wav.channels);
+			t0 = wav_time();
+			if (!vadpcm_encode_channels(&wav, nframes, 1, codebook1, dest1))
 				return 1;
-			}
-			destchan += nframes * kVADPCMFrameByteSize;
+			double elapsed1 = wav_time() - t0;
+			bool same = memcmp(dest, dest1, nframes * kVADPCMFrameByteSize * wav.channels) == 0 &&
+				memcmp(codebook, codebook1, kPREDICTORS * kVADPCMEncodeOrder * wav.channels * sizeof(struct vadpcm_vector)) == 0;
+			fprintf(stderr, "  VADPCM: %.3f s, %.0f frames/sec (1 thread) -- speedup: %.2fx, output %s\n",
+				elapsed1, nframes * wav.channels / elapsed1, elapsed1 / elapsed, same ? "identical" : "DIFFERENT");
+			free(dest1);
+			if (!same)
+				failed = true;
 		}
 
 		struct vadpcm_vector state = {0};
@@ -305,7 +402,6 @@ int wav_convert(const char *infn, const char *outfn) {
 				fwrite(dest + (j * nframes + i) * kVADPCMFrameByteSize, 1, kVADPCMFrameByteSize, out);
 		}
 		free(dest);
-		free(scratch);
 	} break;
 
 	}
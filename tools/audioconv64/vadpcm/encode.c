@@ -4,6 +4,8 @@
 #include "vadpcm.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -16,8 +18,90 @@ enum {
 
     // Iterations for predictor assignment.
     kVADPCMIterations = 20,
+
+    // Minimum number of frames processed by each thread. Smaller ranges are
+    // not worth the cost of starting a thread.
+    kVADPCMMinThreadFrames = 4096,
+
+    // Maximum number of threads.
+    kVADPCMMaxThreads = 64,
 };
 
+// Threading
+// =========
+//
+// The analysis passes work on each frame independently, so they are run in
+// parallel on contiguous ranges of frames. Anything that is not exactly
+// reproducible (like floating-point sums) is computed serially, so the output
+// is always identical to the single-threaded encoder.
+
+// A function processing the frames in the range [start, end).
+typedef void (*vadpcm_range_func)(void *arg, int thread, size_t start,
+                                  size_t end);
+
+struct vadpcm_range_task {
+    vadpcm_range_func func;
+    void *arg;
+    int thread;
+    size_t start, end;
+};
+
+static void *vadpcm_range_thread(void *p) {
+    struct vadpcm_range_task *task = p;
+    task->func(task->arg, task->thread, task->start, task->end);
+    return NULL;
+}
+
+// Return the number of threads to use for processing the given number of
+// frames.
+static int vadpcm_thread_count(int thread_count, size_t frame_count) {
+    size_t max = frame_count / kVADPCMMinThreadFrames;
+    if (thread_count > kVADPCMMaxThreads) {
+        thread_count = kVADPCMMaxThreads;
+    }
+    if ((size_t)thread_count > max) {
+        thread_count = (int)max;
+    }
+    return thread_count > 1 ? thread_count : 1;
+}
+
+// Run the function over all frames, split into thread_count ranges. The first
+// range is processed by the calling thread. Ranges are assigned to threads in
+// order, so thread N always processes frames before thread N+1.
+static void vadpcm_parallel(int thread_count, size_t frame_count,
+                            vadpcm_range_func func, void *arg) {
+    if (thread_count <= 1) {
+        func(arg, 0, 0, frame_count);
+        return;
+    }
+    struct vadpcm_range_task tasks[kVADPCMMaxThreads];
+    pthread_t threads[kVADPCMMaxThreads];
+    bool started[kVADPCMMaxThreads];
+    for (int i = 0; i < thread_count; i++) {
+        tasks[i] = (struct vadpcm_range_task){
+            .func = func,
+            .arg = arg,
+            .thread = i,
+            .start = frame_count * i / thread_count,
+            .end = frame_count * (i + 1) / thread_count,
+        };
+    }
+    for (int i = 1; i < thread_count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, vadpcm_range_thread,
+                                    &tasks[i]) == 0;
+        if (!started[i]) {
+            // Could not start the thread: just process the range here.
+            vadpcm_range_thread(&tasks[i]);
+        }
+    }
+    vadpcm_range_thread(&tasks[0]);
+    for (int i = 1; i < thread_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
 // Autocorrelation is a symmetric 3x3 matrix.
 //
 // The upper triangle is stored. Indexes:
@@ -26,14 +110,21 @@ enum {
 // [_ 2 4]
 // [_ _ 5]
 
-// Calculate the autocorrelation matrix for each frame.
-static void vadpcm_autocorr(size_t frame_count, float (*restrict corr)[6],
-                            const int16_t *restrict src) {
+// Calculate the autocorrelation matrix for the frames in [start, end).
+static void vadpcm_autocorr_range(size_t start, size_t end,
+                                  float (*restrict corr)[6],
+                                  const int16_t *restrict src) {
     float x0 = 0.0f, x1 = 0.0f, x2 = 0.0f, m[6];
     size_t frame;
     int i;
 
-    for (frame = 0; frame < frame_count; frame++) {
+    // Samples of the previous frame are part of the correlation.
+    if (start > 0) {
+        x1 = src[start * kVADPCMFrameSampleCount - 2] * (1.0f / 32768.0f);
+        x0 = src[start * kVADPCMFrameSampleCount - 1] * (1.0f / 32768.0f);
+    }
+
+    for (frame = start; frame < end; frame++) {
         for (i = 0; i < 6; i++) {
             m[i] = 0.0f;
         }
@@ -203,12 +294,12 @@ static double vadpcm_eval_solved(const double corr[restrict static 6],
     return corr[0] - corr[1] * coeff[0] - corr[3] * coeff[1];
 }
 
-// Calculate the best-case error for each frame, given the autocorrelation
-// matrixes.
-static void vadpcm_best_error(size_t frame_count,
+// Calculate the best-case error for each frame in [start, end), given the
+// autocorrelation matrixes.
+static void vadpcm_best_error(size_t start, size_t end,
                               const float (*restrict corr)[6],
                               float *restrict best_error) {
-    for (size_t frame = 0; frame < frame_count; frame++) {
+    for (size_t frame = start; frame < end; frame++) {
         double fcorr[6];
         for (int i = 0; i < 6; i++) {
             fcorr[i] = (double)corr[frame][i];
@@ -219,11 +310,46 @@ static void vadpcm_best_error(size_t frame_count,
     }
 }
 
+struct vadpcm_assign_ctx {
+    const float (*restrict corr)[6];
+    const float (*restrict coeff)[2];
+    int active_count;
+    float *restrict error;
+    uint8_t *restrict predictors;
+    // Number of frames assigned to each predictor, for each thread.
+    int count[kVADPCMMaxThreads][kVADPCMMaxPredictorCount];
+};
+
+// Assign the frames in [start, end) to the best predictor for each frame.
+static void vadpcm_assign_range(void *arg, int thread, size_t start,
+                                size_t end) {
+    struct vadpcm_assign_ctx *ctx = arg;
+    int *restrict count = ctx->count[thread];
+    for (int i = 0; i < ctx->active_count; i++) {
+        count[i] = 0;
+    }
+    for (size_t frame = start; frame < end; frame++) {
+        int fpredictor = 0;
+        float ferror = 0.0f;
+        for (int i = 0; i < ctx->active_count; i++) {
+            float e = vadpcm_eval(ctx->corr[frame], ctx->coeff[i]);
+            if (i == 0 || e < ferror) {
+                fpredictor = i;
+                ferror = e;
+            }
+        }
+        ctx->predictors[frame] = fpredictor;
+        ctx->error[frame] = ferror;
+        count[fpredictor]++;
+    }
+}
+
 // Refine (improve) the existing predictor assignments. Does not assign
 // unassigned predictors. Record the amount of error, squared, for each frame.
 // Returns the index of an unassigned predictor, or predictor_count, if no
 // predictor is unassigned.
 static int vadpcm_refine_predictors(size_t frame_count, int predictor_count,
+                                    int thread_count,
                                     const float (*restrict corr)[6],
                                     float *restrict error,
                                     uint8_t *restrict predictors) {
@@ -248,51 +374,77 @@ static int vadpcm_refine_predictors(size_t frame_count, int predictor_count,
 
     // Assign frames to the best predictor for each frame, and record the amount
     // of error.
-    int count2[kVADPCMMaxPredictorCount];
+    struct vadpcm_assign_ctx ctx = {
+        .corr = corr,
+        .coeff = (const float(*)[2])coeff,
+        .active_count = active_count,
+        .error = error,
+        .predictors = predictors,
+    };
+    vadpcm_parallel(thread_count, frame_count, vadpcm_assign_range, &ctx);
     for (int i = 0; i < active_count; i++) {
-        count2[i] = 0;
-    }
-    for (size_t frame = 0; frame < frame_count; frame++) {
-        int fpredictor = 0;
-        float ferror = 0.0f;
-        for (int i = 0; i < active_count; i++) {
-            float e = vadpcm_eval(corr[frame], coeff[i]);
-            if (i == 0 || e < ferror) {
-                fpredictor = i;
-                ferror = e;
-            }
+        int count2 = 0;
+        for (int t = 0; t < thread_count; t++) {
+            count2 += ctx.count[t][i];
         }
-        predictors[frame] = fpredictor;
-        error[frame] = ferror;
-        count2[fpredictor]++;
-    }
-    for (int i = 0; i < active_count; i++) {
-        if (count2[i] == 0) {
+        if (count2 == 0) {
             return i;
         }
     }
     return active_count;
 }
 
-// Find the frame where the error is highest, relative to the best case.
-static size_t vadpcm_worst_frame(size_t frame_count,
-                                 const float *restrict best_error,
-                                 const float *restrict error) {
-    float best_improvement = error[0] - best_error[0];
-    size_t best_index = 0;
-    for (size_t frame = 1; frame < frame_count; frame++) {
-        float improvement = error[frame] - best_error[frame];
+struct vadpcm_worst_ctx {
+    const float *restrict best_error;
+    const float *restrict error;
+    // Worst frame found by each thread, and its improvement.
+    size_t index[kVADPCMMaxThreads];
+    float improvement[kVADPCMMaxThreads];
+};
+
+// Find the frame in [start, end) where the error is highest, relative to the
+// best case.
+static void vadpcm_worst_range(void *arg, int thread, size_t start,
+                               size_t end) {
+    struct vadpcm_worst_ctx *ctx = arg;
+    float best_improvement = ctx->error[start] - ctx->best_error[start];
+    size_t best_index = start;
+    for (size_t frame = start + 1; frame < end; frame++) {
+        float improvement = ctx->error[frame] - ctx->best_error[frame];
         if (improvement > best_improvement) {
             best_improvement = improvement;
             best_index = frame;
         }
     }
+    ctx->index[thread] = best_index;
+    ctx->improvement[thread] = best_improvement;
+}
+
+// Find the frame where the error is highest, relative to the best case. Ties
+// are resolved in favor of the first frame, irrespective of the thread count.
+static size_t vadpcm_worst_frame(size_t frame_count, int thread_count,
+                                 const float *restrict best_error,
+                                 const float *restrict error) {
+    struct vadpcm_worst_ctx ctx = {
+        .best_error = best_error,
+        .error = error,
+    };
+    vadpcm_parallel(thread_count, frame_count, vadpcm_worst_range, &ctx);
+    size_t best_index = ctx.index[0];
+    float best_improvement = ctx.improvement[0];
+    for (int t = 1; t < thread_count; t++) {
+        if (ctx.improvement[t] > best_improvement) {
+            best_improvement = ctx.improvement[t];
+            best_index = ctx.index[t];
+        }
+    }
     return best_index;
 }
 
 // Assign a predictor to each frame. The predictors array should be initialized
 // to zero.
 static void vadpcm_assign_predictors(size_t frame_count, int predictor_count,
+                                     int thread_count,
                                      const float (*restrict corr)[6],
                                      const float *restrict best_error,
                                      float *restrict error,
@@ -301,14 +453,15 @@ static void vadpcm_assign_predictors(size_t frame_count, int predictor_count,
     int active_count = 1;
     for (int iter = 0; iter < kVADPCMIterations; iter++) {
         if (unassigned < predictor_count) {
-            size_t worst = vadpcm_worst_frame(frame_count, best_error, error);
+            size_t worst = vadpcm_worst_frame(frame_count, thread_count,
+                                              best_error, error);
             predictors[worst] = unassigned;
             if (unassigned >= active_count) {
                 active_count = unassigned + 1;
             }
         }
-        unassigned = vadpcm_refine_predictors(frame_count, active_count, corr,
-                                              error, predictors);
+        unassigned = vadpcm_refine_predictors(
+            frame_count, active_count, thread_count, corr, error, predictors);
     }
 }
 
@@ -488,6 +641,25 @@ static void vadpcm_encode_data(size_t frame_count, void *restrict dest,
     }
 }
 
+struct vadpcm_analysis_ctx {
+    const int16_t *restrict src;
+    float (*restrict corr)[6];
+    float *restrict best_error;
+};
+
+// Calculate the autocorrelation matrix and (optionally) the best-case error of
+// the frames in [start, end).
+static void vadpcm_analysis_range(void *arg, int thread, size_t start,
+                                  size_t end) {
+    struct vadpcm_analysis_ctx *ctx = arg;
+    (void)thread;
+    vadpcm_autocorr_range(start, end, ctx->corr, ctx->src);
+    if (ctx->best_error != NULL) {
+        vadpcm_best_error(start, end, (const float(*)[6])ctx->corr,
+                          ctx->best_error);
+    }
+}
+
 vadpcm_error vadpcm_encode(const struct vadpcm_params *restrict params,
                            struct vadpcm_vector *restrict codebook,
                            size_t frame_count, void *restrict dest,
@@ -519,14 +691,19 @@ vadpcm_error vadpcm_encode(const struct vadpcm_params *restrict params,
         predictors = (void *)ptr;
     }
 
-    vadpcm_autocorr(frame_count, corr, src);
+    int thread_count = vadpcm_thread_count(params->thread_count, frame_count);
+    struct vadpcm_analysis_ctx ctx = {
+        .src = src,
+        .corr = corr,
+        .best_error = predictor_count > 1 ? best_error : NULL,
+    };
+    vadpcm_parallel(thread_count, frame_count, vadpcm_analysis_range, &ctx);
     for (size_t i = 0; i < frame_count; i++) {
         predictors[i] = 0;
     }
     if (predictor_count > 1) {
-        vadpcm_best_error(frame_count, corr, best_error);
-        vadpcm_assign_predictors(frame_count, predictor_count, corr, best_error,
-                                 error, predictors);
+        vadpcm_assign_predictors(frame_count, predictor_count, thread_count,
+                                 corr, best_error, error, predictors);
     }
     vadpcm_make_codebook(frame_count, predictor_count, corr, predictors,
                          codebook);
@@ -571,7 +748,7 @@ static void test_autocorr(void) {
 
         // Get the autocorrelation.
         float corr[2][6];
-        vadpcm_autocorr(2, corr, data);
+        vadpcm_autocorr_range(0, 2, corr, data);
 
         // Calculate error directly.
         float s1 = (float)data[kVADPCMFrameSampleCount - 2] * (1.0f / 32768.0f);
@@ -131,6 +131,10 @@ vadpcm_error vadpcm_decode(int predictor_count, int order,
 struct vadpcm_params {
     // The number of predictors to put in the codebook.
     int predictor_count;
+
+    // The number of threads to use for the analysis of the audio. Zero or one
+    // means single-threaded. The output does not depend on this value.
+    int thread_count;
 };
 
 // Return the amount of scratch space needed to encode a file with the given
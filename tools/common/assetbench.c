@@ -0,0 +1,200 @@
+/**
+ * @file assetbench.c
+ * @brief Host-side benchmark of the asset compression algorithms
+ *
+ * This is the host counterpart of the decompression benchmark ROM
+ * (tests/benchrom.c): it compresses a corpus of files with every supported
+ * algorithm and reports compression ratio and compression speed. Run it on
+ * the same corpus (eg: "make bench-host" in the tests directory) to compare
+ * the trade-offs of each algorithm.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "binout.c"
+#include "assetcomp.h"
+#include "asset.h"
+
+#include "../../src/asset_internal.h"
+
+#define NUM_LEVELS      3
+
+static const char *level_names[NUM_LEVELS+1] = { "none", "lz4", "aplib", "shrinkler" };
+
+typedef struct {
+    uint64_t orig_size;         ///< Total uncompressed size
+    uint64_t cmp_size;          ///< Total compressed size
+    double secs;                ///< Total compression time
+} bench_total_t;
+
+void print_args(char * name)
+{
+    fprintf(stderr, "%s -- Libdragon asset compression benchmark\n\n", name);
+    fprintf(stderr, "This tool compresses the input files with all the compression levels\n");
+    fprintf(stderr, "supported by the asset library, and reports compression ratio and speed.\n\n");
+    fprintf(stderr, "Usage: %s [flags] <input files...>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Command-line flags:\n");
+    fprintf(stderr, "   -c/--compress <algo>    Only benchmark this compression level (1-%d, default: all)\n", NUM_LEVELS);
+    fprintf(stderr, "   -w/--winsize <window>   Size of the matching window in KiB (default: algorithm's default)\n");
+    fprintf(stderr, "   --chunk <size>          Compress in independent blocks of the given size in KiB (default: off)\n");
+    fprintf(stderr, "   -i/--iterations <n>     Number of iterations per measurement; the best is reported (default: 1)\n");
+    fprintf(stderr, "\n");
+}
+
+static double bench_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** @brief Compress a buffer, returning the compressed size and the time taken */
+static int bench_compress(int level, const uint8_t *data, int size, int winsize, int chunk_size, double *secs)
+{
+    if (!chunk_size) chunk_size = size;
+
+    int total = 0;
+    double t0 = bench_time();
+    for (int pos = 0; pos < size; pos += chunk_size) {
+        int len = size - pos < chunk_size ? size - pos : chunk_size;
+        uint8_t *output; int cmp_size, margin;
+        int w = winsize;
+        asset_compress_mem(level, data + pos, len, &output, &cmp_size, &w, &margin);
+        free(output);
+        total += cmp_size;
+    }
+    *secs = bench_time() - t0;
+
+    // Account for the block index of the chunked format
+    if (chunk_size != size)
+        total += 8 + ((size + chunk_size - 1) / chunk_size + 1) * 4;
+    return total + sizeof(asset_header_t);
+}
+
+int main(int argc, char *argv[])
+{
+    int only_level = 0, winsize = 0, chunk_size = 0, iterations = 1;
+    bench_total_t totals[NUM_LEVELS+1] = {0};
+    bool error = false;
+
+    if (argc < 2) {
+        print_args(argv[0]);
+        return 1;
+    }
+
+    __asset_init_compression_lvl2();
+    __asset_init_compression_lvl3();
+
+    printf("%-24s %9s %-10s %9s %7s %10s\n", "file", "size", "algo", "cmp size", "ratio", "comp MB/s");
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            char extra;
+            if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+                print_args(argv[0]);
+                return 0;
+            } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--compress")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                if (sscanf(argv[i], "%d%c", &only_level, &extra) != 1 || only_level < 1 || only_level > NUM_LEVELS) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+            } else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--winsize")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                if (sscanf(argv[i], "%d%c", &winsize, &extra) != 1 || asset_winsize_to_flags(winsize * 1024) < 0) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    fprintf(stderr, "supported window sizes: 2, 4, 8, 16, 32, 64, 128, 256\n");
+                    return 1;
+                }
+                winsize *= 1024;
+            } else if (!strcmp(argv[i], "--chunk")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                if (sscanf(argv[i], "%d%c", &chunk_size, &extra) != 1 || chunk_size <= 0) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+                chunk_size *= 1024;
+            } else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--iterations")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                if (sscanf(argv[i], "%d%c", &iterations, &extra) != 1 || iterations < 1) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "invalid flag: %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+
+        // Make sure the file exists before calling asset_load, which would just assert.
+        char *infn = argv[i];
+        FILE *in = fopen(infn, "rb");
+        if (!in) {
+            fprintf(stderr, "error opening input file: %s\n", infn);
+            error = true;
+            continue;
+        }
+        fclose(in);
+
+        // Already compressed files are transparently decompressed, so that
+        // the benchmark always starts from the original data.
+        int size;
+        uint8_t *data = asset_load(infn, &size);
+        char *basename = strrchr(infn, '/');
+        if (!basename) basename = infn; else basename += 1;
+
+        for (int level = 1; level <= NUM_LEVELS; level++) {
+            if (only_level && level != only_level)
+                continue;
+            if (chunk_size && level == 3) {
+                // Shrinkler does not support the chunked format
+                continue;
+            }
+
+            int cmp_size = 0;
+            double best = 0;
+            for (int it = 0; it < iterations; it++) {
+                double secs;
+                cmp_size = bench_compress(level, data, size, winsize, chunk_size, &secs);
+                if (it == 0 || secs < best) best = secs;
+            }
+
+            printf("%-24s %9d %-10s %9d %6.1f%% %10.2f\n", basename, size, level_names[level],
+                cmp_size, size ? cmp_size * 100.0 / size : 0.0, size / best / (1024*1024));
+            totals[level].orig_size += size;
+            totals[level].cmp_size += cmp_size;
+            totals[level].secs += best;
+        }
+        free(data);
+    }
+
+    printf("\n");
+    for (int level = 1; level <= NUM_LEVELS; level++) {
+        bench_total_t *t = &totals[level];
+        if (!t->orig_size)
+            continue;
+        printf("%-24s %9llu %-10s %9llu %6.1f%% %10.2f\n", "TOTAL",
+            (unsigned long long)t->orig_size, level_names[level], (unsigned long long)t->cmp_size,
+            t->cmp_size * 100.0 / t->orig_size, t->orig_size / t->secs / (1024*1024));
+    }
+
+    return error ? 1 : 0;
+}
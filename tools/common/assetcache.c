@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "assetcache.h"
+#include "polyfill.h"
+
+// 64-bit FNV-1a hash
+#define FNV64_OFFSET    0xcbf29ce484222325ull
+#define FNV64_PRIME     0x100000001b3ull
+
+static uint64_t fnv64(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len--) {
+        h ^= *p++;
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
+
+static char* assetcache_entry_path(assetcache_t *cache, const assetcache_key_t *key)
+{
+    char *path;
+    asprintf(&path, "%s/%016llx%016llx", cache->dir,
+        (unsigned long long)key->parms_hash, (unsigned long long)key->data_hash);
+    return path;
+}
+
+static bool copy_file(const char *src, const char *dst)
+{
+    FILE *in = fopen(src, "rb");
+    if (!in) return false;
+    FILE *out = fopen(dst, "wb");
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+
+    char buf[64*1024]; size_t n; bool ok = true;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            ok = false;
+            break;
+        }
+    }
+    if (ferror(in)) ok = false;
+    fclose(in);
+    if (fclose(out) != 0) ok = false;
+    return ok;
+}
+
+bool assetcache_init(assetcache_t *cache, const char *dir, uint64_t max_size)
+{
+    memset(cache, 0, sizeof(*cache));
+
+    struct stat st;
+    if (stat(dir, &st) != 0) {
+        #ifndef __MINGW32__
+        mkdir(dir, 0777);
+        #else
+        mkdir(dir);
+        #endif
+        if (stat(dir, &st) != 0) {
+            fprintf(stderr, "ERROR: cannot create cache directory: %s\n", dir);
+            return false;
+        }
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "ERROR: %s is a file but should be a directory\n", dir);
+        return false;
+    }
+
+    cache->dir = strdup(dir);
+    cache->max_size = max_size;
+    return true;
+}
+
+void assetcache_key_init(assetcache_key_t *key, const char *tool, const char *version)
+{
+    key->data_hash = FNV64_OFFSET;
+    key->parms_hash = FNV64_OFFSET;
+    assetcache_key_add_parm(key, "assetcache %s", ASSETCACHE_VERSION);
+    assetcache_key_add_parm(key, "%s %s", tool, version);
+}
+
+void assetcache_key_add_parm(assetcache_key_t *key, const char *fmt, ...)
+{
+    char *parm;
+    va_list va;
+    va_start(va, fmt);
+    vasprintf(&parm, fmt, va);
+    va_end(va);
+
+    // Include the terminator, so that parameters are always separated
+    key->parms_hash = fnv64(key->parms_hash, parm, strlen(parm)+1);
+    free(parm);
+}
+
+bool assetcache_key_add_file(assetcache_key_t *key, const char *fn)
+{
+    FILE *f = fopen(fn, "rb");
+    if (!f) return false;
+
+    char buf[64*1024]; size_t n; uint64_t size = 0;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        key->data_hash = fnv64(key->data_hash, buf, n);
+        size += n;
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+
+    // Also hash the size, so that concatenating multiple files is unambiguous
+    key->data_hash = fnv64(key->data_hash, &size, sizeof(size));
+    return ok;
+}
+
+bool assetcache_fetch(assetcache_t *cache, const assetcache_key_t *key, const char *outfn)
+{
+    if (!cache->dir) return false;
+
+    char *path = assetcache_entry_path(cache, key);
+    bool hit = copy_file(path, outfn);
+    if (hit) {
+        // Refresh the modification time: eviction removes the least recently used entries
+        utime(path, NULL);
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    free(path);
+    return hit;
+}
+
+void assetcache_store(assetcache_t *cache, const assetcache_key_t *key, const char *outfn)
+{
+    if (!cache->dir) return;
+
+    // Write to a temporary file first, and then move it into place. This
+    // makes the store atomic with respect to other tools using the cache.
+    char *path = assetcache_entry_path(cache, key);
+    char *tmppath;
+    asprintf(&tmppath, "%s/.tmp-%d-%016llx%016llx", cache->dir, (int)getpid(),
+        (unsigned long long)key->parms_hash, (unsigned long long)key->data_hash);
+    if (copy_file(outfn, tmppath)) {
+        #ifdef __MINGW32__
+        // rename() does not overwrite existing files on Windows
+        remove(path);
+        #endif
+        if (rename(tmppath, path) == 0)
+            cache->stores++;
+    }
+    remove(tmppath);
+    free(tmppath);
+    free(path);
+}
+
+typedef struct {
+    char *path;
+    uint64_t size;
+    time_t mtime;
+} cache_entry_t;
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    const cache_entry_t *ea = a, *eb = b;
+    if (ea->mtime != eb->mtime)
+        return ea->mtime < eb->mtime ? -1 : 1;
+    return strcmp(ea->path, eb->path);
+}
+
+void assetcache_evict(assetcache_t *cache)
+{
+    if (!cache->dir || !cache->max_size) return;
+
+    DIR *d = opendir(cache->dir);
+    if (!d) return;
+
+    cache_entry_t *entries = NULL;
+    int num_entries = 0, cap_entries = 0;
+    uint64_t total_size = 0;
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        // Skip special entries and temporary files of in-progress stores
+        if (de->d_name[0] == '.')
+            continue;
+        char *path;
+        asprintf(&path, "%s/%s", cache->dir, de->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (num_entries == cap_entries) {
+            cap_entries = cap_entries ? cap_entries*2 : 256;
+            entries = realloc(entries, cap_entries * sizeof(cache_entry_t));
+        }
+        entries[num_entries++] = (cache_entry_t){ path, st.st_size, st.st_mtime };
+        total_size += st.st_size;
+    }
+    closedir(d);
+
+    // Remove the least recently used entries until we are within the limit
+    qsort(entries, num_entries, sizeof(cache_entry_t), cache_entry_cmp);
+    for (int i=0; i<num_entries && total_size > cache->max_size; i++) {
+        if (remove(entries[i].path) == 0) {
+            total_size -= entries[i].size;
+            cache->evictions++;
+            cache->evicted_bytes += entries[i].size;
+        }
+    }
+
+    for (int i=0; i<num_entries; i++)
+        free(entries[i].path);
+    free(entries);
+}
+
+void assetcache_close(assetcache_t *cache)
+{
+    if (!cache->dir) return;
+
+    // The cache can only grow if we stored something, so avoid scanning
+    // the directory otherwise.
+    if (cache->stores && cache->max_size)
+        assetcache_evict(cache);
+
+    free(cache->dir);
+    cache->dir = NULL;
+}
+
+void assetcache_print_stats(assetcache_t *cache, FILE *out)
+{
+    int lookups = cache->hits + cache->misses;
+    fprintf(out, "cache: %d hits, %d misses (hit rate %.1f%%), %d stored, %d evicted (%llu KiB)\n",
+        cache->hits, cache->misses, lookups ? 100.0f * cache->hits / lookups : 0.0f,
+        cache->stores, cache->evictions, (unsigned long long)(cache->evicted_bytes / 1024));
+}
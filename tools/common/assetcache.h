@@ -0,0 +1,100 @@
+#ifndef COMMON_ASSETCACHE_H
+#define COMMON_ASSETCACHE_H
+
+/**
+ * @file assetcache.h
+ * @brief On-disk cache of converted assets, shared by the asset tools
+ *
+ * The cache maps a key (computed from the contents of the input files, the
+ * tool that runs the conversion, its version, and all the conversion flags) to
+ * the output file produced by the conversion. On a cache hit, the tool can
+ * simply copy the cached output instead of running the conversion and the
+ * compression again.
+ *
+ * Each entry is a plain file in the cache directory, named after the key.
+ * Entries are written atomically (temporary file + rename) so the same cache
+ * can be shared by multiple tools running in parallel. When the total size of
+ * the cache exceeds the configured limit, the least recently used entries
+ * are evicted.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/** @brief Default maximum size of the cache (in bytes) */
+#define ASSETCACHE_DEFAULT_MAX_SIZE     (1024ull*1024*1024)
+
+/**
+ * @brief Version of the cache format
+ *
+ * This is part of every key. Bump it when the way keys are computed or
+ * entries are stored changes, to invalidate all existing entries.
+ */
+#define ASSETCACHE_VERSION              "1"
+
+/** @brief An asset cache */
+typedef struct {
+    char *dir;                  ///< Cache directory (NULL if the cache is disabled)
+    uint64_t max_size;          ///< Maximum size of the cache in bytes (0 = unlimited)
+    int hits;                   ///< Number of cache hits
+    int misses;                 ///< Number of cache misses
+    int stores;                 ///< Number of entries added to the cache
+    int evictions;              ///< Number of entries evicted from the cache
+    uint64_t evicted_bytes;     ///< Total size of evicted entries
+} assetcache_t;
+
+/** @brief A cache key being computed */
+typedef struct {
+    uint64_t data_hash;         ///< Hash of the input data
+    uint64_t parms_hash;        ///< Hash of the tool and conversion parameters
+} assetcache_key_t;
+
+/** @brief Enable the cache, using the specified directory (created if missing) */
+bool assetcache_init(assetcache_t *cache, const char *dir, uint64_t max_size);
+
+/**
+ * @brief Begin computing a key for a conversion run by the specified tool
+ *
+ * @p version identifies the output of the tool: it must be bumped whenever
+ * a change to the tool (or to the libraries it uses, like the compressors)
+ * changes the output for the same input and flags, so that stale entries
+ * are never reused.
+ */
+void assetcache_key_init(assetcache_key_t *key, const char *tool, const char *version);
+
+/** @brief Add a conversion parameter to the key */
+void assetcache_key_add_parm(assetcache_key_t *key, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/** @brief Add the contents of an input file to the key */
+bool assetcache_key_add_file(assetcache_key_t *key, const char *fn);
+
+/**
+ * @brief Look up a key in the cache, and copy the cached output to outfn on hit
+ *
+ * @return true     Cache hit: outfn has been written
+ * @return false    Cache miss: the caller should run the conversion and then
+ *                  call #assetcache_store
+ */
+bool assetcache_fetch(assetcache_t *cache, const assetcache_key_t *key, const char *outfn);
+
+/** @brief Store the output file of a conversion into the cache */
+void assetcache_store(assetcache_t *cache, const assetcache_key_t *key, const char *outfn);
+
+/**
+ * @brief Evict the least recently used entries until the cache is within its size limit
+ *
+ * This is done automatically by #assetcache_close if any entry was stored.
+ * A tool that delegates the conversions to child processes should run the
+ * children with an unlimited cache, and call this once after they exit.
+ */
+void assetcache_evict(assetcache_t *cache);
+
+/** @brief Evict entries (if the size limit was exceeded) and release the cache */
+void assetcache_close(assetcache_t *cache);
+
+/** @brief Print cache statistics */
+void assetcache_print_stats(assetcache_t *cache, FILE *out);
+
+#endif
@@ -85,6 +85,71 @@ void asset_compress_mem(int compression, const uint8_t *data, int sz, uint8_t **
     }  
 }
 
+/**
+ * @brief Write a chunked compressed asset (made of independent blocks)
+ * 
+ * Each block of @p chunk_size bytes is compressed on its own, so that
+ * asset_fopen() can seek anywhere in the file by restarting decompression
+ * at the beginning of the block that contains the requested offset.
+ */
+static bool asset_compress_chunked(const uint8_t *data, int sz, const char *outfn, int compression, int winsize, int chunk_size)
+{
+    if (compression != 1 && compression != 2) {
+        fprintf(stderr, "chunked mode is only supported by compression levels 1 and 2\n");
+        return false;
+    }
+
+    // Matches never cross block boundaries, so there is no point in using a
+    // window bigger than the block itself.
+    if (winsize == 0)
+        winsize = compression == 1 ? 8*1024 : 256*1024;
+    while (chunk_size < winsize && winsize > 2*1024)
+        winsize /= 2;
+
+    int num_blocks = (sz + chunk_size - 1) / chunk_size;
+    uint8_t **blocks = calloc(num_blocks, sizeof(uint8_t*));
+    int *block_sizes = calloc(num_blocks, sizeof(int));
+    int cmp_size = 8 + (num_blocks+1) * 4;
+    for (int i=0; i<num_blocks; i++) {
+        int len = sz - i*chunk_size < chunk_size ? sz - i*chunk_size : chunk_size;
+        int margin;
+        asset_compress_mem(compression, data + i*chunk_size, len, &blocks[i], &block_sizes[i], &winsize, &margin);
+        cmp_size += block_sizes[i];
+    }
+
+    FILE *out = fopen(outfn, "wb");
+    if (!out) {
+        fprintf(stderr, "error opening output file: %s\n", outfn);
+        for (int i=0; i<num_blocks; i++)
+            free(blocks[i]);
+        free(blocks);
+        free(block_sizes);
+        return false;
+    }
+    fwrite("DCA4", 1, 4, out);
+    w16(out, compression); // algo
+    w16(out, asset_winsize_to_flags(winsize) | ASSET_FLAG_CHUNKED); // flags
+    w32(out, cmp_size); // cmp_size
+    w32(out, sz); // dec_size
+    w32(out, 0); // inplace margin (unused)
+    w32(out, chunk_size); // block size
+    w32(out, num_blocks); // number of blocks
+    uint32_t offset = 20 + 8 + (num_blocks+1) * 4;
+    for (int i=0; i<num_blocks; i++) {
+        w32(out, offset);
+        offset += block_sizes[i];
+    }
+    w32(out, offset); // end of the last block
+    for (int i=0; i<num_blocks; i++) {
+        fwrite(blocks[i], 1, block_sizes[i], out);
+        free(blocks[i]);
+    }
+    fclose(out);
+    free(blocks);
+    free(block_sizes);
+    return true;
+}
+
 /**
  * @brief Compress or recompress a file in the libdragon asset format.
  * 
@@ -95,10 +160,13 @@ void asset_compress_mem(int compression, const uint8_t *data, int sz, uint8_t **
  *                      for optimal compression ratio/dec-speed. If not zero, the specified
  *                      window size will be used for compression. This can be useful
  *                      to decrease the amount of RAM used by the decompressor.
+ * @param chunk_size    If not zero, the file is split into blocks of this size
+ *                      which are compressed independently, so that it can be
+ *                      freely seeked by asset_fopen().
  * @return true         File was compressed correctly
  * @return false        Error compressing the file
  */
-bool asset_compress(const char *infn, const char *outfn, int compression, int winsize)
+bool asset_compress(const char *infn, const char *outfn, int compression, int winsize, int chunk_size)
 {
     asset_init_compression(2);
     asset_init_compression(3);
@@ -132,13 +200,20 @@ bool asset_compress(const char *infn, const char *outfn, int compression, int wi
             winsize /= 2;
     }
 
+    if (compression != 0 && chunk_size) {
+        bool ok = asset_compress_chunked(data, sz, outfn, compression, winsize, chunk_size);
+        free(data);
+        return ok;
+    }
+
     // FIXME: use asset_compress_mem() instead of duplicating the code here
     switch (compression) {
     case 0: { // none
         FILE *out = fopen(outfn, "wb");
         if (!out) {
             fprintf(stderr, "error opening output file: %s\n", outfn);
-            return 1;
+            free(data);
+            return false;
         }
         fwrite(data, 1, sz, out);
         fclose(out);
@@ -234,5 +309,6 @@ bool asset_compress(const char *infn, const char *outfn, int compression, int wi
         assert(0);
     }
 
+    free(data);
     return true;
 }
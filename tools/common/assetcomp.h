@@ -11,7 +11,7 @@
 extern "C" {
 #endif
 
-bool asset_compress(const char *infn, const char *outfn, int compression, int winsize);
+bool asset_compress(const char *infn, const char *outfn, int compression, int winsize, int chunk_size);
 void asset_compress_mem(int compression, const uint8_t *inbuf, int size, uint8_t **outbuf, int *cmp_size, int *winsize, int *margin);
 
 #ifdef __cplusplus
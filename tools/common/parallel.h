@@ -0,0 +1,170 @@
+#ifndef LIBDRAGON_TOOLS_PARALLEL_H
+#define LIBDRAGON_TOOLS_PARALLEL_H
+
+/**
+ * @file parallel.h
+ * @brief Run a batch of tool invocations on a pool of worker processes
+ *
+ * Asset tools are often invoked on many files at once. This helper spreads
+ * the work across multiple cores: each job is a full command line (normally
+ * the tool itself, invoked on a single input file) and is run as a child
+ * process, so that jobs never share any global state of the tool.
+ *
+ * The output of each job (stdout and stderr, combined) is captured and
+ * flushed in submission order, so logs stay grouped per file and are
+ * identical across runs irrespective of the scheduling.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "subprocess.h"
+
+/** @brief A job to be run by #parallel_run */
+typedef struct {
+    const char *name;           ///< Name of the job (eg: input file), used for error reporting
+    const char **argv;          ///< Command line to execute (NULL-terminated)
+    char *output;               ///< Captured output of the job (stdout+stderr)
+    size_t output_size;         ///< Size of the captured output in bytes
+    int retcode;                ///< Exit code of the job (-1 if it could not be started)
+    bool done;                  ///< True once the job has completed
+} parallel_job_t;
+
+typedef struct {
+    parallel_job_t *jobs;       // Array of jobs
+    int njobs;                  // Number of jobs
+    int next;                   // Index of the next job to start
+    pthread_mutex_t lock;       // Protects next and jobs[].done
+    pthread_cond_t cond;        // Signaled whenever a job completes
+} parallel_pool_t;
+
+/** @brief Return the number of CPUs available on the host */
+static inline int parallel_num_cpus(void)
+{
+#ifdef _WIN32
+    const char *env = getenv("NUMBER_OF_PROCESSORS");
+    int ncpu = env ? atoi(env) : 1;
+#else
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return ncpu > 0 ? ncpu : 1;
+}
+
+static inline void parallel_exec(parallel_pool_t *pool, parallel_job_t *job)
+{
+    struct subprocess_s proc;
+    const int options = subprocess_option_combined_stdout_stderr |
+                        subprocess_option_inherit_environment |
+                        subprocess_option_search_user_path |
+                        subprocess_option_no_window;
+
+    // Spawn while holding the lock. subprocess.h does not create its pipes
+    // with O_CLOEXEC, so a child spawned concurrently could inherit the write
+    // end of the output pipe of another job, delaying its EOF.
+    pthread_mutex_lock(&pool->lock);
+    int err = subprocess_create(job->argv, options, &proc);
+    pthread_mutex_unlock(&pool->lock);
+    if (err) {
+        const char *fmt = "ERROR: cannot run: %s\n";
+        job->output_size = snprintf(NULL, 0, fmt, job->argv[0]);
+        job->output = malloc(job->output_size + 1);
+        snprintf(job->output, job->output_size + 1, fmt, job->argv[0]);
+        job->retcode = -1;
+        return;
+    }
+
+    // Read the whole output until the child closes it, then reap it.
+    size_t cap = 0;
+    char buf[4096]; size_t n;
+    FILE *out = subprocess_stdout(&proc);
+    while ((n = fread(buf, 1, sizeof(buf), out)) > 0) {
+        if (job->output_size + n > cap) {
+            cap = (job->output_size + n) * 2;
+            job->output = realloc(job->output, cap);
+        }
+        memcpy(job->output + job->output_size, buf, n);
+        job->output_size += n;
+    }
+    if (subprocess_join(&proc, &job->retcode) != 0)
+        job->retcode = -1;
+    subprocess_destroy(&proc);
+}
+
+static inline void* parallel_worker(void *arg)
+{
+    parallel_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->njobs) {
+        parallel_job_t *job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+        parallel_exec(pool, job);
+        pthread_mutex_lock(&pool->lock);
+        job->done = true;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * @brief Run a batch of jobs using a pool of worker processes
+ *
+ * Jobs are started in order, keeping at most @p nworkers of them running
+ * at the same time. The output of each job is written to @p log as soon as
+ * that job and all the jobs before it have completed, so the final log is
+ * the same that a sequential run would produce. For each failed job, an
+ * error line is appended after its output.
+ *
+ * @param jobs          Array of jobs to run
+ * @param njobs         Number of jobs
+ * @param nworkers      Maximum number of concurrent jobs (0 = one per CPU)
+ * @param log           Stream where to write the output of the jobs
+ * @return int          Number of jobs that failed
+ */
+static inline int parallel_run(parallel_job_t *jobs, int njobs, int nworkers, FILE *log)
+{
+    if (nworkers <= 0) nworkers = parallel_num_cpus();
+    if (nworkers > njobs) nworkers = njobs;
+
+    parallel_pool_t pool = { .jobs = jobs, .njobs = njobs };
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pthread_t *threads = calloc(nworkers, sizeof(pthread_t));
+    for (int i=0; i<nworkers; i++)
+        pthread_create(&threads[i], NULL, parallel_worker, &pool);
+
+    int failed = 0;
+    for (int i=0; i<njobs; i++) {
+        parallel_job_t *job = &jobs[i];
+        pthread_mutex_lock(&pool.lock);
+        while (!job->done)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (job->output_size)
+            fwrite(job->output, 1, job->output_size, log);
+        if (job->retcode != 0) {
+            fprintf(log, "ERROR: %s: failed (exit code %d)\n", job->name, job->retcode);
+            failed++;
+        }
+        fflush(log);
+        free(job->output);
+        job->output = NULL;
+    }
+
+    for (int i=0; i<nworkers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    return failed;
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 #include "dragonfs.h"
 #include "dfsinternal.h"
@@ -20,6 +21,10 @@ struct directory_entry root_dirent = {
     .path = ROOT_PATH,
 };
 
+/* Size of the root sector used to search for it. file_pointer is excluded
+   as it points to the path index, if present. */
+#define ROOT_DIRENT_MATCH   offsetof(struct directory_entry, file_pointer)
+
 /* Directory walking flags */
 enum
 {
@@ -778,7 +783,7 @@ int main( int argc, char *argv[] )
             int offset = 0;
             if (strstr(argv[2], ".z64"))
             {
-                void *fs = memmem(filesystem, lSize, &root_dirent, sizeof(root_dirent));
+                void *fs = memmem(filesystem, lSize, &root_dirent, ROOT_DIRENT_MATCH);
                 if (!fs)
                 {
                     fprintf(stderr, "cannot find DragonFS in ROM\n");
@@ -821,7 +826,7 @@ int main( int argc, char *argv[] )
             int offset = 0;
             if (strstr(argv[2], ".z64"))
             {
-                void *fs = memmem(filesystem, lSize, &root_dirent, sizeof(root_dirent));
+                void *fs = memmem(filesystem, lSize, &root_dirent, ROOT_DIRENT_MATCH);
                 if (!fs)
                 {
                     fprintf(stderr, "cannot find DragonFS in ROM\n");
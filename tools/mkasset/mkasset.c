@@ -5,10 +5,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include "../common/binout.c"
+#include "../common/assetcache.c"
 #include "../common/assetcomp.h"
 
 #include "../../src/asset_internal.h"
 
+/** @brief Version of the mkasset output, for the asset cache (bump when the output changes) */
+#define MKASSET_CACHE_VERSION   "1"
+
 bool flag_verbose = false;
 
 void print_args(char * name)
@@ -24,9 +28,14 @@ void print_args(char * name)
     fprintf(stderr, "   -o/--output <dir>       Specify output directory (default: .)\n");
     fprintf(stderr, "   -c/--compress <algo>    Compression level 0-%d (default: %d)\n", MAX_COMPRESSION, DEFAULT_COMPRESSION);
     fprintf(stderr, "   -w/--winsize <window>   Maximum size of the matching window in KiB. (default: %d)\n", DEFAULT_WINSIZE_STREAMING/1024);
+    fprintf(stderr, "   --chunk <size>          Compress in independent blocks of the given size in KiB, to allow seeking (default: off)\n");
+    fprintf(stderr, "   --cache-dir <dir>       Reuse previous compressions stored in the specified cache directory\n");
+    fprintf(stderr, "   --cache-size <MiB>      Maximum size of the cache directory (0 = unlimited, default: %d)\n", (int)(ASSETCACHE_DEFAULT_MAX_SIZE / (1024*1024)));
     fprintf(stderr, "\nSupported window sizes: 2, 4, 8, 16, 32, 64, 128, 256\n");
     fprintf(stderr, "The window size affects the memory used by asset_fopen() only.\n");
     fprintf(stderr, "If you only use asset_load(), use the biggest window (256 KiB) to improve ratio.\n");
+    fprintf(stderr, "\nChunked files (--chunk) can be freely seeked with asset_fopen(), at the cost\n");
+    fprintf(stderr, "of a lower compression ratio. Only compression levels 1 and 2 support them.\n");
     fprintf(stderr, "\n");
 }
 
@@ -35,12 +44,31 @@ int main(int argc, char *argv[])
     char *infn = NULL, *outdir = ".", *outfn = NULL;
     int compression = DEFAULT_COMPRESSION;
     int winsize = DEFAULT_WINSIZE_STREAMING;
+    int chunk_size = 0;
+    char *cache_dir = NULL; int cache_size = ASSETCACHE_DEFAULT_MAX_SIZE / (1024*1024);
+    assetcache_t cache = {0};
+    bool error = false;
 
     if (argc < 2) {
         print_args(argv[0]);
         return 1;
     }
 
+    // Look for the cache options first, so that they apply to all files
+    for (int i = 1; i < argc-1; i++) {
+        if (!strcmp(argv[i], "--cache-dir"))
+            cache_dir = argv[i+1];
+        if (!strcmp(argv[i], "--cache-size")) {
+            char extra;
+            if (sscanf(argv[i+1], "%d%c", &cache_size, &extra) != 1 || cache_size < 0) {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i], argv[i+1]);
+                return 1;
+            }
+        }
+    }
+    if (cache_dir && !assetcache_init(&cache, cache_dir, (uint64_t)cache_size * 1024 * 1024))
+        return 1;
+
     for (int i = 1; i < argc; i++) {
         if (argv[i][0] == '-') {
             if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
@@ -64,6 +92,17 @@ int main(int argc, char *argv[])
                     fprintf(stderr, "supported window sizes: 2, 4, 8, 16, 32, 64, 128, 256\n");
                     return 1;
                 }    
+            } else if (!strcmp(argv[i], "--chunk")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char extra;
+                if (sscanf(argv[i], "%d%c", &chunk_size, &extra) != 1 || chunk_size <= 0) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+                chunk_size = chunk_size * 1024;
             } else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
                 if (++i == argc) {
                     fprintf(stderr, "missing argument for %s\n", argv[i-1]);
@@ -84,6 +123,12 @@ int main(int argc, char *argv[])
                     fprintf(stderr, "invalid compression algorithm: %d\n", compression);
                     return 1;
                 }
+            } else if (!strcmp(argv[i], "--cache-dir") || !strcmp(argv[i], "--cache-size")) {
+                // Already parsed above
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
             } else {
                 fprintf(stderr, "invalid flag: %s\n", argv[i]);
                 return 1;
@@ -100,8 +145,30 @@ int main(int argc, char *argv[])
         if (flag_verbose)
             printf("Compressing: %s => %s [algo=%d]\n", infn, outfn, compression);
 
-        asset_compress(infn, outfn, compression, winsize);
+        assetcache_key_t key;
+        bool use_cache = cache.dir != NULL;
+        if (use_cache) {
+            assetcache_key_init(&key, "mkasset", MKASSET_CACHE_VERSION);
+            assetcache_key_add_parm(&key, "compress=%d winsize=%d chunk=%d", compression, winsize, chunk_size);
+            use_cache = assetcache_key_add_file(&key, infn);
+        }
+
+        if (use_cache && assetcache_fetch(&cache, &key, outfn)) {
+            if (flag_verbose)
+                printf("cache hit: %s => %s\n", infn, outfn);
+        } else if (!asset_compress(infn, outfn, compression, winsize, chunk_size)) {
+            error = true;
+        } else if (use_cache) {
+            assetcache_store(&cache, &key, outfn);
+        }
 
         free(outfn);
     }
+
+    if (cache.dir) {
+        assetcache_close(&cache);
+        if (flag_verbose)
+            assetcache_print_stats(&cache, stdout);
+    }
+    return error ? 1 : 0;
 }
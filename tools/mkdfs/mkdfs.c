@@ -1,14 +1,21 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/param.h>
 #include "dragonfs.h"
 #include "dfsinternal.h"
+#include "../common/polyfill.h"
+#include "../common/binout.c"
+#include "../common/assetcomp.h"
 
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #define SWAPLONG(i) (i)
@@ -16,114 +23,1106 @@
 #define SWAPLONG(i) (((uint32_t)((i) & 0xFF000000) >> 24) | ((uint32_t)((i) & 0x00FF0000) >>  8) | ((uint32_t)((i) & 0x0000FF00) <<  8) | ((uint32_t)((i) & 0x000000FF) << 24))
 #endif
 
+/* copy_file_range() lets the kernel copy file payloads without going through user space */
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+
+/*
+ * The image is built in two phases. First, the directory tree is walked and
+ * all the metadata (root sector, directory entries, path index) is laid out
+ * at the start of the image, in memory. Then, the files are assigned their
+ * offsets after the metadata, and their payloads are streamed straight from
+ * the source files to the output. This way, memory usage is proportional to
+ * the number of files rather than to the total size of the filesystem.
+ */
+
+/* Metadata of the filesystem (kept in memory) */
 uint8_t *dfs = NULL;
 uint32_t fs_size = 0;
+uint32_t dfs_capacity = 0;
+
+/* Alignment of the metadata area and of the path index */
+#define META_ALIGN          16
+/* Default alignment of files (can be changed with --align) */
+#define DEFAULT_FILE_ALIGN  SECTOR_SIZE
+
+/* Alignment rule for files matching a glob pattern */
+typedef struct
+{
+    const char *pattern;
+    uint32_t align;
+    uint32_t num_files;
+    uint32_t padding;
+} align_rule_t;
+
+#define MAX_ALIGN_RULES     64
+
+align_rule_t align_rules[MAX_ALIGN_RULES];
+int num_align_rules = 0;
+align_rule_t default_rule = { "(default)", DEFAULT_FILE_ALIGN, 0, 0 };
+uint32_t meta_padding = 0;
+
+/* Compression rule for files matching a glob pattern */
+typedef struct
+{
+    const char *pattern;
+    int level;
+} compress_rule_t;
+
+#define MAX_COMPRESS_RULES  64
+
+compress_rule_t compress_rules[MAX_COMPRESS_RULES];
+int num_compress_rules = 0;
+
+/* Compression statistics */
+uint32_t compressed_files_count = 0;
+uint64_t compressed_orig_bytes = 0;
+uint64_t compressed_bytes = 0;
+
+/* Files added to the filesystem. The position in this array is the file ID. */
+typedef struct
+{
+    char *src;              /* Path of the source file */
+    char *path;             /* Full path within the filesystem */
+    uint32_t size;          /* Size of the file in bytes */
+    uint32_t dirent;        /* Offset of the directory entry */
+    uint32_t file_pointer;  /* Offset of the payload (assigned by layout_files) */
+    uint64_t hash;          /* Hash of the full path (see dfs_hash_update) */
+    align_rule_t *rule;     /* Alignment rule */
+    uint32_t align;         /* Alignment of the payload */
+    int32_t dup_of;         /* ID of the file with identical contents, or -1 */
+    int compressed;         /* True if src is a temporary file with the compressed contents */
+} file_entry_t;
+
+file_entry_t *files = NULL;
+uint32_t num_files = 0;
+
+/* Path index: files sorted by bucket and hash */
+uint32_t *index_sorted = NULL;
+uint32_t index_buckets = 0;
+
+/* Total size of the image (metadata and payloads) */
+uint32_t image_size = 0;
+/* Padding at the end of the image */
+uint32_t tail_padding = 0;
+
+/* Order of the files in the image (by default, file ID order) */
+uint32_t *layout_order = NULL;
+
+/* Reads recorded in the access trace (see --order-from-trace) */
+typedef struct
+{
+    uint32_t id;            /* ID of the file */
+    uint32_t offset;        /* Offset within the file */
+    uint32_t len;           /* Length of the read */
+} trace_read_t;
+
+trace_read_t *trace_reads = NULL;
+uint32_t num_trace_reads = 0;
+
+/* Deduplication statistics */
+uint32_t dedup_files_count = 0;
+uint32_t dedup_bytes = 0;
+
+inline void *sector_to_memory(uint32_t offset)
+{
+    return (void *)(dfs + offset);
+}
+
+uint32_t dfs_alloc(int size, int align, uint32_t *padding)
+{
+    uint32_t start = (fs_size + align - 1) / align * align;
+
+    if(start + size > dfs_capacity)
+    {
+        /* Grow geometrically to avoid reallocating for each sector */
+        dfs_capacity = MAX(start + size, dfs_capacity * 2);
+        dfs = realloc(dfs, dfs_capacity);
+    }
+
+    /* Zero out padding and new bytes */
+    memset(dfs + fs_size, 0, start + size - fs_size);
+
+    if(padding)
+    {
+        *padding += start - fs_size;
+    }
+
+    fs_size = start + size;
+    return start;
+}
+
+/* Add a new sector to the filesystem, return that sector pointer */
+uint32_t new_sector(void)
+{
+    return dfs_alloc(SECTOR_SIZE, META_ALIGN, &meta_padding);
+}
+
+uint32_t new_blob(int size)
+{
+    return dfs_alloc(size, META_ALIGN, &meta_padding);
+}
+
+/* Match a path against a glob pattern supporting '*' and '?' */
+int glob_match(const char *pattern, const char *str)
+{
+    while(*pattern)
+    {
+        if(*pattern == '*')
+        {
+            /* Try to match the rest of the pattern at every position */
+            for(const char *s = str; ; s++)
+            {
+                if(glob_match(pattern + 1, s))
+                {
+                    return 1;
+                }
+                if(!*s)
+                {
+                    return 0;
+                }
+            }
+        }
+
+        if(!*str || (*pattern != '?' && *pattern != *str))
+        {
+            return 0;
+        }
+
+        pattern++;
+        str++;
+    }
+
+    return !*str;
+}
+
+/* Match a file against a rule pattern. Patterns containing a slash are matched
+   against the full path, the others against the file name only. */
+int rule_match(const char * const pattern, const char * const dfs_path)
+{
+    const char *name = strrchr(dfs_path, '/');
+    name = name ? name + 1 : dfs_path;
+
+    return glob_match(pattern, strchr(pattern, '/') ? dfs_path : name);
+}
+
+/* Find the alignment rule for a file */
+align_rule_t *find_align_rule(const char * const dfs_path)
+{
+    for(int i = 0; i < num_align_rules; i++)
+    {
+        if(rule_match(align_rules[i].pattern, dfs_path))
+        {
+            return &align_rules[i];
+        }
+    }
+
+    return &default_rule;
+}
+
+/* Find the compression level for a file (0 if it must not be compressed) */
+int find_compress_level(const char * const dfs_path)
+{
+    for(int i = 0; i < num_compress_rules; i++)
+    {
+        if(rule_match(compress_rules[i].pattern, dfs_path))
+        {
+            return compress_rules[i].level;
+        }
+    }
+
+    return 0;
+}
+
+/* Parse an alignment value, return 0 if invalid */
+uint32_t parse_align(const char *str)
+{
+    char extra;
+    int align;
+
+    /* Files must be at least 2-byte aligned, to allow for direct DMA */
+    if(sscanf(str, "%d%c", &align, &extra) != 1 || align < 2 || align > 1024*1024 || (align & (align - 1)))
+    {
+        return 0;
+    }
+
+    return align;
+}
+
+/* Write a C header with the IDs of all files, return 0 on failure */
+int write_header(const char * const header_fn)
+{
+    FILE *fp = fopen(header_fn, "w");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Error opening '%s' for writing.\n", header_fn);
+        return 0;
+    }
+
+    /* Build the include guard from the file name */
+    const char *basename = strrchr(header_fn, '/');
+    basename = basename ? basename + 1 : header_fn;
+
+    char *guard = strdup(basename);
+    for(char *c = guard; *c; c++)
+    {
+        *c = isalnum((unsigned char)*c) ? toupper((unsigned char)*c) : '_';
+    }
+
+    fprintf(fp, "/* Generated by mkdfs, do not edit. */\n");
+    fprintf(fp, "/* File IDs for dfs_open_by_index() and dfs_rom_addr_by_index(). They are only\n");
+    fprintf(fp, "   valid for the filesystem image generated together with this header. */\n");
+    fprintf(fp, "#ifndef __DFS_IDS_%s\n", guard);
+    fprintf(fp, "#define __DFS_IDS_%s\n\n", guard);
+
+    char **idents = calloc(num_files, sizeof(char *));
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        /* Turn the path into a valid C identifier, eg: "sprites/hero.sprite"
+           becomes DFSID_SPRITES_HERO_SPRITE */
+        char *ident = malloc(strlen(files[i].path) + 32);
+        sprintf(ident, "DFSID_%s", files[i].path);
+        for(char *c = ident; *c; c++)
+        {
+            *c = isalnum((unsigned char)*c) ? toupper((unsigned char)*c) : '_';
+        }
+
+        /* Different paths could map to the same identifier (eg: "a-b" and "a_b") */
+        for(uint32_t j = 0; j < i; j++)
+        {
+            if(!strcmp(idents[j], ident))
+            {
+                sprintf(ident + strlen(ident), "_%u", i);
+                break;
+            }
+        }
+
+        idents[i] = ident;
+        fprintf(fp, "#define %-40s %5u   // %s\n", ident, i, files[i].path);
+    }
+
+    fprintf(fp, "\n#define DFSID_NUM_FILES %u\n", num_files);
+    fprintf(fp, "\n#endif\n");
+    fclose(fp);
+
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        free(idents[i]);
+    }
+    free(idents);
+    free(guard);
+    return 1;
+}
+
+void kill_fs()
+{
+    if(dfs)
+    {
+        free(dfs);
+    }
+
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        if(files[i].compressed)
+        {
+            remove(files[i].src);
+        }
+        free(files[i].src);
+        free(files[i].path);
+    }
+    free(files);
+    free(index_sorted);
+    free(layout_order);
+    free(trace_reads);
+}
+
+void print_help(const char * const prog_name)
+{
+    fprintf(stderr, "Usage: %s [flags] <File> <Directory>\n", prog_name);
+    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
+    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Command-line flags:\n");
+    fprintf(stderr, "   -v, --verbose     Print a summary of the layout of the image\n");
+    fprintf(stderr, "   --no-index        Do not add the hashed path index (slower file lookups at runtime)\n");
+    fprintf(stderr, "   --header <file>   Write a C header with the ID of each file, for dfs_open_by_index()\n");
+    fprintf(stderr, "   --no-dedup        Store a separate copy of files with identical contents\n");
+    fprintf(stderr, "   --order-from-trace <file>\n");
+    fprintf(stderr, "                     Lay out files in the order they are first accessed in the given\n");
+    fprintf(stderr, "                     debug log, recorded at runtime with dfs_trace_enable()\n");
+    fprintf(stderr, "   --align <n>       Default alignment of files in bytes (power of two, default: %d)\n", DEFAULT_FILE_ALIGN);
+    fprintf(stderr, "   --align-rule <glob>=<n>\n");
+    fprintf(stderr, "                     Alignment of the files matching the pattern (eg: \"*.wav64=64\").\n");
+    fprintf(stderr, "                     Patterns with a slash match the full path ('*' also matches\n");
+    fprintf(stderr, "                     slashes), others match the file name only.\n");
+    fprintf(stderr, "                     Can be repeated, the first matching rule applies.\n");
+    fprintf(stderr, "   --compress <glob>=<level>\n");
+    fprintf(stderr, "                     Compress the files matching the pattern (same syntax as --align-rule)\n");
+    fprintf(stderr, "                     with the given level (1: LZ4, 2: aPLib). Files opened with fopen()\n");
+    fprintf(stderr, "                     are transparently decompressed at runtime.\n");
+}
+
+void print_layout_summary(void)
+{
+    uint32_t total_padding = meta_padding + tail_padding;
+
+    printf("\nLayout summary:\n");
+    printf("  %-24s %6s %7s %10s\n", "rule", "align", "files", "padding");
+    for(int i = 0; i <= num_align_rules; i++)
+    {
+        align_rule_t *rule = i < num_align_rules ? &align_rules[i] : &default_rule;
+
+        printf("  %-24s %6u %7u %10u\n", rule->pattern, rule->align, rule->num_files, rule->padding);
+        total_padding += rule->padding;
+    }
+    printf("  %-24s %6u %7s %10u\n", "(metadata)", META_ALIGN, "", meta_padding + tail_padding);
+    printf("  Metadata: %u bytes\n", fs_size);
+    if(compressed_files_count)
+    {
+        printf("  Compressed: %u files, %llu bytes saved (%llu -> %llu bytes)\n", compressed_files_count,
+            (unsigned long long)(compressed_orig_bytes - compressed_bytes),
+            (unsigned long long)compressed_orig_bytes, (unsigned long long)compressed_bytes);
+    }
+    if(dedup_files_count)
+    {
+        printf("  Deduplicated: %u files, %u bytes saved\n", dedup_files_count, dedup_bytes);
+    }
+    printf("  Total padding: %u bytes (%.1f%% of %u bytes)\n", total_padding,
+        image_size ? total_padding * 100.0 / image_size : 0.0, image_size);
+}
+
+/* Record a new file, return its entry */
+file_entry_t *file_add(const char * const src, const char * const dfs_path, uint32_t size, uint32_t dirent)
+{
+    if((num_files & (num_files - 1)) == 0)
+    {
+        /* Grow the array at every power of two */
+        files = realloc(files, (num_files ? num_files * 2 : 16) * sizeof(file_entry_t));
+    }
+
+    file_entry_t *f = &files[num_files++];
+    f->src = strdup(src);
+    f->path = strdup(dfs_path);
+    f->size = size;
+    f->dirent = dirent;
+    f->file_pointer = 0;
+    f->hash = dfs_hash_update(DFS_HASH_INIT, dfs_path, strlen(dfs_path));
+    f->rule = find_align_rule(dfs_path);
+    f->align = f->rule->align;
+    f->dup_of = -1;
+    f->compressed = 0;
+    return f;
+}
+
+/* Size and flags of a file, as stored in the directory entry and in the index */
+uint32_t file_flags(const file_entry_t * const f)
+{
+    uint32_t type = f->compressed ? FLAGS_FILE | FLAGS_COMPRESSED : FLAGS_FILE;
+    return (type << 28) | (f->size & 0x0FFFFFFF);
+}
+
+int index_cmp(const void *a, const void *b)
+{
+    const file_entry_t *ea = &files[*(const uint32_t *)a], *eb = &files[*(const uint32_t *)b];
+    uint32_t ba = ea->hash & (index_buckets - 1);
+    uint32_t bb = eb->hash & (index_buckets - 1);
+
+    if(ba != bb) return ba < bb ? -1 : 1;
+    if(ea->hash != eb->hash) return ea->hash < eb->hash ? -1 : 1;
+    return 0;
+}
+
+/* Reserve space for the path index in the metadata, return its offset or 0 on failure */
+uint32_t add_index(void)
+{
+    /* Aim at about 4 entries per bucket: a lookup then needs to fetch just
+     * a few entries, while the bucket table (which is kept in RAM at runtime)
+     * stays at about one byte per file. */
+    index_buckets = 1;
+    while(index_buckets * 4 < num_files)
+    {
+        index_buckets <<= 1;
+    }
+
+    index_sorted = malloc(num_files * sizeof(uint32_t));
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        index_sorted[i] = i;
+    }
+
+    qsort(index_sorted, num_files, sizeof(uint32_t), index_cmp);
+
+    for(uint32_t i = 1; i < num_files; i++)
+    {
+        if(files[index_sorted[i]].hash == files[index_sorted[i-1]].hash)
+        {
+            fprintf(stderr, "Hash collision in path index between '%s' and '%s': please rename one of them\n",
+                files[index_sorted[i-1]].path, files[index_sorted[i]].path);
+            return 0;
+        }
+    }
+
+    int size = sizeof(struct dfs_index_header) + (index_buckets + 1) * sizeof(uint32_t) +
+        num_files * sizeof(struct dfs_index_entry) + num_files * sizeof(struct dfs_file_entry);
+    return new_blob(size);
+}
+
+/* Fill the path index, once all files have been laid out */
+void write_index(uint32_t index)
+{
+    struct dfs_index_header *header = sector_to_memory(index);
+    header->magic = SWAPLONG(DFS_INDEX_MAGIC);
+    header->version = SWAPLONG(DFS_INDEX_VERSION);
+    header->num_entries = SWAPLONG(num_files);
+    header->num_buckets = SWAPLONG(index_buckets);
+
+    uint32_t *buckets = (uint32_t *)(header + 1);
+    struct dfs_index_entry *entries = (struct dfs_index_entry *)(buckets + index_buckets + 1);
+    struct dfs_file_entry *table = (struct dfs_file_entry *)(entries + num_files);
+
+    uint32_t cur = 0;
+    for(uint32_t b = 0; b <= index_buckets; b++)
+    {
+        while(cur < num_files && (files[index_sorted[cur]].hash & (index_buckets - 1)) < b)
+        {
+            cur++;
+        }
+        buckets[b] = SWAPLONG(cur);
+    }
+
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        file_entry_t *f = &files[index_sorted[i]];
+        uint32_t flags = file_flags(f);
+
+        entries[i].hash_hi = SWAPLONG((uint32_t)(f->hash >> 32));
+        entries[i].hash_lo = SWAPLONG((uint32_t)f->hash);
+        entries[i].flags = SWAPLONG(flags);
+        entries[i].file_pointer = SWAPLONG(f->file_pointer);
+    }
+
+    /* The file table is in ID order */
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        table[i].flags = SWAPLONG(file_flags(&files[i]));
+        table[i].file_pointer = SWAPLONG(files[i].file_pointer);
+    }
+}
+
+/* Return true if the file is a format that the runtime streams directly
+   from ROM via dfs_rom_addr(), so that it must never be compressed */
+int is_rom_streamed(const char * const path)
+{
+    static const char *exts[] = { ".wav64", ".xm64", ".ym64", ".m1v" };
+    const char *ext = strrchr(path, '.');
+
+    for(int i = 0; ext && i < sizeof(exts) / sizeof(exts[0]); i++)
+    {
+        if(!strcasecmp(ext, exts[i]))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Compress the files matching a compression rule. Each compressed file is
+   stored in a temporary file next to the output image, which replaces the
+   source of the file. Return 0 on failure. */
+int compress_files(const char * const outfn)
+{
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        file_entry_t *f = &files[i];
+        int level = find_compress_level(f->path);
+
+        if(!level || !f->size)
+        {
+            continue;
+        }
+
+        if(is_rom_streamed(f->path))
+        {
+            fprintf(stderr, "WARNING: not compressing '%s': this format is streamed directly from ROM.\n", f->path);
+            continue;
+        }
+
+        /* Files already in the asset format are left as they are: asset_load()
+           and asset_fopen() already decompress them */
+        char magic[3] = {0};
+        FILE *fp = fopen(f->src, "rb");
+        if(!fp)
+        {
+            fprintf(stderr, "Error opening '%s' for reading.\n", f->src);
+            return 0;
+        }
+        fread(magic, 1, sizeof(magic), fp);
+        fclose(fp);
+        if(!memcmp(magic, "DCA", 3))
+        {
+            printf("Not compressing '%s': already compressed.\n", f->src);
+            continue;
+        }
+
+        char *tmp = malloc(strlen(outfn) + 32);
+        sprintf(tmp, "%s.%u.tmp", outfn, i);
+
+        if(!asset_compress(f->src, tmp, level, DEFAULT_WINSIZE_STREAMING, 0))
+        {
+            fprintf(stderr, "Error compressing '%s'.\n", f->src);
+            remove(tmp);
+            free(tmp);
+            return 0;
+        }
+
+        struct stat st;
+        if(stat(tmp, &st) != 0 || st.st_size >= f->size)
+        {
+            /* Not worth it */
+            remove(tmp);
+            free(tmp);
+            continue;
+        }
+
+        compressed_files_count++;
+        compressed_orig_bytes += f->size;
+        compressed_bytes += st.st_size;
+
+        free(f->src);
+        f->src = tmp;
+        f->size = st.st_size;
+        f->compressed = 1;
+
+        directory_entry_t *dirent = sector_to_memory(f->dirent);
+        dirent->flags = SWAPLONG(file_flags(f));
+    }
+
+    return 1;
+}
+
+/* Hash the contents of a file, return 0 on failure */
+int hash_contents(const char * const src, uint64_t *hash)
+{
+    static char buf[64*1024];
+    FILE *fp = fopen(src, "rb");
+    int n;
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", src);
+        return 0;
+    }
+
+    *hash = DFS_HASH_INIT;
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        *hash = dfs_hash_update(*hash, buf, n);
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+/* Compare the contents of two files of the same size */
+int same_contents(const char * const src1, const char * const src2)
+{
+    static char buf1[64*1024], buf2[64*1024];
+    FILE *fp1 = fopen(src1, "rb");
+    FILE *fp2 = fopen(src2, "rb");
+    int same = fp1 && fp2;
+
+    while(same)
+    {
+        int n1 = fread(buf1, 1, sizeof(buf1), fp1);
+        int n2 = fread(buf2, 1, sizeof(buf2), fp2);
+
+        same = n1 == n2 && !memcmp(buf1, buf2, n1);
+        if(n1 <= 0)
+        {
+            break;
+        }
+    }
+
+    if(fp1) fclose(fp1);
+    if(fp2) fclose(fp2);
+    return same;
+}
+
+int size_cmp(const void *a, const void *b)
+{
+    uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+
+    if(files[ia].size != files[ib].size) return files[ia].size < files[ib].size ? -1 : 1;
+    return ia < ib ? -1 : 1;
+}
+
+/* Find files with identical contents, so that they can share the same payload.
+   Only files with the same size are hashed, and contents are always compared
+   byte by byte before deduplicating, so hash collisions are harmless. */
+int dedup_files(void)
+{
+    uint32_t *sorted = malloc(num_files * sizeof(uint32_t));
+    uint64_t *hashes = malloc(num_files * sizeof(uint64_t));
+    int ok = 1;
+
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        sorted[i] = i;
+    }
+
+    qsort(sorted, num_files, sizeof(uint32_t), size_cmp);
+
+    for(uint32_t start = 0, end; ok && start < num_files; start = end)
+    {
+        /* Find the run of files with the same size */
+        for(end = start + 1; end < num_files && files[sorted[end]].size == files[sorted[start]].size; end++) {}
+
+        if(end - start < 2)
+        {
+            continue;
+        }
+
+        for(uint32_t i = start; ok && i < end; i++)
+        {
+            ok = hash_contents(files[sorted[i]].src, &hashes[i]);
+        }
+
+        for(uint32_t i = start + 1; ok && i < end; i++)
+        {
+            file_entry_t *f = &files[sorted[i]];
+
+            for(uint32_t j = start; j < i; j++)
+            {
+                file_entry_t *orig = &files[sorted[j]];
+
+                if(orig->dup_of < 0 && hashes[i] == hashes[j] && same_contents(orig->src, f->src))
+                {
+                    /* The shared payload must satisfy the alignment of all its users */
+                    f->dup_of = sorted[j];
+                    orig->align = MAX(orig->align, f->align);
+                    dedup_files_count++;
+                    dedup_bytes += f->size;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(hashes);
+    free(sorted);
+    return ok;
+}
+
+/* Assign an offset to the payload of each file, after the metadata, following
+   the order in layout_order */
+void layout_files(void)
+{
+    uint32_t cur = fs_size;
+
+    /* Reset the statistics, as the layout can be computed more than once */
+    for(int i = 0; i <= num_align_rules; i++)
+    {
+        align_rule_t *rule = i < num_align_rules ? &align_rules[i] : &default_rule;
+        rule->num_files = 0;
+        rule->padding = 0;
+    }
+
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        file_entry_t *f = &files[layout_order[i]];
 
-/* Offset from start of filesystem */
-inline uint32_t sector_offset(void *sector)
-{
-    uint32_t x = (uint8_t *)sector - dfs;
+        f->rule->num_files++;
+        if(f->dup_of >= 0)
+        {
+            /* Shares the payload of another file */
+            continue;
+        }
+
+        uint32_t start = (cur + f->align - 1) / f->align * f->align;
+
+        f->rule->padding += start - cur;
+        f->file_pointer = start;
+        cur = start + f->size;
+    }
+
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        file_entry_t *f = &files[i];
+
+        if(f->dup_of >= 0)
+        {
+            f->file_pointer = files[f->dup_of].file_pointer;
+        }
 
-    return x;
+        directory_entry_t *dirent = sector_to_memory(f->dirent);
+        dirent->file_pointer = SWAPLONG(f->file_pointer);
+    }
+
+    /* Pad the end of the image to the metadata alignment */
+    image_size = (cur + META_ALIGN - 1) / META_ALIGN * META_ALIGN;
+    tail_padding = image_size - cur;
 }
 
-inline void *sector_to_memory(uint32_t offset)
+/* Resolve a path as done by the runtime directory walk, relative to the given
+   current directory (unless absolute), and normalize it as done by the path
+   index: no leading slash, no empty or "." components, ".." components
+   applied. The result must be freed by the caller. */
+char *resolve_path(const char *cwd, const char *path)
 {
-    return (void *)(dfs + offset);
+    char *norm = malloc(strlen(cwd) + strlen(path) + 2);
+    char *out = norm;
+
+    for(int pass = (path[0] == '/'); pass < 2; pass++)
+    {
+        const char *p = pass ? path : cwd;
+
+        while(*p)
+        {
+            int len = strcspn(p, "/");
+
+            if(len == 2 && p[0] == '.' && p[1] == '.')
+            {
+                /* Go up one level (staying at the root) */
+                while(out > norm && *--out != '/');
+            }
+            else if(len && !(len == 1 && p[0] == '.'))
+            {
+                if(out != norm)
+                {
+                    *out++ = '/';
+                }
+                memcpy(out, p, MIN(len, MAX_FILENAME_LEN));
+                out += MIN(len, MAX_FILENAME_LEN);
+            }
+
+            p += len;
+            if(*p == '/')
+            {
+                p++;
+            }
+        }
+    }
+    *out = 0;
+    return norm;
 }
 
-uint32_t dfs_alloc(int size)
+/* Find a file given its path as passed to dfs_open at runtime while in the
+   given current directory, return its ID or -1 */
+int find_file_by_path(const char *cwd, const char *path)
 {
-    void *end;
-    int rsize = (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    char *norm = resolve_path(cwd, path);
 
-    if(!dfs)
+    uint64_t hash = dfs_hash_update(DFS_HASH_INIT, norm, strlen(norm));
+    int id = -1;
+
+    for(uint32_t i = 0; i < num_files; i++)
     {
-        dfs = malloc(rsize);
-        fs_size = rsize;
+        if(files[i].hash == hash && !strcmp(files[i].path, norm))
+        {
+            id = i;
+            break;
+        }
+    }
+
+    free(norm);
+    return id;
+}
+
+/* Parse the access trace logged by the runtime (see dfs_trace_enable), and
+   lay out the files in the order in which they are first accessed. Files
+   not present in the trace are placed after, in file ID order. The new
+   layout order is stored in the given array. */
+int order_from_trace(const char * const trace_fn, uint32_t *order)
+{
+    FILE *fp = fopen(trace_fn, "r");
 
-        end = dfs;
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open trace file '%s'!\n", trace_fn);
+        return 0;
     }
-    else
+
+    /* Map open handles to file IDs */
+    #define MAX_TRACE_HANDLES 64
+    struct { uint32_t handle; int id; } handles[MAX_TRACE_HANDLES];
+    int num_handles = 0;
+
+    uint8_t *placed = calloc(num_files, 1);
+    uint32_t num_placed = 0;
+    uint32_t num_unmatched = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    char *cwd = strdup("");
+
+    while(getline(&line, &line_size, fp) > 0)
     {
-        dfs = realloc(dfs, fs_size + rsize);
+        char *ev = strstr(line, "dfs: trace ");
+        if(!ev)
+        {
+            /* Other debug output */
+            continue;
+        }
+        ev += strlen("dfs: trace ");
+        line[strcspn(line, "\r\n")] = 0;
+
+        unsigned long ticks, offset;
+        uint32_t handle;
+        int id = -1, n = 0, len;
+        bool opened = false;
+
+        const char *path = NULL;
+
+        if(sscanf(ev, "chdir %lu %n", &ticks, &n) == 1 && n)
+        {
+            char *newcwd = resolve_path(cwd, ev + n);
+            free(cwd);
+            cwd = newcwd;
+            continue;
+        }
+        else if(sscanf(ev, "open %lu %x %n", &ticks, &handle, &n) == 2 && n)
+        {
+            path = ev + n;
+            id = find_file_by_path(cwd, path);
+            opened = true;
+        }
+        else if(sscanf(ev, "openid %lu %x %d", &ticks, &handle, &id) == 3)
+        {
+            if(id < 0 || id >= num_files) id = -1;
+            opened = true;
+        }
+        else if(sscanf(ev, "addr %lu %n", &ticks, &n) == 1 && n)
+        {
+            path = ev + n;
+            id = find_file_by_path(cwd, path);
+        }
+        else if(sscanf(ev, "addrid %lu %d", &ticks, &id) == 2)
+        {
+            if(id < 0 || id >= num_files) id = -1;
+        }
+        else if(sscanf(ev, "read %lu %x %lu %d", &ticks, &handle, &offset, &len) == 4)
+        {
+            for(int i = num_handles - 1; i >= 0; i--)
+            {
+                if(handles[i].handle == handle)
+                {
+                    id = handles[i].id;
+                    break;
+                }
+            }
+
+            if(id >= 0)
+            {
+                if((num_trace_reads & (num_trace_reads - 1)) == 0)
+                {
+                    trace_reads = realloc(trace_reads, (num_trace_reads ? num_trace_reads * 2 : 16) * sizeof(trace_read_t));
+                }
+                trace_reads[num_trace_reads++] = (trace_read_t){ id, offset, len };
+            }
+        }
+
+        if(path && id < 0)
+        {
+            fprintf(stderr, "WARNING: trace: '%s' (in '/%s') does not match any file in the filesystem\n", path, cwd);
+            num_unmatched++;
+        }
+
+        if(opened)
+        {
+            /* Remember the file opened with this handle (handles are reused
+               after close, so the most recent one wins) */
+            if(num_handles == MAX_TRACE_HANDLES)
+            {
+                memmove(handles, handles + 1, sizeof(handles[0]) * --num_handles);
+            }
+            handles[num_handles].handle = handle;
+            handles[num_handles].id = id;
+            num_handles++;
+        }
 
-        end = dfs + fs_size;
-        fs_size += rsize;
+        if(id >= 0)
+        {
+            /* Files with identical contents share the same payload */
+            if(files[id].dup_of >= 0)
+            {
+                id = files[id].dup_of;
+            }
+            if(!placed[id])
+            {
+                placed[id] = 1;
+                order[num_placed++] = id;
+            }
+        }
     }
 
-    /* Zero out last bytes */
-    memset(end, 0, rsize);
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        if(!placed[i])
+        {
+            order[num_placed++] = i;
+        }
+    }
 
-    return sector_offset(end);    
-}
+    if(num_unmatched)
+    {
+        fprintf(stderr, "WARNING: trace: %u accesses do not match any file, and were ignored\n", num_unmatched);
+    }
 
-/* Add a new sector to the filesystem, return that sector pointer */
-uint32_t new_sector(void)
-{
-    return dfs_alloc(SECTOR_SIZE);
+    free(cwd);
+    free(line);
+    free(placed);
+    fclose(fp);
+    return 1;
 }
 
-uint32_t new_blob(int size)
+/* Count the reads of the trace that cannot be served by continuing the
+   previous one: a read is contiguous if it starts where the previous read
+   ended, or if it starts at the beginning of the file laid out right after
+   the previous one (only the alignment padding is skipped). */
+uint32_t count_discontiguous_reads(void)
 {
-    return dfs_alloc(size);    
-}
+    uint32_t *pos = malloc(num_files * sizeof(uint32_t));
+    uint32_t count = 0;
+    uint32_t prev_end = 0;
+    int prev_owner = -1;
 
-void kill_fs()
-{
-    if(dfs)
+    for(uint32_t i = 0; i < num_files; i++)
     {
-        free(dfs);
+        pos[layout_order[i]] = i;
+    }
+
+    for(uint32_t i = 0; i < num_trace_reads; i++)
+    {
+        trace_read_t *r = &trace_reads[i];
+        int owner = files[r->id].dup_of >= 0 ? files[r->id].dup_of : (int)r->id;
+        uint32_t start = files[owner].file_pointer + r->offset;
+
+        if(prev_owner < 0 ||
+           (start != prev_end && !(r->offset == 0 && pos[owner] == pos[prev_owner] + 1)))
+        {
+            count++;
+        }
+        prev_end = start + r->len;
+        prev_owner = owner;
     }
+
+    free(pos);
+    return count;
 }
 
-void print_help(const char * const prog_name)
+/* Write zero bytes to pad the output */
+int write_padding(FILE *out, uint32_t size)
 {
-    fprintf(stderr, "Usage: %s <File> <Directory>\n", prog_name);
-    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
-    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    static const uint8_t zero[4096] = {0};
+
+    while(size)
+    {
+        uint32_t n = MIN(size, sizeof(zero));
+        if(fwrite(zero, 1, n, out) != n)
+        {
+            return 0;
+        }
+        size -= n;
+    }
+
+    return 1;
 }
 
-uint32_t add_file(const char * const file, uint32_t *size)
+/* Copy the payload of a file into the output, return 0 on failure */
+int write_payload(FILE *out, file_entry_t *f)
 {
-    FILE *fp;
+    static uint8_t buf[64*1024];
+    uint32_t copied = 0;
+    FILE *in = fopen(f->src, "rb");
+
+    if(!in)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", f->src);
+        return 0;
+    }
+
+#ifdef HAVE_COPY_FILE_RANGE
+    /* Flush our buffered output, and let the kernel do the copy. If it is not
+       supported (eg: across filesystems on older kernels), just fall back
+       to a normal copy of the remaining data. */
+    fflush(out);
+    while(copied < f->size)
+    {
+        ssize_t n = copy_file_range(fileno(in), NULL, fileno(out), NULL, f->size - copied, 0);
+        if(n <= 0)
+        {
+            break;
+        }
+        copied += n;
+    }
 
-    printf("Adding '%s' to filesystem image.\n", file);
+    /* Resync the stdio streams with the underlying file descriptors */
+    fseek(out, 0, SEEK_END);
+    fseek(in, copied, SEEK_SET);
+#endif
+
+    while(copied < f->size)
+    {
+        uint32_t n = fread(buf, 1, MIN(f->size - copied, sizeof(buf)), in);
+        if(n == 0 || fwrite(buf, 1, n, out) != n)
+        {
+            fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", f->src);
+            fclose(in);
+            return 0;
+        }
+        copied += n;
+    }
+
+    fclose(in);
+    return 1;
+}
 
-    fp = fopen(file, "rb");
+/* Write the whole image: metadata first, then the payloads of all files */
+int write_image(const char * const outfn)
+{
+    FILE *fp = fopen(outfn, "wb");
 
     if(!fp)
     {
-        fprintf(stderr, "Cannot open file '%s' for read!\n", file);
+        /* Error writing file out */
+        fprintf(stderr, "Error opening '%s' for writing.\n", outfn);
         return 0;
     }
 
-    fseek(fp, 0, SEEK_END);
-    *size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    uint32_t cur = fs_size;
+    int ok = fwrite(dfs, 1, fs_size, fp) == fs_size;
 
-    if (*size > 0x0FFFFFFF)
+    for(uint32_t i = 0; ok && i < num_files; i++)
     {
-        fprintf(stderr, "File '%s' too big for the filesystem!\n", file);
-        return 0;
+        file_entry_t *f = &files[layout_order[i]];
+
+        if(f->dup_of >= 0)
+        {
+            continue;
+        }
+
+        ok = write_padding(fp, f->file_pointer - cur) && write_payload(fp, f);
+        cur = f->file_pointer + f->size;
     }
 
-    uint32_t blob = new_blob(*size);
-    uint8_t *data = sector_to_memory(blob);
+    if(ok)
+    {
+        ok = write_padding(fp, image_size - cur);
+    }
 
-    int read = fread(data, 1, *size, fp);
-    if (read < 0) {
-        /* Wat? */
-        fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", file);
-        fclose(fp);
-        return 0;    
+    if(fclose(fp) != 0 || !ok)
+    {
+        fprintf(stderr, "Error writing '%s'.\n", outfn);
+        remove(outfn);
+        return 0;
     }
 
-    fclose(fp);
-    return blob;
+    return 1;
 }
 
-uint32_t add_directory(const char * const path)
+uint32_t add_directory(const char * const path, const char * const dfs_path)
 {
     directory_entry_t *tmp_entry;
     uint32_t first_entry = 0;
@@ -173,27 +1172,33 @@ uint32_t add_directory(const char * const path)
 
                 if(S_ISREG(stats.st_mode))
                 {
+                    printf("Adding '%s' to filesystem image.\n", file);
+
+                    if (stats.st_size > 0x0FFFFFFF)
+                    {
+                        fprintf(stderr, "File '%s' too big for the filesystem!\n", file);
+                        free(file);
+                        return 0;
+                    }
+
                     uint32_t new_entry = new_sector();
-                    uint32_t file_size = 0;
+                    uint32_t file_size = stats.st_size;
 
                     tmp_entry = sector_to_memory(new_entry);
                     tmp_entry->next_entry = 0;
+                    tmp_entry->flags = SWAPLONG((FLAGS_FILE << 28) | (file_size & 0x0FFFFFFF));
 
                     /* Copy over filename */
                     strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
                     tmp_entry->path[MAX_FILENAME_LEN] = 0;
 
-                    uint32_t new_file = add_file(file, &file_size);
-
-                    if(!new_file)
-                    {
-                        free(file);
-                        return 0;
-                    }
+                    /* Full path within the filesystem (with the truncated name) */
+                    char *full_path = malloc(strlen(dfs_path) + strlen(tmp_entry->path) + 2);
+                    sprintf(full_path, "%s%s%s", dfs_path, dfs_path[0] ? "/" : "", tmp_entry->path);
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->file_pointer = SWAPLONG(new_file);
-                    tmp_entry->flags = SWAPLONG((FLAGS_FILE << 28) | (file_size & 0x0FFFFFFF));
+                    /* The payload is laid out later (see layout_files) */
+                    file_add(file, full_path, file_size, new_entry);
+                    free(full_path);
 
                     if(cur_entry)
                     {
@@ -217,7 +1222,11 @@ uint32_t add_directory(const char * const path)
                     strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
                     tmp_entry->path[MAX_FILENAME_LEN] = 0;
 
-                    uint32_t new_directory = add_directory(file);
+                    char *sub_path = malloc(strlen(dfs_path) + strlen(tmp_entry->path) + 2);
+                    sprintf(sub_path, "%s%s%s", dfs_path, dfs_path[0] ? "/" : "", tmp_entry->path);
+
+                    uint32_t new_directory = add_directory(file, sub_path);
+                    free(sub_path);
 
                     if(!new_directory)
                     {
@@ -259,12 +1268,127 @@ uint32_t add_directory(const char * const path)
 
 int main(int argc, char *argv[])
 {
-    if(argc != 3)
+    int emit_index = 1;
+    int dedup = 1;
+    int verbose = 0;
+    const char *header_fn = NULL;
+    const char *trace_fn = NULL;
+    int i = 1;
+
+    for(; i < argc && argv[i][0] == '-'; i++)
+    {
+        if(!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose"))
+        {
+            verbose = 1;
+        }
+        else if(!strcmp(argv[i], "--no-index"))
+        {
+            emit_index = 0;
+        }
+        else if(!strcmp(argv[i], "--no-dedup"))
+        {
+            dedup = 0;
+        }
+        else if(!strcmp(argv[i], "--align"))
+        {
+            if(++i == argc)
+            {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return -1;
+            }
+            default_rule.align = parse_align(argv[i]);
+            if(!default_rule.align)
+            {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                return -1;
+            }
+        }
+        else if(!strcmp(argv[i], "--align-rule"))
+        {
+            if(++i == argc)
+            {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return -1;
+            }
+
+            char *eq = strrchr(argv[i], '=');
+            if(!eq || eq == argv[i] || num_align_rules == MAX_ALIGN_RULES)
+            {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                return -1;
+            }
+
+            align_rule_t *rule = &align_rules[num_align_rules++];
+            rule->pattern = strndup(argv[i], eq - argv[i]);
+            rule->align = parse_align(eq + 1);
+            if(!rule->align)
+            {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                return -1;
+            }
+        }
+        else if(!strcmp(argv[i], "--compress"))
+        {
+            if(++i == argc)
+            {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return -1;
+            }
+
+            char *eq = strrchr(argv[i], '=');
+            char extra;
+            compress_rule_t *rule = &compress_rules[num_compress_rules];
+            if(!eq || eq == argv[i] || num_compress_rules == MAX_COMPRESS_RULES ||
+               sscanf(eq + 1, "%d%c", &rule->level, &extra) != 1 || rule->level < 0 || rule->level > 2)
+            {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                fprintf(stderr, "supported levels: 0 (none), 1 (LZ4), 2 (aPLib)\n");
+                return -1;
+            }
+            rule->pattern = strndup(argv[i], eq - argv[i]);
+            num_compress_rules++;
+        }
+        else if(!strcmp(argv[i], "--order-from-trace"))
+        {
+            if(++i == argc)
+            {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return -1;
+            }
+            trace_fn = argv[i];
+        }
+        else if(!strcmp(argv[i], "--header"))
+        {
+            if(++i == argc)
+            {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return -1;
+            }
+            header_fn = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "invalid flag: %s\n", argv[i]);
+            print_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if(argc - i != 2)
     {
         print_help(argv[0]);
         return -1;
     }
 
+    if(header_fn && !emit_index)
+    {
+        fprintf(stderr, "--header requires the path index, it cannot be used with --no-index\n");
+        return -1;
+    }
+
+    const char *outfn = argv[i];
+    const char *indir = argv[i+1];
+
     /* Add in identifier */
     directory_entry_t *id = sector_to_memory(new_sector());
 
@@ -279,31 +1403,101 @@ int main(int argc, char *argv[])
     id->next_entry = SWAPLONG(ROOT_NEXT_ENTRY);
     strcpy(id->path, ROOT_PATH);
 
-    if(!add_directory(argv[2]))
+    if(!add_directory(indir, ""))
     {
         /* Error adding directory */
-        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", argv[2]);
+        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", indir);
 
         kill_fs();
 
         return -1;
     }
 
-    /* Write out filesystem */
-    FILE *fp = fopen(argv[1], "wb");
+    if(num_compress_rules && !compress_files(outfn))
+    {
+        kill_fs();
+        return -1;
+    }
 
-    if(!fp)
+    uint32_t index = 0;
+
+    if(emit_index)
     {
-        /* Error writing file out */
-        fprintf(stderr, "Error opening '%s' for writing.\n", argv[1]);
+        /* Link the path index from the root sector */
+        index = add_index();
+
+        if(!index)
+        {
+            kill_fs();
+            return -1;
+        }
+
+        id = sector_to_memory(0);
+        id->file_pointer = SWAPLONG(index);
+    }
 
+    if(dedup && !dedup_files())
+    {
         kill_fs();
+        return -1;
+    }
+
+    /* All metadata is now in place: the payloads go after it */
+    dfs_alloc(0, META_ALIGN, &meta_padding);
+
+    layout_order = malloc(num_files * sizeof(uint32_t));
+    for(uint32_t i = 0; i < num_files; i++)
+    {
+        layout_order[i] = i;
+    }
+    layout_files();
+
+    if(trace_fn)
+    {
+        uint32_t *order = malloc(num_files * sizeof(uint32_t));
+
+        if(!order_from_trace(trace_fn, order))
+        {
+            free(order);
+            kill_fs();
+            return -1;
+        }
+
+        uint32_t before = count_discontiguous_reads();
+        free(layout_order);
+        layout_order = order;
+        layout_files();
+
+        if(verbose)
+        {
+            printf("\nTrace: %u reads, discontiguous reads: %u before reordering, %u after\n",
+                num_trace_reads, before, count_discontiguous_reads());
+        }
+    }
+
+    if(index)
+    {
+        write_index(index);
+    }
 
+    if(header_fn && !write_header(header_fn))
+    {
+        kill_fs();
         return -1;
     }
 
-    fwrite(dfs, 1, fs_size, fp);
-    fclose(fp);
+    if(verbose)
+    {
+        print_layout_summary();
+    }
+
+    /* Write out filesystem */
+    if(!write_image(outfn))
+    {
+        kill_fs();
+
+        return -1;
+    }
 
     kill_fs();
 
@@ -0,0 +1,406 @@
+/**
+ * @file atlas.c
+ * @brief Texture atlas packer for mksprite
+ *
+ * In atlas mode, mksprite packs a set of input images into one or more
+ * sheets, each written as a normal sprite file. Images are placed using a
+ * skyline bin-packer, with their horizontal position and width rounded to the
+ * 8-byte TMEM line size of the output format, so that each image can be loaded
+ * on its own with a single #rdpq_tex_upload_sub (or through #surface_make_sub)
+ * without wasting TMEM. Images that would not fit in TMEM are rejected.
+ *
+ * Alongside the sheets, a C header is generated with an enum of the images
+ * and a table of their position (sheet index and sub-rectangle). All the
+ * images of a sheet share the same format and palette.
+ */
+
+#include <dirent.h>
+#include <ctype.h>
+
+typedef struct {
+    char *name;             // Image name (input filename without extension)
+    char *infn;             // Input filename
+    image_t img;            // Loaded image
+    int w, h;               // Size of the reserved rectangle (width padded to TMEM alignment)
+    int sheet;              // Sheet containing the image
+    int x, y;               // Position in the sheet
+} atlas_image_t;
+
+typedef struct {
+    int x, y, w;            // Segment of the skyline: [x, x+w) is free above y
+} skyline_node_t;
+
+typedef struct {
+    skyline_node_t *nodes;  // Skyline segments, sorted by x
+    int num_nodes;          // Number of segments
+    int used_w, used_h;     // Bounding box of the placed images
+} atlas_sheet_t;
+
+typedef struct {
+    const char *name;       // Name of the atlas
+    atlas_image_t *images;  // Images to pack
+    int num_images;         // Number of images
+    atlas_sheet_t *sheets;  // Sheets created by the packer
+    int num_sheets;         // Number of sheets
+} atlas_t;
+
+static void atlas_add_image(atlas_t *atlas, const char *infn)
+{
+    const char *basename = strrchr(infn, '/');
+    if (!basename) basename = infn; else basename += 1;
+    char *name = strdup(basename);
+    char *ext = strrchr(name, '.');
+    if (ext) *ext = '\0';
+
+    atlas->images = realloc(atlas->images, (atlas->num_images+1) * sizeof(atlas_image_t));
+    atlas->images[atlas->num_images++] = (atlas_image_t){ .name = name, .infn = strdup(infn) };
+}
+
+static int strcmp_ptr(const void *a, const void *b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+/** @brief Add an input to the atlas: either a PNG file, or a directory of PNG files */
+bool atlas_add_input(atlas_t *atlas, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "ERROR: file %s does not exist\n", path);
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        atlas_add_image(atlas, path);
+        return true;
+    }
+
+    // Add all the PNG files in the directory, sorted by name so that the
+    // generated indices do not depend on the filesystem order.
+    DIR *d = opendir(path);
+    if (!d) {
+        fprintf(stderr, "ERROR: cannot open directory %s\n", path);
+        return false;
+    }
+    char **files = NULL; int num_files = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        const char *ext = strrchr(de->d_name, '.');
+        if (!ext || strcasecmp(ext, ".png"))
+            continue;
+        files = realloc(files, (num_files+1) * sizeof(char*));
+        asprintf(&files[num_files++], "%s/%s", path, de->d_name);
+    }
+    closedir(d);
+
+    qsort(files, num_files, sizeof(char*), strcmp_ptr);
+    for (int i=0; i<num_files; i++) {
+        atlas_add_image(atlas, files[i]);
+        free(files[i]);
+    }
+    free(files);
+    return true;
+}
+
+static bool skyline_fit(atlas_sheet_t *sheet, int idx, int w, int h, int sheet_w, int sheet_h, int *out_y)
+{
+    int x = sheet->nodes[idx].x;
+    if (x + w > sheet_w)
+        return false;
+
+    int y = 0;
+    for (int i=idx, left=w; left > 0; i++) {
+        assert(i < sheet->num_nodes);
+        if (sheet->nodes[i].y > y) y = sheet->nodes[i].y;
+        if (y + h > sheet_h)
+            return false;
+        left -= sheet->nodes[i].w;
+    }
+    *out_y = y;
+    return true;
+}
+
+static bool skyline_place(atlas_sheet_t *sheet, int w, int h, int sheet_w, int sheet_h, int *out_x, int *out_y)
+{
+    // Find the position where the image bottom would be lowest (bottom-left heuristic)
+    int best_idx = -1, best_x = 0, best_y = 0;
+    for (int i=0; i<sheet->num_nodes; i++) {
+        int y;
+        if (!skyline_fit(sheet, i, w, h, sheet_w, sheet_h, &y))
+            continue;
+        if (best_idx < 0 || y < best_y) {
+            best_idx = i; best_x = sheet->nodes[i].x; best_y = y;
+        }
+    }
+    if (best_idx < 0)
+        return false;
+
+    // Insert the new segment on top of the image, and trim the segments it covers
+    sheet->nodes = realloc(sheet->nodes, (sheet->num_nodes+1) * sizeof(skyline_node_t));
+    memmove(&sheet->nodes[best_idx+1], &sheet->nodes[best_idx], (sheet->num_nodes - best_idx) * sizeof(skyline_node_t));
+    sheet->nodes[best_idx] = (skyline_node_t){ best_x, best_y + h, w };
+    sheet->num_nodes++;
+
+    for (int i=best_idx+1; i<sheet->num_nodes; ) {
+        skyline_node_t *n = &sheet->nodes[i];
+        int shrink = best_x + w - n->x;
+        if (shrink <= 0)
+            break;
+        n->x += shrink;
+        n->w -= shrink;
+        if (n->w > 0)
+            break;
+        memmove(n, n+1, (sheet->num_nodes - i - 1) * sizeof(skyline_node_t));
+        sheet->num_nodes--;
+    }
+
+    // Merge adjacent segments at the same height
+    for (int i=0; i<sheet->num_nodes-1; ) {
+        if (sheet->nodes[i].y == sheet->nodes[i+1].y) {
+            sheet->nodes[i].w += sheet->nodes[i+1].w;
+            memmove(&sheet->nodes[i+1], &sheet->nodes[i+2], (sheet->num_nodes - i - 2) * sizeof(skyline_node_t));
+            sheet->num_nodes--;
+        } else {
+            i++;
+        }
+    }
+
+    if (best_x + w > sheet->used_w) sheet->used_w = best_x + w;
+    if (best_y + h > sheet->used_h) sheet->used_h = best_y + h;
+    *out_x = best_x;
+    *out_y = best_y;
+    return true;
+}
+
+static atlas_image_t *sort_images;
+static int atlas_sort_cmp(const void *a, const void *b)
+{
+    // Place tallest images first, then widest. Fall back to the name to get
+    // a deterministic layout.
+    const atlas_image_t *ia = &sort_images[*(const int*)a];
+    const atlas_image_t *ib = &sort_images[*(const int*)b];
+    if (ia->h != ib->h) return ib->h - ia->h;
+    if (ia->w != ib->w) return ib->w - ia->w;
+    return strcmp(ia->name, ib->name);
+}
+
+static void atlas_c_identifier(char *dst, const char *src, bool upper)
+{
+    if (isdigit((unsigned char)*src))
+        *dst++ = '_';
+    for (; *src; src++) {
+        unsigned char c = *src;
+        *dst++ = !isalnum(c) ? '_' : upper ? toupper(c) : tolower(c);
+    }
+    *dst = '\0';
+}
+
+static bool atlas_write_header(atlas_t *atlas, const char *outdir, tex_format_t fmt)
+{
+    char *outfn;
+    asprintf(&outfn, "%s/%s_atlas.h", outdir, atlas->name);
+    FILE *out = fopen(outfn, "w");
+    if (!out) {
+        fprintf(stderr, "ERROR: cannot open output file %s\n", outfn);
+        free(outfn);
+        return false;
+    }
+
+    char prefix[256], varname[256], ident[512];
+    atlas_c_identifier(prefix, atlas->name, true);
+    atlas_c_identifier(varname, atlas->name, false);
+
+    fprintf(out, "// Generated by mksprite -- do not edit\n");
+    fprintf(out, "// Atlas \"%s\": %d images in %d sheets (format: %s)\n", atlas->name,
+        atlas->num_images, atlas->num_sheets, tex_format_name(fmt));
+    fprintf(out, "#ifndef __%s_ATLAS_H\n", prefix);
+    fprintf(out, "#define __%s_ATLAS_H\n\n", prefix);
+    fprintf(out, "#include <stdint.h>\n\n");
+    fprintf(out, "#ifndef __MKSPRITE_ATLAS_ENTRY_T\n");
+    fprintf(out, "#define __MKSPRITE_ATLAS_ENTRY_T\n");
+    fprintf(out, "/** @brief Position of an image within an atlas (see mksprite --atlas) */\n");
+    fprintf(out, "typedef struct {\n");
+    fprintf(out, "    const char *name;       ///< Name of the image (input filename without extension)\n");
+    fprintf(out, "    uint8_t sheet;          ///< Index of the sheet containing the image\n");
+    fprintf(out, "    uint16_t s0, t0;        ///< Top-left corner of the image in the sheet\n");
+    fprintf(out, "    uint16_t s1, t1;        ///< Bottom-right *exclusive* corner of the image in the sheet\n");
+    fprintf(out, "} atlas_entry_t;\n");
+    fprintf(out, "#endif\n\n");
+
+    fprintf(out, "#define %s_NUM_SHEETS %d\n\n", prefix, atlas->num_sheets);
+    fprintf(out, "/** @brief Sheet filenames (relative to the output directory of mksprite) */\n");
+    fprintf(out, "static const char *%s_sheets[%s_NUM_SHEETS] = {\n", varname, prefix);
+    for (int i=0; i<atlas->num_sheets; i++)
+        fprintf(out, "    \"%s.%d.sprite\",\n", atlas->name, i);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "enum {\n");
+    char **idents = calloc(atlas->num_images, sizeof(char*));
+    for (int i=0; i<atlas->num_images; i++) {
+        atlas_c_identifier(ident, atlas->images[i].name, true);
+
+        // Different names could map to the same identifier (eg: "a-b" and "a_b"),
+        // or clash with the trailing COUNT entry.
+        bool clash = !strcmp(ident, "COUNT");
+        for (int j=0; j<i && !clash; j++)
+            clash = !strcmp(idents[j], ident);
+        if (clash) {
+            sprintf(ident + strlen(ident), "_%d", i);
+            fprintf(stderr, "WARNING: atlas %s: identifier for image \"%s\" renamed to %s_%s\n",
+                atlas->name, atlas->images[i].name, prefix, ident);
+        }
+
+        idents[i] = strdup(ident);
+        fprintf(out, "    %s_%s,\n", prefix, ident);
+    }
+    for (int i=0; i<atlas->num_images; i++)
+        free(idents[i]);
+    free(idents);
+    fprintf(out, "    %s_COUNT\n", prefix);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const atlas_entry_t %s_entries[%s_COUNT] = {\n", varname, prefix);
+    for (int i=0; i<atlas->num_images; i++) {
+        atlas_image_t *img = &atlas->images[i];
+        fprintf(out, "    { \"%s\", %d, %d, %d, %d, %d },\n", img->name, img->sheet,
+            img->x, img->y, img->x + img->img.width, img->y + img->img.height);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "#endif\n");
+
+    fclose(out);
+    if (flag_verbose)
+        fprintf(stderr, "atlas: wrote index %s\n", outfn);
+    free(outfn);
+    return true;
+}
+
+/**
+ * @brief Pack all the images of the atlas into sheets, and write them
+ *
+ * @param atlas         Atlas to build
+ * @param outdir        Output directory
+ * @param pm            Conversion parameters (the output format applies to all the sheets)
+ * @param compression   Compression level for the sheets
+ * @param sheet_w       Maximum width of a sheet
+ * @param sheet_h       Maximum height of a sheet
+ * @return int          0 on success, 1 on error
+ */
+int atlas_convert(atlas_t *atlas, const char *outdir, const parms_t *pm, int compression, int sheet_w, int sheet_h)
+{
+    tex_format_t fmt = pm->outfmt;
+    if (fmt == FMT_NONE) fmt = FMT_RGBA16;
+    if ((int)fmt == FMT_ZBUF || (int)fmt == FMT_IHQ) {
+        fprintf(stderr, "ERROR: format %s is not supported in atlas mode\n", tex_format_name(fmt));
+        return 1;
+    }
+    bool is_ci = (fmt == FMT_CI8 || fmt == FMT_CI4);
+
+    // Images are placed at multiples of 8 bytes in TMEM line (and RDRAM row)
+    int align = TEX_FORMAT_BYTES2PIX(fmt, 8);
+    int max_tmem = is_ci ? 2048 : 4096;
+
+    int bpp = 0;
+    LodePNGColorType ct = LCT_RGBA;
+    for (int i=0; i<atlas->num_images; i++) {
+        atlas_image_t *img = &atlas->images[i];
+        for (int j=0; j<i; j++) {
+            if (!strcmp(atlas->images[j].name, img->name)) {
+                fprintf(stderr, "ERROR: %s: duplicated image name in atlas: %s\n", img->infn, img->name);
+                return 1;
+            }
+        }
+
+        // Palettized sheets are quantized as a whole after packing, so
+        // load the single images as RGBA.
+        palette_t pal;
+        if (!load_png_image(img->infn, is_ci ? FMT_RGBA32 : fmt, &img->img, &pal))
+            return 1;
+        if (i == 0) {
+            ct = img->img.ct;
+            bpp = ct == LCT_RGBA ? 4 : ct == LCT_GREY_ALPHA ? 2 : 1;
+        }
+        assert(img->img.ct == ct);
+
+        img->w = ROUND_UP(img->img.width, align);
+        img->h = img->img.height;
+        int tmem_usage = calc_tmem_usage(fmt, img->w, img->h);
+        if (tmem_usage > max_tmem) {
+            fprintf(stderr, "ERROR: %s: image too big to fit in TMEM (%d bytes as %s)\n", img->infn, tmem_usage, tex_format_name(fmt));
+            return 1;
+        }
+        if (img->w > sheet_w || img->h > sheet_h) {
+            fprintf(stderr, "ERROR: %s: image (%dx%d) is bigger than the atlas sheet size (%dx%d)\n", img->infn, img->w, img->h, sheet_w, sheet_h);
+            return 1;
+        }
+    }
+
+    // Pack the images, opening a new sheet whenever one doesn't fit in the current ones
+    int *order = malloc(atlas->num_images * sizeof(int));
+    for (int i=0; i<atlas->num_images; i++) order[i] = i;
+    sort_images = atlas->images;
+    qsort(order, atlas->num_images, sizeof(int), atlas_sort_cmp);
+
+    for (int i=0; i<atlas->num_images; i++) {
+        atlas_image_t *img = &atlas->images[order[i]];
+        bool placed = false;
+        for (int s=0; s<atlas->num_sheets && !placed; s++) {
+            if (skyline_place(&atlas->sheets[s], img->w, img->h, sheet_w, sheet_h, &img->x, &img->y)) {
+                img->sheet = s;
+                placed = true;
+            }
+        }
+        if (!placed) {
+            atlas->sheets = realloc(atlas->sheets, (atlas->num_sheets+1) * sizeof(atlas_sheet_t));
+            atlas_sheet_t *sheet = &atlas->sheets[atlas->num_sheets];
+            *sheet = (atlas_sheet_t){0};
+            sheet->nodes = malloc(sizeof(skyline_node_t));
+            sheet->nodes[0] = (skyline_node_t){ 0, 0, sheet_w };
+            sheet->num_nodes = 1;
+            placed = skyline_place(sheet, img->w, img->h, sheet_w, sheet_h, &img->x, &img->y);
+            assert(placed);
+            img->sheet = atlas->num_sheets++;
+        }
+    }
+    free(order);
+
+    // Compose and write each sheet through the normal conversion pipeline
+    for (int s=0; s<atlas->num_sheets; s++) {
+        atlas_sheet_t *sheet = &atlas->sheets[s];
+        int w = sheet->used_w, h = sheet->used_h;
+        uint8_t *pixels = calloc(w * h, bpp);
+        int used_area = 0;
+        for (int i=0; i<atlas->num_images; i++) {
+            atlas_image_t *img = &atlas->images[i];
+            if (img->sheet != s) continue;
+            for (int y=0; y<img->img.height; y++)
+                memcpy(pixels + ((img->y + y) * w + img->x) * bpp,
+                       img->img.image + y * img->img.width * bpp, img->img.width * bpp);
+            used_area += img->img.width * img->img.height;
+        }
+
+        spritemaker_t spr = {0};
+        char *outfn;
+        asprintf(&outfn, "%s/%s.%d.sprite", outdir, atlas->name, s);
+        spr.infn = atlas->name;
+        spr.outfn = outfn;
+        spr.texparms.s.repeats = 1;
+        spr.texparms.t = spr.texparms.s;
+        spr.detail.texparms.s.scale = -1;
+        spr.detail.texparms.s.repeats = 2048;
+        spr.detail.texparms.t = spr.detail.texparms.s;
+        spr.images[0] = (image_t){ .image = pixels, .width = w, .height = h, .fmt = fmt, .ct = ct };
+
+        if (flag_verbose)
+            fprintf(stderr, "atlas: sheet %d: %dx%d, %.1f%% used\n", s, w, h, 100.0f * used_area / (w * h));
+
+        // Mipmaps are disabled as they would blend images together
+        if (spritemaker_process(&spr, pm, MIPMAP_ALGO_NONE) != 0) {
+            free(outfn);
+            return 1;
+        }
+        spritemaker_compress(outfn, compression);
+        free(outfn);
+    }
+
+    return atlas_write_header(atlas, outdir, fmt) ? 0 : 1;
+}
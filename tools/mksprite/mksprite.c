@@ -5,10 +5,16 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 #include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "../common/binout.c"
 #include "../common/binout.h"
+#include "../common/assetcache.c"
 #include "../common/polyfill.h"
+#include "../common/parallel.h"
 #include "exoquant.h"
 
 #define LODEPNG_NO_COMPILE_ANCILLARY_CHUNKS    // No need to parse PNG extra fields
@@ -69,13 +75,33 @@ tex_format_t tex_format_from_name(const char *name) {
     return FMT_NONE;
 }
 
-#define MIPMAP_ALGO_NONE  0
-#define MIPMAP_ALGO_BOX   1
+/** @brief Find a texture format embedded in a filename (eg: "foo.ci4.png"), or FMT_NONE */
+tex_format_t tex_format_from_filename(const char *fn) {
+    tex_format_t fmt = FMT_NONE;
+    char *fntok = strdup(fn);
+    char *sect = strtok(fntok, ".");
+    while (sect) {
+        fmt = tex_format_from_name(sect);
+        if (fmt != FMT_NONE) break;
+        sect = strtok(NULL, ".");
+    }
+    free(fntok);
+    return fmt;
+}
+
+#define MIPMAP_ALGO_NONE    0
+#define MIPMAP_ALGO_BOX     1
+#define MIPMAP_ALGO_KAISER  2
+
+#define ATLAS_DEFAULT_SIZE  256   // Default maximum size of an atlas sheet (--atlas-size)
+
+#define MKSPRITE_CACHE_VERSION  "1" // Version of the output for the asset cache (bump when the output changes)
 
 const char *mipmap_algo_name(int algo) {
     switch (algo) {
     case MIPMAP_ALGO_NONE: return "NONE";
     case MIPMAP_ALGO_BOX: return "BOX";
+    case MIPMAP_ALGO_KAISER: return "KAISER";
     default: assert(0); return "";
     }
 }
@@ -133,7 +159,7 @@ void print_supported_formats(void) {
 }
 
 void print_supported_mipmap(void) {
-    fprintf(stderr, "Supported mipmap algorithms: NONE (disable), BOX\n");
+    fprintf(stderr, "Supported mipmap algorithms: NONE (disable), BOX, KAISER (sharper, slower)\n");
 }
 
 void print_supported_dithers(void) {
@@ -151,6 +177,9 @@ void print_args( char * name )
     fprintf(stderr, "   -D/--dither <dither>  Dithering algorithm (default: NONE)\n");
     fprintf(stderr, "   -c/--compress <level> Compress output files (default: %d)\n", DEFAULT_COMPRESSION);
     fprintf(stderr, "   -d/--debug            Dump computed images (eg: mipmaps) as PNG files in output directory\n");
+    fprintf(stderr, "   -j/--jobs <num>       Convert input files in parallel using <num> processes (0 = one per CPU, default: 1)\n");
+    fprintf(stderr, "   --cache-dir <dir>     Reuse previous conversions stored in the specified cache directory\n");
+    fprintf(stderr, "   --cache-size <MiB>    Maximum size of the cache directory (0 = unlimited, default: %d)\n", (int)(ASSETCACHE_DEFAULT_MAX_SIZE / (1024*1024)));
     fprintf(stderr, "\nSampling flags:\n");
     fprintf(stderr, "   --texparms <x,s,r,m>          Sampling parameters:\n");
     fprintf(stderr, "                                 x=translation, s=scale, r=repetitions, m=mirror\n");
@@ -162,6 +191,14 @@ void print_args( char * name )
     fprintf(stderr, "                                         <fmt> is the output format (default: AUTO)\n");
     fprintf(stderr, "                                         <factor> is the blend factor in range 0..1 (default: 0.5)\n");
     fprintf(stderr, "   --detail-texparms <x,x,s,s,r,r,m,m>   Sampling parameters for the detail texture\n");
+    fprintf(stderr, "\nPalette group flags:\n");
+    fprintf(stderr, "   --palette-group          Quantize all input images (CI4 or CI8) to a single shared palette. An\n");
+    fprintf(stderr, "                            ID (hash of the palette) is stored in each sprite, so that rdpq can skip\n");
+    fprintf(stderr, "                            uploading the palette again when drawing sprites of the group in sequence\n");
+    fprintf(stderr, "\nAtlas flags:\n");
+    fprintf(stderr, "   --atlas <name>           Pack all input images (files or directories of PNGs) into sheets\n");
+    fprintf(stderr, "                            named <name>.<N>.sprite, plus an index header <name>_atlas.h\n");
+    fprintf(stderr, "   --atlas-size <w,h>       Maximum size of a sheet in pixels (default: %d,%d)\n", ATLAS_DEFAULT_SIZE, ATLAS_DEFAULT_SIZE);
     fprintf(stderr, "\n");
     print_supported_formats();
     print_supported_mipmap();
@@ -224,6 +261,8 @@ typedef struct {
     const char *outfn;      // Output file
     image_t images[MAX_IMAGES]; // Pixel images (one per lod level).
     palette_t palette;      // Palette (if any)
+    const palette_t *shared_palette; // Palette shared with other sprites, forced during quantization (if any)
+    uint16_t pal_id;        // ID of the shared palette (0 = palette not shared)
     int vslices;            // Number of vertical slices (deprecated API for old rdp.c)
     int hslices;            // Number of horizontal slices (deprecated API for old rdp.c)
     texparms_t texparms;    // Texture parameters
@@ -289,18 +328,11 @@ bool load_png_image(const char *infn, tex_format_t fmt, image_t *imgout, palette
     // Try first inspecting the extension
     if (fmt == FMT_NONE) {
         // Check the filename string if it contains a texformat for output
-        char *fntok = strdup(infn);
-        char *sect = strtok(fntok, ".");
-        while (sect) {
-            fmt = tex_format_from_name(sect);
-            if (fmt != FMT_NONE) break;
-            sect = strtok(NULL, ".");
-        }
+        fmt = tex_format_from_filename(infn);
         if (fmt != FMT_NONE) {
             if (flag_verbose)
                 fprintf(stderr, "detected format from filename: %s\n", tex_format_name(fmt));
         }
-        free(fntok);
     }
 
     // If we still don't have a format, try to autodetect it from the PNG header
@@ -500,40 +532,199 @@ bool spritemaker_fit_tmem(spritemaker_t *spr, int *out_tmem_usage)
     return tmem_usage <= 4096;
 }
 
-static uint8_t *image_shrink_box(uint8_t *src, int width, int height, bool half_w, bool half_h) {
+/**
+ * @brief Apply a 2x2 box filter to two rows of pixels, producing one row at half width
+ * 
+ * @param dst       Destination row (new_width pixels)
+ * @param src1      First source row (new_width*2 pixels)
+ * @param src2      Second source row (new_width*2 pixels)
+ * @param new_width Width of the destination row in pixels
+ * @param bpp       Bytes per pixel: 4 (RGBA8) or 1 (I8)
+ */
+static void shrink_box_row_2x2(uint8_t *dst, const uint8_t *src1, const uint8_t *src2, int new_width, int bpp) {
+    int n = new_width * bpp;
+    int i = 0;
+
+#ifdef __SSE2__
+    // Process 16 output bytes per iteration, summing with 16-bit precision.
+    // The result is bit-exact with the scalar loop below (truncating division).
+    const __m128i zero = _mm_setzero_si128();
+    if (bpp == 4) {
+        for (; i+16 <= n; i+=16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*)(src1 + i*2));
+            __m128i a1 = _mm_loadu_si128((const __m128i*)(src1 + i*2 + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i*)(src2 + i*2));
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(src2 + i*2 + 16));
+            // Vertical sums: each register holds two pixels (eg: v0 = p0,p1)
+            __m128i v0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+            __m128i v1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+            __m128i v2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+            __m128i v3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+            // Horizontal sums of adjacent pixels (p0+p1, p2+p3, ...)
+            __m128i h0 = _mm_add_epi16(_mm_unpacklo_epi64(v0, v1), _mm_unpackhi_epi64(v0, v1));
+            __m128i h1 = _mm_add_epi16(_mm_unpacklo_epi64(v2, v3), _mm_unpackhi_epi64(v2, v3));
+            _mm_storeu_si128((__m128i*)(dst + i),
+                _mm_packus_epi16(_mm_srli_epi16(h0, 2), _mm_srli_epi16(h1, 2)));
+        }
+    } else {
+        const __m128i lomask = _mm_set1_epi16(0x00FF);
+        for (; i+16 <= n; i+=16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*)(src1 + i*2));
+            __m128i a1 = _mm_loadu_si128((const __m128i*)(src1 + i*2 + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i*)(src2 + i*2));
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(src2 + i*2 + 16));
+            // Seen as 16-bit lanes, even pixels are in the low byte, odd pixels in the high byte
+            __m128i s0 = _mm_add_epi16(
+                _mm_add_epi16(_mm_and_si128(a0, lomask), _mm_srli_epi16(a0, 8)),
+                _mm_add_epi16(_mm_and_si128(b0, lomask), _mm_srli_epi16(b0, 8)));
+            __m128i s1 = _mm_add_epi16(
+                _mm_add_epi16(_mm_and_si128(a1, lomask), _mm_srli_epi16(a1, 8)),
+                _mm_add_epi16(_mm_and_si128(b1, lomask), _mm_srli_epi16(b1, 8)));
+            _mm_storeu_si128((__m128i*)(dst + i),
+                _mm_packus_epi16(_mm_srli_epi16(s0, 2), _mm_srli_epi16(s1, 2)));
+        }
+    }
+#endif
+
+    for (int x=i/bpp; x<new_width; x++) {
+        const uint8_t *s1 = src1 + x*2*bpp;
+        const uint8_t *s2 = src2 + x*2*bpp;
+        for (int c=0; c<bpp; c++)
+            dst[x*bpp + c] = (s1[c] + s1[bpp+c] + s2[c] + s2[bpp+c]) / 4;
+    }
+}
+
+static uint8_t *image_shrink_box(uint8_t *src, int width, int height, int bpp, bool half_w, bool half_h) {
     int new_width = half_w ? width/2 : width;
     int new_height = half_h ? height/2 : height;
-    uint8_t *imgdst = malloc(new_width * new_height * 4);
-    int wstep = half_w ? 8 : 4;
+    uint8_t *imgdst = malloc(new_width * new_height * bpp);
+
+    // Fast path: halve in both directions
+    if (half_w && half_h) {
+        for (int y=0; y<new_height; y++) {
+            uint8_t *src1 = src + y*2*width*bpp;
+            shrink_box_row_2x2(imgdst + y*new_width*bpp, src1, src1 + width*bpp, new_width, bpp);
+        }
+        return imgdst;
+    }
+
+    int wstep = half_w ? bpp*2 : bpp;
     for (int y=0; y<new_height; y++) {
         uint8_t *src1, *src2, *src3, *src4;
         if (half_h) {
-            src1 = src + y*2*width*4;
-            src2 = src1 + width*4;
+            src1 = src + y*2*width*bpp;
+            src2 = src1 + width*bpp;
         } else {
-            src1 = src2 = src + y*width*4;
+            src1 = src2 = src + y*width*bpp;
         }
         if (half_w) {
-            src3 = src1 + 4;
-            src4 = src2 + 4;
+            src3 = src1 + bpp;
+            src4 = src2 + bpp;
         } else {
             src3 = src4 = src1;
         }
-        uint8_t *dst = imgdst + y*new_width*4;
+        uint8_t *dst = imgdst + y*new_width*bpp;
+        for (int x=0; x<new_width; x++) {
+            for (int c=0; c<bpp; c++)
+                dst[c] = (src1[c] + src3[c] + src2[c] + src4[c]) / 4;
+            dst += bpp; src1 += wstep; src2 += wstep; src3 += wstep; src4 += wstep;
+        }
+    }
+    return imgdst;
+}
+
+// Kaiser-windowed sinc filter used for 2:1 downsampling. Each destination
+// pixel is computed from KAISER_TAPS source pixels, centered between the two
+// source pixels that a box filter would average.
+#define KAISER_TAPS     8
+#define KAISER_BETA     4.0f
+
+static float bessel_i0(float x) {
+    // Power series of the modified Bessel function of the first kind (order 0)
+    float sum = 1.0f, term = 1.0f;
+    for (int k=1; k<32; k++) {
+        term *= (x / (2*k)) * (x / (2*k));
+        sum += term;
+        if (term < sum * 1e-9f) break;
+    }
+    return sum;
+}
+
+static void kaiser_weights(float w[KAISER_TAPS]) {
+    const float radius = KAISER_TAPS / 2;
+    float total = 0;
+    for (int k=0; k<KAISER_TAPS; k++) {
+        // Distance from the center, in source pixels (-3.5 ... +3.5)
+        float d = k - (KAISER_TAPS-1) * 0.5f;
+        // Sinc with cutoff at half the source frequency (2:1 decimation)
+        float x = (float)M_PI * d * 0.5f;
+        float sinc = sinf(x) / x;
+        float t = d / radius;
+        float window = bessel_i0(KAISER_BETA * sqrtf(1 - t*t)) / bessel_i0(KAISER_BETA);
+        w[k] = sinc * window;
+        total += w[k];
+    }
+    for (int k=0; k<KAISER_TAPS; k++)
+        w[k] /= total;
+}
+
+static uint8_t *image_shrink_kaiser(uint8_t *src, int width, int height, int bpp) {
+    int new_width = width/2, new_height = height/2;
+    float w[KAISER_TAPS];
+    kaiser_weights(w);
+
+    // The filter is separable: run an horizontal pass into a temporary float
+    // buffer first, and then a vertical pass. Source pixels outside the image
+    // are clamped to the edge.
+    float *tmp = malloc(new_width * height * bpp * sizeof(float));
+    for (int y=0; y<height; y++) {
+        const uint8_t *row = src + y*width*bpp;
+        float *dst = tmp + y*new_width*bpp;
         for (int x=0; x<new_width; x++) {
-            dst[0] = (src1[0] + src3[0] + src2[0] + src4[0]) / 4;
-            dst[1] = (src1[1] + src3[1] + src2[1] + src4[1]) / 4;
-            dst[2] = (src1[2] + src3[2] + src2[2] + src4[2]) / 4;
-            dst[3] = (src1[3] + src3[3] + src2[3] + src4[3]) / 4;
-            dst += 4; src1 += wstep; src2 += wstep; src3 += wstep; src4 += wstep;
+            int offs[KAISER_TAPS];
+            for (int k=0; k<KAISER_TAPS; k++) {
+                int sx = x*2 - (KAISER_TAPS/2 - 1) + k;
+                if (sx < 0) sx = 0;
+                if (sx >= width) sx = width-1;
+                offs[k] = sx*bpp;
+            }
+            for (int c=0; c<bpp; c++) {
+                float v = 0;
+                for (int k=0; k<KAISER_TAPS; k++)
+                    v += row[offs[k] + c] * w[k];
+                *dst++ = v;
+            }
         }
     }
+
+    uint8_t *imgdst = malloc(new_width * new_height * bpp);
+    int pitch = new_width * bpp;
+    for (int y=0; y<new_height; y++) {
+        const float *rows[KAISER_TAPS];
+        for (int k=0; k<KAISER_TAPS; k++) {
+            int sy = y*2 - (KAISER_TAPS/2 - 1) + k;
+            if (sy < 0) sy = 0;
+            if (sy >= height) sy = height-1;
+            rows[k] = tmp + sy*pitch;
+        }
+        uint8_t *dst = imgdst + y*pitch;
+        for (int i=0; i<pitch; i++) {
+            float v = 0;
+            for (int k=0; k<KAISER_TAPS; k++)
+                v += rows[k][i] * w[k];
+            // The sinc lobes can overshoot, so clamp to the valid range
+            int iv = (int)(v + 0.5f);
+            dst[i] = iv < 0 ? 0 : iv > 255 ? 255 : iv;
+        }
+    }
+
+    free(tmp);
     return imgdst;
 }
 
 bool spritemaker_calc_lods(spritemaker_t *spr, int algo) {
     // Calculate mipmap levels
-    assert(algo == MIPMAP_ALGO_BOX);
+    assert(algo == MIPMAP_ALGO_BOX || algo == MIPMAP_ALGO_KAISER);
 
     int tmem_usage;
     if (!spritemaker_fit_tmem(spr, &tmem_usage)) {
@@ -556,40 +747,25 @@ bool spritemaker_calc_lods(spritemaker_t *spr, int algo) {
                 fprintf(stderr, "mipmap: stopping because TMEM full (%d)\n", tmem_usage);
             break;
         }
-        uint8_t *mipmap = NULL;
+        int bpp;
         switch (prev->ct) {
         case LCT_RGBA:
-            mipmap = malloc(mw * mh * 4);
-            for (int y=0;y<mh;y++) {
-                uint8_t *src1 = prev->image + y*prev->width*4*2;
-                uint8_t *src2 = src1 + prev->width*4;
-                uint8_t *dst = mipmap + y*mw*4;
-                for (int x=0;x<mw;x++) {
-                    dst[0] = (src1[0] + src1[4] + src2[0] + src2[4]) / 4;
-                    dst[1] = (src1[1] + src1[5] + src2[1] + src2[5]) / 4;
-                    dst[2] = (src1[2] + src1[6] + src2[2] + src2[6]) / 4;
-                    dst[3] = (src1[3] + src1[7] + src2[3] + src2[7]) / 4;
-                    dst += 4; src1 += 8; src2 += 8;
-                }
-            }
+            bpp = 4;
             break;
         case LCT_GREY:
             assert(prev->fmt == FMT_I8);  // only I8 supported for now
-            mipmap = malloc(mw * mh);
-            for (int y=0;y<mh;y++) {
-                uint8_t *src1 = prev->image + y*prev->width*2;
-                uint8_t *src2 = src1 + prev->width;
-                uint8_t *dst = mipmap + y*mw;
-                for (int x=0;x<mw;x++) {
-                    dst[0] = (src1[0] + src1[1] + src2[0] + src2[1]) / 4;
-                    dst += 1; src1 += 2; src2 += 2;
-                }
-            }
+            bpp = 1;
             break;
         default:
             fprintf(stderr, "ERROR: mipmap calculation for format %s/%s not implemented yet\n", tex_format_name(prev->fmt), colortype_to_string(prev->ct));
             return false;
         }
+        // Each level is always computed from the previous one
+        uint8_t *mipmap;
+        if (algo == MIPMAP_ALGO_KAISER)
+            mipmap = image_shrink_kaiser(prev->image, prev->width, prev->height, bpp);
+        else
+            mipmap = image_shrink_box(prev->image, prev->width, prev->height, bpp, true, true);
         if(!done) {
             if (flag_verbose)
                 fprintf(stderr, "mipmap: generated %dx%d\n", mw, mh);
@@ -778,7 +954,7 @@ bool spritemaker_convert_ihq(spritemaker_t *spr) {
     int height = spr->images[0].height;
 
     // Calculate a first 2x2 mipmap
-    uint8_t *img22 = image_shrink_box(spr->images[0].image, width, height, true, true);
+    uint8_t *img22 = image_shrink_box(spr->images[0].image, width, height, 4, true, true);
     uint8_t *img42 = NULL, *img24 = NULL;
     
     uint8_t *best_rgb_img = NULL;
@@ -792,11 +968,11 @@ bool spritemaker_convert_ihq(spritemaker_t *spr) {
         uint8_t *img; int iw, ih;
         if (dir == 0) {
             if (width % 4) continue;
-            img42 = image_shrink_box(img22, width/2, height/2, true, false);
+            img42 = image_shrink_box(img22, width/2, height/2, 4, true, false);
             img = img42; iw = width/4; ih = height/2;
         } else {
             if (height % 4) continue;
-            img24 = image_shrink_box(img22, width/2, height/2, false, true);
+            img24 = image_shrink_box(img22, width/2, height/2, 4, false, true);
             img = img24; iw = width/2; ih = height/4;
         }
 
@@ -1068,7 +1244,7 @@ bool spritemaker_write(spritemaker_t *spr) {
             if (spr->detail.enabled) flags |= 0x10;
             if (spritemaker_fit_tmem(spr, NULL)) flags |= 0x20;
             w16(out, flags);
-            w16(out, 0); // padding
+            w16(out, spr->pal_id);
             wf32(out, spr->texparms.s.translate);
             wf32(out, spr->texparms.s.repeats);
             w16(out, spr->texparms.s.scale);
@@ -1177,69 +1353,60 @@ void spritemaker_free(spritemaker_t *spr) {
     memset(spr, 0, sizeof(*spr));
 }
 
-int convert(const char *infn, const char *outfn, const parms_t *pm) {
-    if (flag_verbose)
-        fprintf(stderr, "Converting: %s -> %s [fmt=%s tiles=%d,%d mipmap=%s dither=%s]\n",
-            infn, outfn, tex_format_name(pm->outfmt), pm->tilew, pm->tileh, mipmap_algo_name(pm->mipmap_algo), dither_algo_name(pm->dither_algo));
-
-    spritemaker_t spr = {0};
-
-    spr.infn = infn;
-    spr.outfn = outfn;
-    spr.texparms = pm->texparms;
-    if (!spr.texparms.defined) {
-        spr.texparms.s.translate = 0.0f;
-        spr.texparms.s.scale = 0;
-        spr.texparms.s.repeats = 1;
-        spr.texparms.s.mirror = 0;
-        spr.texparms.t = spr.texparms.s;
-    }
-
-    spr.detail.enabled = pm->detail.enabled;
-    spr.detail.use_main_tex = pm->detail.use_main_tex;
-    spr.detail.infn = pm->detail.infn;
-    spr.detail.blend_factor = pm->detail.blend_factor;
-    spr.detail.texparms = pm->detail.texparms;
-    if (!spr.detail.texparms.defined) {
-        spr.detail.texparms.s.translate = 0.0f;
-        spr.detail.texparms.s.scale = -1;
-        spr.detail.texparms.s.repeats = 2048;
-        spr.detail.texparms.s.mirror = 0;
-        spr.detail.texparms.t = spr.detail.texparms.s;
+bool cache_key_parms(assetcache_key_t *key, const parms_t *pm, int compression) {
+    const texparms_t *tp = &pm->texparms;
+    assetcache_key_add_parm(key, "fmt=%d slices=%d,%d tiles=%d,%d mipmap=%d dither=%d compress=%d",
+        pm->outfmt, pm->hslices, pm->vslices, pm->tilew, pm->tileh, pm->mipmap_algo, pm->dither_algo, compression);
+    assetcache_key_add_parm(key, "texparms=%d %a,%d,%a,%d %a,%d,%a,%d", tp->defined,
+        tp->s.translate, tp->s.scale, tp->s.repeats, tp->s.mirror,
+        tp->t.translate, tp->t.scale, tp->t.repeats, tp->t.mirror);
+    if (pm->detail.enabled) {
+        tp = &pm->detail.texparms;
+        assetcache_key_add_parm(key, "detail=%d,%d,%a texparms=%d %a,%d,%a,%d %a,%d,%a,%d",
+            pm->detail.outfmt, pm->detail.use_main_tex, pm->detail.blend_factor, tp->defined,
+            tp->s.translate, tp->s.scale, tp->s.repeats, tp->s.mirror,
+            tp->t.translate, tp->t.scale, tp->t.repeats, tp->t.mirror);
+        if (pm->detail.infn) {
+            // The filename can select the output format (eg: "foo.i4.png")
+            assetcache_key_add_parm(key, "detail_fnfmt=%d", tex_format_from_filename(pm->detail.infn));
+            if (!assetcache_key_add_file(key, pm->detail.infn))
+                return false;
+        }
     }
+    return true;
+}
 
-    int mipmap_algo = pm->mipmap_algo;
-
-    // Load the PNG, passing the desired output format (or FMT_NONE if autodetect).
-    if (!spritemaker_load_png(&spr, pm->outfmt))
-        goto error;
-
-    if (spr.images[0].fmt == FMT_IHQ) {
-        if (!spritemaker_convert_ihq(&spr))
-            goto error;
-        // Compute mipmaps for IHQ
-        mipmap_algo = MIPMAP_ALGO_BOX;
-    } else if (spr.detail.enabled && !spr.detail.use_main_tex) {
-        // Load the detail PNG, passing the desired output format (or FMT_NONE if autodetect).
-        if (!spritemaker_load_detail_png(&spr, pm->detail.outfmt))
+/**
+ * @brief Run the conversion pipeline on a loaded image and write the sprite
+ * 
+ * This computes mipmaps, runs quantization if required by the output format,
+ * and finally writes the sprite to spr->outfn. The sprite is freed in any case.
+ * 
+ * @return 0 on success, 1 on error
+ */
+int spritemaker_process(spritemaker_t *spr, const parms_t *pm, int mipmap_algo) {
+    // With a shared palette, the whole sprite is quantized from scratch, so
+    // throw away the palette of the PNG (if any).
+    if (spr->shared_palette && spr->images[0].ct == LCT_PALETTE) {
+        if (!spritemaker_expand_rgba(spr))
             goto error;
     }
 
     // Calculate mipmap levels, if requested
     if (mipmap_algo != MIPMAP_ALGO_NONE) {
-        switch (spr.images[0].ct) {
+        switch (spr->images[0].ct) {
         case LCT_PALETTE: {
             // Mipmap generation of indexed image. In this case, we want to
             // preserve the original palette for all the mipmaps. To reuse
             // existing code, we expand first to RGBA and then quantize again
             // the original palette.
-            palette_t orig_palette = spr.palette;
-            int fmt_colors = spr.images[0].fmt == FMT_CI8 ? 256 : 16;
+            palette_t orig_palette = spr->palette;
+            int fmt_colors = spr->images[0].fmt == FMT_CI8 ? 256 : 16;
 
             // Expand to RGBA, calc lods, and quantize with the original palette
-            if (!spritemaker_expand_rgba(&spr)
-                || !spritemaker_calc_lods(&spr, mipmap_algo)
-                || !spritemaker_quantize(&spr, orig_palette.colors[0], fmt_colors, pm->dither_algo))
+            if (!spritemaker_expand_rgba(spr)
+                || !spritemaker_calc_lods(spr, mipmap_algo)
+                || !spritemaker_quantize(spr, orig_palette.colors[0], fmt_colors, pm->dither_algo))
                 goto error;
 
             // Restore palette. Notice that spritemake_quantize has already done that
@@ -1247,31 +1414,35 @@ int convert(const char *infn, const char *outfn, const parms_t *pm) {
             // might be shipped with a 64 color palette that the user will use
             // at runtime). So we quantized all lods with the first 16 colors
             // (like the first image), but then we restore the other colors.
-            spr.palette = orig_palette;
+            spr->palette = orig_palette;
         }   break;
 
         default:
-            if (!spritemaker_calc_lods(&spr, mipmap_algo))
+            if (!spritemaker_calc_lods(spr, mipmap_algo))
                 goto error;
             break;
         }
     }
 
     // Run quantization if needed
-    if (spr.images[0].fmt == FMT_CI8 || spr.images[0].fmt == FMT_CI4) {
-        int expected_colors = spr.images[0].fmt == FMT_CI8 ? 256 : 16;
+    if (spr->images[0].fmt == FMT_CI8 || spr->images[0].fmt == FMT_CI4) {
+        int expected_colors = spr->images[0].fmt == FMT_CI8 ? 256 : 16;
 
-        switch (spr.images[0].ct) {
+        if (spr->shared_palette) {
+            assert(spr->images[0].ct == LCT_RGBA);
+            if (!spritemaker_quantize(spr, (uint8_t*)spr->shared_palette->colors[0], spr->shared_palette->num_colors, pm->dither_algo))
+                goto error;
+        } else switch (spr->images[0].ct) {
         case LCT_RGBA:
-            if (!spritemaker_quantize(&spr, NULL, expected_colors, pm->dither_algo))
+            if (!spritemaker_quantize(spr, NULL, expected_colors, pm->dither_algo))
                 goto error;
             break;
         case LCT_PALETTE:
             // When the source image is already palettized, we quantize only if
             // the requested number of colors is less than the actually used colors.
-            if (expected_colors < spr.palette.used_colors) {
-                if (!spritemaker_expand_rgba(&spr) || 
-                    !spritemaker_quantize(&spr, NULL, expected_colors, pm->dither_algo))
+            if (expected_colors < spr->palette.used_colors) {
+                if (!spritemaker_expand_rgba(spr) || 
+                    !spritemaker_quantize(spr, NULL, expected_colors, pm->dither_algo))
                     goto error;
             }
             break;
@@ -1282,43 +1453,130 @@ int convert(const char *infn, const char *outfn, const parms_t *pm) {
 
     // Dump TMEM usage
     if (flag_verbose) {
-        int tmem_usage; spritemaker_fit_tmem(&spr, &tmem_usage);
+        int tmem_usage; spritemaker_fit_tmem(spr, &tmem_usage);
         fprintf(stderr, "TMEM required: %d bytes\n", tmem_usage);
     }
 
     // Legacy support for old mksprite usage
-    if (pm->hslices) spr.hslices = pm->hslices;
-    if (pm->vslices) spr.vslices = pm->vslices;
+    if (pm->hslices) spr->hslices = pm->hslices;
+    if (pm->vslices) spr->vslices = pm->vslices;
     // Autodetection of optimal slice size. NOTE: we currently don't
     // use this in rdpq. rdpq_tex does its own from-scratch calculation,
     // but we could skip some runtime work by doing the same here.
-    if (pm->tilew) spr.hslices = spr.images[0].width / pm->tilew;
-    if (pm->tileh) spr.vslices = spr.images[0].height / pm->tileh;
-    if (!spr.hslices) {
-        spr.hslices = spr.images[0].width / 16;
-        if (!spr.hslices) spr.hslices = 1;
+    if (pm->tilew) spr->hslices = spr->images[0].width / pm->tilew;
+    if (pm->tileh) spr->vslices = spr->images[0].height / pm->tileh;
+    if (!spr->hslices) {
+        spr->hslices = spr->images[0].width / 16;
+        if (!spr->hslices) spr->hslices = 1;
     }
-    if (!spr.vslices) {
-        spr.vslices = spr.images[0].height / 16;
-        if (!spr.vslices) spr.vslices = 1;
+    if (!spr->vslices) {
+        spr->vslices = spr->images[0].height / 16;
+        if (!spr->vslices) spr->vslices = 1;
     }
 
     // Write the sprite
-    if (!spritemaker_write(&spr))
+    if (!spritemaker_write(spr))
         goto error;
 
     // Write debug files
     if (flag_debug)
-        spritemaker_write_pngs(&spr);
+        spritemaker_write_pngs(spr);
 
-    spritemaker_free(&spr);
+    spritemaker_free(spr);
     return 0;
 
 error:
-    spritemaker_free(&spr);
+    spritemaker_free(spr);
     return 1;
 }
 
+void spritemaker_compress(const char *outfn, int compression) {
+    if (!compression)
+        return;
+    struct stat st_decomp = {0}, st_comp = {0};
+    stat(outfn, &st_decomp);
+    asset_compress(outfn, outfn, compression, 0, 0);
+    stat(outfn, &st_comp);
+    if (flag_verbose)
+        fprintf(stderr, "compressed: %s (%d -> %d, ratio %.1f%%)\n", outfn,
+        (int)st_decomp.st_size, (int)st_comp.st_size, 100.0 * (float)st_comp.st_size / (float)(st_decomp.st_size == 0 ? 1 :st_decomp.st_size));
+}
+
+/**
+ * @brief Initialize a sprite and load its input image(s), ready for #spritemaker_process
+ * 
+ * @param spr           Sprite to initialize
+ * @param infn          Input filename
+ * @param outfn         Output filename
+ * @param pm            Conversion parameters
+ * @param mipmap_algo   Returns the mipmap algorithm to use for this sprite
+ * @return true         If the images were loaded successfully
+ * @return false        If there was an error (the sprite is freed)
+ */
+bool spritemaker_load(spritemaker_t *spr, const char *infn, const char *outfn, const parms_t *pm, int *mipmap_algo) {
+    if (flag_verbose)
+        fprintf(stderr, "Converting: %s -> %s [fmt=%s tiles=%d,%d mipmap=%s dither=%s]\n",
+            infn, outfn, tex_format_name(pm->outfmt), pm->tilew, pm->tileh, mipmap_algo_name(pm->mipmap_algo), dither_algo_name(pm->dither_algo));
+
+    memset(spr, 0, sizeof(*spr));
+    spr->infn = infn;
+    spr->outfn = outfn;
+    spr->texparms = pm->texparms;
+    if (!spr->texparms.defined) {
+        spr->texparms.s.translate = 0.0f;
+        spr->texparms.s.scale = 0;
+        spr->texparms.s.repeats = 1;
+        spr->texparms.s.mirror = 0;
+        spr->texparms.t = spr->texparms.s;
+    }
+
+    spr->detail.enabled = pm->detail.enabled;
+    spr->detail.use_main_tex = pm->detail.use_main_tex;
+    spr->detail.infn = pm->detail.infn;
+    spr->detail.blend_factor = pm->detail.blend_factor;
+    spr->detail.texparms = pm->detail.texparms;
+    if (!spr->detail.texparms.defined) {
+        spr->detail.texparms.s.translate = 0.0f;
+        spr->detail.texparms.s.scale = -1;
+        spr->detail.texparms.s.repeats = 2048;
+        spr->detail.texparms.s.mirror = 0;
+        spr->detail.texparms.t = spr->detail.texparms.s;
+    }
+
+    *mipmap_algo = pm->mipmap_algo;
+
+    // Load the PNG, passing the desired output format (or FMT_NONE if autodetect).
+    if (!spritemaker_load_png(spr, pm->outfmt))
+        goto error;
+
+    if (spr->images[0].fmt == FMT_IHQ) {
+        if (!spritemaker_convert_ihq(spr))
+            goto error;
+        // Compute mipmaps for IHQ
+        *mipmap_algo = MIPMAP_ALGO_BOX;
+    } else if (spr->detail.enabled && !spr->detail.use_main_tex) {
+        // Load the detail PNG, passing the desired output format (or FMT_NONE if autodetect).
+        if (!spritemaker_load_detail_png(spr, pm->detail.outfmt))
+            goto error;
+    }
+
+    return true;
+
+error:
+    spritemaker_free(spr);
+    return false;
+}
+
+int convert(const char *infn, const char *outfn, const parms_t *pm) {
+    spritemaker_t spr; int mipmap_algo;
+    if (!spritemaker_load(&spr, infn, outfn, pm, &mipmap_algo))
+        return 1;
+    return spritemaker_process(&spr, pm, mipmap_algo);
+}
+
+#include "atlas.c"
+#include "palgroup.c"
+
 bool cli_parse_texparms(const char *opt, texparms_t *parms)
 {
     char extra;
@@ -1364,6 +1622,12 @@ int main(int argc, char *argv[])
     char *infn = NULL, *outdir = ".", *outfn = NULL;
     parms_t pm = {0}; int compression = -1;
     bool at_least_one_file = false;
+    int num_jobs = 1;
+    char *cache_dir = NULL; int cache_size = ASSETCACHE_DEFAULT_MAX_SIZE / (1024*1024);
+    assetcache_t cache = {0};
+    atlas_t atlas = {0};
+    int atlas_w = ATLAS_DEFAULT_SIZE, atlas_h = ATLAS_DEFAULT_SIZE;
+    palgroup_t palgroup = {0};
 
     if (argc < 2) {
         print_args(argv[0]);
@@ -1385,6 +1649,40 @@ int main(int argc, char *argv[])
         return convert(infn, outfn, &pm);
     }
 
+    // Look for the jobs and cache options first, as they change how each input
+    // file is processed, irrespective of their position on the command line.
+    for (int i = 1; i < argc-1; i++) {
+        if (!strcmp(argv[i], "--cache-dir"))
+            cache_dir = argv[i+1];
+        if (!strcmp(argv[i], "--cache-size")) {
+            char extra;
+            if (sscanf(argv[i+1], "%d%c", &cache_size, &extra) != 1 || cache_size < 0) {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i], argv[i+1]);
+                return 1;
+            }
+        }
+        if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+            char extra;
+            if (sscanf(argv[i+1], "%d%c", &num_jobs, &extra) != 1 || num_jobs < 0) {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i], argv[i+1]);
+                return 1;
+            }
+            if (num_jobs == 0) num_jobs = parallel_num_cpus();
+        }
+    }
+
+    // In parallel mode, each input file is converted by a child process that
+    // receives all the flags that preceded the file on the command line, plus
+    // the cache directory. child_skip marks the arguments that must not be forwarded.
+    // Children use an unlimited cache: eviction runs once here, after they exit,
+    // so that concurrent children never scan and trim the directory.
+    bool *child_skip = calloc(argc, sizeof(bool));
+    parallel_job_t *jobs = NULL; int num_queued = 0;
+    if (num_jobs > 1)
+        jobs = calloc(argc, sizeof(parallel_job_t));
+    if (cache_dir && !assetcache_init(&cache, cache_dir, (uint64_t)cache_size * 1024 * 1024))
+        return 1;
+
     bool error = false;
     /* console arguments */
     for (int i = 1; i < argc; i++) {
@@ -1408,6 +1706,56 @@ int main(int argc, char *argv[])
                 flag_debug = true;
             } 
 
+            /* ---------------- JOBS console argument ------------------- */
+            /* -j/--jobs <num>       Convert input files in parallel (already parsed above)             */
+            else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                child_skip[i-1] = child_skip[i] = true;
+            }
+
+            /* ---------------- ATLAS console arguments ------------------- */
+            /* --atlas <name>           Pack all input images into atlas sheets             */
+            else if (!strcmp(argv[i], "--atlas")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                atlas.name = argv[i];
+            }
+
+            /* --atlas-size <w,h>       Maximum size of a sheet in pixels             */
+            else if (!strcmp(argv[i], "--atlas-size")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char extra;
+                if (sscanf(argv[i], "%d,%d%c", &atlas_w, &atlas_h, &extra) != 2 || atlas_w <= 0 || atlas_h <= 0) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+            }
+
+            /* ---------------- PALETTE GROUP console arguments ------------------- */
+            /* --palette-group          Quantize all input images to a shared palette     */
+            else if (!strcmp(argv[i], "--palette-group")) {
+                palgroup.enabled = true;
+            }
+
+            /* ---------------- CACHE console arguments ------------------- */
+            /* --cache-dir <dir>     Reuse previous conversions stored in the cache (already parsed above) */
+            /* --cache-size <MiB>    Maximum size of the cache directory (already parsed above)            */
+            else if (!strcmp(argv[i], "--cache-dir") || !strcmp(argv[i], "--cache-size")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                child_skip[i-1] = child_skip[i] = true;
+            }
+
             /* ---------------- OUTPUT FILE console argument ------------------- */
             /* -o/--output <dir>     Specify output directory (default: .)             */
             else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
@@ -1455,6 +1803,7 @@ int main(int argc, char *argv[])
                 }
                 if (!strcmp(argv[i], "NONE")) pm.mipmap_algo = MIPMAP_ALGO_NONE;
                 else if (!strcmp(argv[i], "BOX")) pm.mipmap_algo = MIPMAP_ALGO_BOX;
+                else if (!strcmp(argv[i], "KAISER")) pm.mipmap_algo = MIPMAP_ALGO_KAISER;
                 else {
                     fprintf(stderr, "invalid mipmap algorithm: %s\n", argv[i]);
                     print_supported_mipmap();
@@ -1579,7 +1928,16 @@ int main(int argc, char *argv[])
         }
 
         at_least_one_file = true;
+        child_skip[i] = true;
         infn = argv[i];
+
+        // In atlas mode, inputs are collected and packed together at the end
+        if (atlas.name) {
+            if (!atlas_add_input(&atlas, infn))
+                error = true;
+            continue;
+        }
+
         char *basename = strrchr(infn, '/');
         if (!basename) basename = infn; else basename += 1;
         char* basename_noext = strdup(basename);
@@ -1587,26 +1945,106 @@ int main(int argc, char *argv[])
         if (ext) *ext = '\0';
 
         asprintf(&outfn, "%s/%s.sprite", outdir, basename_noext);
+        if (compression == -1)
+            compression = DEFAULT_COMPRESSION;
+
+        // In palette group mode, images are loaded now and converted together at the end
+        if (palgroup.enabled) {
+            if (!palgroup_add(&palgroup, infn, outfn, &pm))
+                error = true;
+            free(outfn);
+            continue;
+        }
 
-        if (convert(infn, outfn, &pm) != 0) {
+        // Palette groups and atlases are collected above, before dispatching
+        // to worker processes: each worker would otherwise compute its own
+        // palette from a subset of the group.
+        if (jobs) {
+            const char **child_argv = calloc(i+6, sizeof(char*));
+            int n = 0;
+            child_argv[n++] = argv[0];
+            if (cache_dir) {
+                child_argv[n++] = "--cache-dir";
+                child_argv[n++] = cache_dir;
+                child_argv[n++] = "--cache-size";
+                child_argv[n++] = "0";
+            }
+            for (int j = 1; j < i; j++)
+                if (!child_skip[j]) child_argv[n++] = argv[j];
+            child_argv[n++] = infn;
+            jobs[num_queued++] = (parallel_job_t){ .name = infn, .argv = child_argv };
+            free(outfn);
+            continue;
+        }
+
+        // Debug mode writes additional files that are not cached, so always convert
+        assetcache_key_t key;
+        bool use_cache = cache.dir && !flag_debug;
+        if (use_cache) {
+            assetcache_key_init(&key, "mksprite", MKSPRITE_CACHE_VERSION);
+            // The input filename can select the output format (eg: "foo.ci4.png")
+            assetcache_key_add_parm(&key, "fnfmt=%d", tex_format_from_filename(infn));
+            use_cache = cache_key_parms(&key, &pm, compression) &&
+                        assetcache_key_add_file(&key, infn);
+        }
+
+        if (use_cache && assetcache_fetch(&cache, &key, outfn)) {
+            if (flag_verbose)
+                fprintf(stderr, "cache hit: %s -> %s\n", infn, outfn);
+        } else if (convert(infn, outfn, &pm) != 0) {
             error = true;
         } else {
-            if (compression == -1)
-                compression = DEFAULT_COMPRESSION;
-            if (compression) {
-                struct stat st_decomp = {0}, st_comp = {0};
-                stat(outfn, &st_decomp);
-                asset_compress(outfn, outfn, compression, 0);
-                stat(outfn, &st_comp);
-                if (flag_verbose)
-                    fprintf(stderr, "compressed: %s (%d -> %d, ratio %.1f%%)\n", outfn,
-                    (int)st_decomp.st_size, (int)st_comp.st_size, 100.0 * (float)st_comp.st_size / (float)(st_decomp.st_size == 0 ? 1 :st_decomp.st_size));
-            }
+            spritemaker_compress(outfn, compression);
+            if (use_cache)
+                assetcache_store(&cache, &key, outfn);
         }
 
         free(outfn);
     }
 
+    if (atlas.name && palgroup.enabled) {
+        fprintf(stderr, "ERROR: --palette-group cannot be used together with --atlas\n");
+        error = true;
+    }
+
+    if (atlas.name && !error) {
+        if (compression == -1)
+            compression = DEFAULT_COMPRESSION;
+        if (!atlas.num_images) {
+            fprintf(stderr, "ERROR: no input images for atlas %s\n", atlas.name);
+            error = true;
+        } else if (atlas_convert(&atlas, outdir, &pm, compression, atlas_w, atlas_h) != 0) {
+            error = true;
+        }
+    }
+
+    if (palgroup.enabled && !error && palgroup.num_entries) {
+        if (palgroup_convert(&palgroup, compression) != 0)
+            error = true;
+    }
+
+    if (jobs) {
+        if (parallel_run(jobs, num_queued, num_jobs, stderr) > 0)
+            error = true;
+        for (int i = 0; i < num_queued; i++)
+            free(jobs[i].argv);
+        free(jobs);
+        if (cache.dir) {
+            assetcache_evict(&cache);
+            // Each child already printed its own hit/miss statistics
+            if (flag_verbose && cache.evictions)
+                fprintf(stderr, "cache: %d evicted (%llu KiB)\n",
+                    cache.evictions, (unsigned long long)(cache.evicted_bytes / 1024));
+        }
+    }
+    free(child_skip);
+
+    if (cache.dir) {
+        assetcache_close(&cache);
+        if (flag_verbose && num_jobs <= 1)
+            assetcache_print_stats(&cache, stderr);
+    }
+
     if (!at_least_one_file) {
         infn = "(stdin)";
         outfn = "(stdout)";
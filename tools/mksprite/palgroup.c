@@ -0,0 +1,123 @@
+/**
+ * @file palgroup.c
+ * @brief Shared palette quantization for a group of sprites
+ *
+ * With --palette-group, mksprite converts all the input images to the same
+ * palette: the images are quantized all at once (as if they were a single
+ * image), and then each of them is written as a separate sprite which embeds
+ * the shared palette. Each sprite also records an ID of the palette, so that
+ * at runtime rdpq can skip uploading the palette again when drawing sprites
+ * with the same palette one after the other.
+ *
+ * The ID is a hash of the palette contents, so that it is consistent across
+ * separate mksprite runs (and incremental rebuilds of part of a group): two
+ * sprites share an ID only if they embed the same palette, barring hash
+ * collisions.
+ */
+
+typedef struct {
+    spritemaker_t spr;      // Loaded sprite
+    parms_t pm;             // Conversion parameters for this sprite
+    int mipmap_algo;        // Mipmap algorithm for this sprite
+} palgroup_entry_t;
+
+typedef struct {
+    bool enabled;               // True if --palette-group was specified
+    palgroup_entry_t *entries;  // Sprites of the group
+    int num_entries;            // Number of sprites
+} palgroup_t;
+
+/** @brief Add an input image to the group, with the parameters in effect for it */
+bool palgroup_add(palgroup_t *group, const char *infn, const char *outfn, const parms_t *pm)
+{
+    group->entries = realloc(group->entries, (group->num_entries+1) * sizeof(palgroup_entry_t));
+    palgroup_entry_t *e = &group->entries[group->num_entries];
+    e->pm = *pm;
+    char *outfn_copy = strdup(outfn);
+    if (!spritemaker_load(&e->spr, infn, outfn_copy, &e->pm, &e->mipmap_algo)) {
+        free(outfn_copy);
+        return false;
+    }
+
+    tex_format_t fmt = e->spr.images[0].fmt;
+    if (fmt != FMT_CI8 && fmt != FMT_CI4) {
+        fprintf(stderr, "ERROR: %s: palette groups require a CI4 or CI8 output format (found: %s)\n", infn, tex_format_name(fmt));
+        spritemaker_free(&e->spr);
+        free(outfn_copy);
+        return false;
+    }
+    if (group->num_entries > 0 && fmt != group->entries[0].spr.images[0].fmt) {
+        fprintf(stderr, "ERROR: %s: all the images of a palette group must use the same format (found: %s, expected: %s)\n",
+            infn, tex_format_name(fmt), tex_format_name(group->entries[0].spr.images[0].fmt));
+        spritemaker_free(&e->spr);
+        free(outfn_copy);
+        return false;
+    }
+
+    // Quantization always starts from the RGBA pixels
+    if (e->spr.images[0].ct == LCT_PALETTE && !spritemaker_expand_rgba(&e->spr)) {
+        spritemaker_free(&e->spr);
+        free(outfn_copy);
+        return false;
+    }
+
+    group->num_entries++;
+    return true;
+}
+
+/**
+ * @brief Compute the shared palette of the group and write all the sprites
+ *
+ * @return int      0 on success, 1 on error
+ */
+int palgroup_convert(palgroup_t *group, int compression)
+{
+    tex_format_t fmt = group->entries[0].spr.images[0].fmt;
+    int num_colors = fmt == FMT_CI8 ? 256 : 16;
+
+    if (flag_verbose)
+        fprintf(stderr, "palette group: quantizing %d images to %d colors\n", group->num_entries, num_colors);
+
+    // Feed all the images to the quantizer, to compute a single palette.
+    // Mipmaps are not computed yet: they are averages of the pixels of the
+    // first level, so they are well represented by its palette anyway.
+    exq_data *exq = exq_init();
+    exq->numBitsPerChannel = 5;   // force calculations using rgb555
+    for (int i=0; i<group->num_entries; i++) {
+        image_t *img = &group->entries[i].spr.images[0];
+        exq_feed(exq, img->image, img->width * img->height);
+    }
+    exq_quantize_hq(exq, num_colors);
+
+    palette_t palette = {0};
+    exq_get_palette(exq, palette.colors[0], num_colors);
+    palette.num_colors = num_colors;
+    palette.used_colors = num_colors;
+    exq_free(exq);
+
+    // Derive the palette ID from its contents (0 means "not shared")
+    uint64_t hash = fnv64(FNV64_OFFSET, palette.colors[0], num_colors * 4);
+    uint16_t pal_id = hash ^ (hash >> 16) ^ (hash >> 32) ^ (hash >> 48);
+    if (pal_id == 0) pal_id = 1;
+    if (flag_verbose)
+        fprintf(stderr, "palette group: palette ID %04x\n", pal_id);
+
+    // Convert each sprite, forcing the shared palette
+    int error = 0;
+    for (int i=0; i<group->num_entries; i++) {
+        palgroup_entry_t *e = &group->entries[i];
+        char *outfn = (char*)e->spr.outfn;
+        e->spr.shared_palette = &palette;
+        e->spr.pal_id = pal_id;
+        if (spritemaker_process(&e->spr, &e->pm, e->mipmap_algo) != 0)
+            error = 1;
+        else
+            spritemaker_compress(outfn, compression);
+        free(outfn);
+    }
+
+    free(group->entries);
+    group->entries = NULL;
+    group->num_entries = 0;
+    return error;
+}